@@ -0,0 +1,606 @@
+/*  image.c - ELF and Intel HEX images for ZPUino
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <elf.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "zpuino.h"
+
+#ifndef EM_ZPU
+#define EM_ZPU           106
+#endif
+
+#define IMAGE_MIN_ADDR   (ZPUINO_SKETCH_OFFSET - 8) /* Below is the bootloader's */
+#define ZERO_RUN_WORDS   64 /* Shorter zero runs are cheaper to just write */
+
+static int read_file(const char *path, uint8_t **buf, size_t *len)
+{
+        struct stat st;
+        ssize_t r;
+        int fd = open(path, O_RDONLY);
+
+        if (fd<0)
+                return -1;
+        if (fstat(fd, &st)<0) {
+                close(fd);
+                return -1;
+        }
+        *buf = malloc(st.st_size + 1);
+        if (*buf==NULL) {
+                close(fd);
+                return -1;
+        }
+        r = read(fd, *buf, st.st_size);
+        close(fd);
+        if (r!=st.st_size) {
+                free(*buf);
+                if (r>=0)
+                        errno = EIO;
+                return -1;
+        }
+        (*buf)[r] = '\0';
+        *len = r;
+        return 0;
+}
+
+int zpuino_image_detect(const char *path)
+{
+        uint8_t magic[4];
+        int r, fd = open(path, O_RDONLY);
+
+        if (fd<0)
+                return 0;
+        r = read(fd, magic, sizeof(magic));
+        close(fd);
+
+        if (r==sizeof(magic) && memcmp(magic, ELFMAG, SELFMAG)==0)
+                return ZPUINO_IMAGE_ELF;
+        if (r>0 && magic[0]==':')
+                return ZPUINO_IMAGE_IHEX;
+        return 0;
+}
+
+static int add_segment(struct zpuino_image *img, uint32_t addr, uint32_t filesz,
+                       uint32_t memsz, const uint8_t *data)
+{
+        struct zpuino_segment *n;
+
+        n = realloc(img->segs, (img->nsegs + 1) * sizeof(*n));
+        if (n==NULL)
+                return -1;
+        img->segs = n;
+        n[img->nsegs].addr = addr;
+        n[img->nsegs].filesz = filesz;
+        n[img->nsegs].memsz = memsz;
+        n[img->nsegs].data = data;
+        img->nsegs++;
+        return 0;
+}
+
+/*
+ * ZPU executables are 32-bit big-endian, so the file holds segment data
+ * in ZPU byte order already. Segments go to their physical address.
+ */
+static int elf_parse(struct zpuino_image *img)
+{
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr*)img->buf;
+        const Elf32_Phdr *ph;
+        uint32_t phoff, off, filesz, memsz;
+        unsigned i, phnum, phentsize;
+
+        if (img->buflen < sizeof(*eh) || eh->e_ident[EI_CLASS]!=ELFCLASS32 ||
+            eh->e_ident[EI_DATA]!=ELFDATA2MSB || be16toh(eh->e_machine)!=EM_ZPU) {
+                errno = ENOEXEC;
+                return -1;
+        }
+        phoff = be32toh(eh->e_phoff);
+        phnum = be16toh(eh->e_phnum);
+        phentsize = be16toh(eh->e_phentsize);
+        if (phentsize < sizeof(*ph) || phoff > img->buflen ||
+            (uint64_t)phnum * phentsize > img->buflen - phoff) {
+                errno = ENOEXEC;
+                return -1;
+        }
+        img->entry = be32toh(eh->e_entry);
+
+        for (i=0; i<phnum; i++) {
+                ph = (const Elf32_Phdr*)(img->buf + phoff + i * phentsize);
+                if (be32toh(ph->p_type)!=PT_LOAD)
+                        continue;
+                off = be32toh(ph->p_offset);
+                filesz = be32toh(ph->p_filesz);
+                memsz = be32toh(ph->p_memsz);
+                if (memsz==0)
+                        continue;
+                if (filesz > memsz || off > img->buflen || filesz > img->buflen - off) {
+                        errno = ENOEXEC;
+                        return -1;
+                }
+                if (add_segment(img, be32toh(ph->p_paddr), filesz, memsz, img->buf + off)<0)
+                        return -1;
+        }
+        return 0;
+}
+
+static int hex_byte(const char *p)
+{
+        static const char digits[] = "0123456789ABCDEFabcdef";
+        const char *h = strchr(digits, p[0]), *l = strchr(digits, p[1]);
+        int hv, lv;
+
+        if (p[0]=='\0' || p[1]=='\0' || h==NULL || l==NULL)
+                return -1;
+        hv = h - digits;
+        lv = l - digits;
+        return ((hv > 15 ? hv - 6 : hv) << 4) | (lv > 15 ? lv - 6 : lv);
+}
+
+static int seg_compare(const void *a, const void *b)
+{
+        const struct zpuino_segment *sa = a, *sb = b;
+
+        return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+/*
+ * Data records are decoded in place, over the text they came from, and
+ * consecutive records are merged into one segment.
+ */
+static int ihex_parse(struct zpuino_image *img)
+{
+        char *line = (char*)img->buf, *next;
+        uint8_t *out = img->buf, *rec;
+        uint32_t base = 0, addr;
+        unsigned i, len, type, sum;
+        int b, done = 0;
+        size_t *offs = NULL, *n;
+        struct zpuino_segment *last;
+
+        for (; line && *line && !done; line = next) {
+                next = strchr(line, '\n');
+                if (next)
+                        *next++ = '\0';
+                if (*line=='\r' || *line=='\0')
+                        continue;
+                if (*line!=':')
+                        goto bad;
+
+                /* Decode the record into "rec", then check it */
+                rec = out;
+                for (i=0; (b = hex_byte(line + 1 + 2*i))>=0; i++)
+                        rec[i] = b;
+                if (i<5 || i!=5u + rec[0])
+                        goto bad;
+                for (sum=0, b=0; b<(int)i; b++)
+                        sum += rec[b];
+                if (sum & 0xFF)
+                        goto bad;
+
+                len = rec[0];
+                addr = base + ((rec[1]<<8) | rec[2]);
+                type = rec[3];
+                switch (type) {
+                case 0:
+                        memmove(out, rec + 4, len);
+                        last = img->nsegs ? &img->segs[img->nsegs - 1] : NULL;
+                        if (last && last->addr + last->filesz==addr &&
+                            offs[img->nsegs - 1] + last->filesz==(size_t)(out - img->buf)) {
+                                last->filesz += len;
+                                last->memsz += len;
+                        } else if (len) {
+                                n = realloc(offs, (img->nsegs + 1) * sizeof(*offs));
+                                if (n==NULL)
+                                        goto fail;
+                                offs = n;
+                                offs[img->nsegs] = out - img->buf;
+                                if (add_segment(img, addr, len, len, NULL)<0)
+                                        goto fail;
+                        }
+                        out += len;
+                        break;
+                case 1:
+                        done = 1;
+                        break;
+                case 2:
+                        base = ((rec[4]<<8) | rec[5]) << 4;
+                        break;
+                case 4:
+                        base = ((rec[4]<<8) | rec[5]) << 16;
+                        break;
+                case 3:
+                        img->entry = (((rec[4]<<8) | rec[5]) << 4) + ((rec[6]<<8) | rec[7]);
+                        break;
+                case 5:
+                        img->entry = (rec[4]<<24) | (rec[5]<<16) | (rec[6]<<8) | rec[7];
+                        break;
+                default:
+                        goto bad;
+                }
+        }
+        if (!done)
+                goto bad;
+
+        for (i=0; i<img->nsegs; i++)
+                img->segs[i].data = img->buf + offs[i];
+        free(offs);
+
+        qsort(img->segs, img->nsegs, sizeof(*img->segs), seg_compare);
+        for (i=1; i<img->nsegs; i++) {
+                if (img->segs[i-1].addr + img->segs[i-1].memsz > img->segs[i].addr) {
+                        errno = ENOEXEC;
+                        return -1;
+                }
+        }
+        return 0;
+bad:
+        errno = ENOEXEC;
+fail:
+        free(offs);
+        return -1;
+}
+
+int zpuino_image_read(const char *path, struct zpuino_image *img)
+{
+        int r;
+
+        memset(img, 0, sizeof(*img));
+        img->format = zpuino_image_detect(path);
+        if (img->format==0) {
+                errno = ENOEXEC;
+                return -1;
+        }
+        if (read_file(path, &img->buf, &img->buflen)<0)
+                return -1;
+
+        r = img->format==ZPUINO_IMAGE_ELF ? elf_parse(img) : ihex_parse(img);
+        if (r<0) {
+                zpuino_image_free(img);
+                return -1;
+        }
+        return 0;
+}
+
+void zpuino_image_free(struct zpuino_image *img)
+{
+        free(img->segs);
+        free(img->buf);
+        memset(img, 0, sizeof(*img));
+}
+
+static int segment_check(struct zpuino *zp, const struct zpuino_segment *seg)
+{
+        if ((seg->addr&3) || seg->addr < IMAGE_MIN_ADDR ||
+            (uint64_t)seg->addr + ((seg->memsz + 3) & ~3) > zpuino_memsize(zp)) {
+                errno = ERANGE;
+                return -1;
+        }
+        return 0;
+}
+
+/* Word i of a segment, in ZPU byte order, zero past the file data */
+static int segment_word_zero(const struct zpuino_segment *seg, size_t i)
+{
+        static const uint8_t zero[4];
+        size_t off = i<<2;
+
+        if (off >= seg->filesz)
+                return 1;
+        return memcmp(seg->data + off, zero, seg->filesz - off < 4 ? seg->filesz - off : 4)==0;
+}
+
+static int segment_put(struct zpuino *zp, const struct zpuino_segment *seg,
+                       size_t from, size_t to, struct zpuino_image_stats *st)
+{
+        size_t full = seg->filesz>>2, words;
+        uint8_t tail[4] = { 0, 0, 0, 0 };
+
+        words = (to < full ? to : full) - from;
+        if (from < full && zpuino_pwrite(zp, seg->data + (from<<2), words<<2,
+                                         seg->addr + (from<<2))!=(ssize_t)(words<<2))
+                return -1;
+        /* A last partial word, padded with the zeroes that follow it */
+        if (to > full && (seg->filesz & 3)) {
+                memcpy(tail, seg->data + (full<<2), seg->filesz & 3);
+                if (zpuino_pwrite(zp, tail, 4, seg->addr + (full<<2))!=4)
+                        return -1;
+        }
+        st->written += (to - from)<<2;
+        return 0;
+}
+
+/*
+ * Runs of at least ZERO_RUN_WORDS zero words, and the zero fill that
+ * ends a segment, are filled inside the device; everything else is
+ * written. Nothing is written between segments.
+ */
+static int segment_write(struct zpuino *zp, const struct zpuino_segment *seg,
+                         struct zpuino_image_stats *st)
+{
+        size_t words = (seg->memsz + 3)>>2;
+        size_t start = 0, i = 0, z;
+
+        while (i < words) {
+                if (!segment_word_zero(seg, i)) {
+                        i++;
+                        continue;
+                }
+                for (z=i; z<words && segment_word_zero(seg, z); z++)
+                        ;
+                if (z - i < ZERO_RUN_WORDS && z < words) {
+                        i = z;
+                        continue;
+                }
+                if (i > start && segment_put(zp, seg, start, i, st)<0)
+                        return -1;
+                if (zpuino_memset(zp, seg->addr + (i<<2), (z - i)<<2, 0)<0)
+                        return -1;
+                st->filled += (z - i)<<2;
+                start = i = z;
+        }
+        if (words > start && segment_put(zp, seg, start, words, st)<0)
+                return -1;
+        return 0;
+}
+
+int zpuino_image_write(struct zpuino *zp, const struct zpuino_image *img,
+                       struct zpuino_image_stats *st)
+{
+        struct zpuino_image_stats dummy;
+        uint32_t lo = 0xFFFFFFFF, hi = 0;
+        unsigned i;
+        int r = 0;
+
+        if (st==NULL)
+                st = &dummy;
+        memset(st, 0, sizeof(*st));
+
+        for (i=0; i<img->nsegs; i++) {
+                if (segment_check(zp, &img->segs[i])<0)
+                        return -1;
+        }
+
+        /* Segment data is in ZPU byte order */
+        if (zpuino_setswap(zp, 1)<0)
+                return -1;
+        for (i=0; i<img->nsegs && r==0; i++) {
+                r = segment_write(zp, &img->segs[i], st);
+                if (img->segs[i].addr < lo)
+                        lo = img->segs[i].addr;
+                if (img->segs[i].addr + img->segs[i].memsz > hi)
+                        hi = img->segs[i].addr + img->segs[i].memsz;
+        }
+        zpuino_setswap(zp, 0);
+
+        st->span = hi > lo ? hi - lo : 0;
+        return r;
+}
+
+int zpuino_image_verify(struct zpuino *zp, const struct zpuino_image *img)
+{
+        static const uint8_t zero[256];
+        const struct zpuino_segment *seg;
+        size_t len, fill, n;
+        uint16_t expected, crc;
+        unsigned i;
+
+        for (i=0; i<img->nsegs; i++) {
+                seg = &img->segs[i];
+                if (segment_check(zp, seg)<0)
+                        return -1;
+                len = (seg->memsz + 3) & ~3;
+                expected = zpuino_crc16(ZPUINO_CRC16_INIT, seg->data, seg->filesz);
+                for (fill = len - seg->filesz; fill; fill -= n) {
+                        n = fill < sizeof(zero) ? fill : sizeof(zero);
+                        expected = zpuino_crc16(expected, zero, n);
+                }
+                if (zpuino_checksum(zp, seg->addr, len, &crc)<0)
+                        return -1;
+                if (crc!=expected) {
+                        errno = EIO;
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Symbol table
+ */
+static unsigned name_hash(const char *name)
+{
+        unsigned h = 2166136261u;
+
+        while (*name)
+                h = (h ^ (uint8_t)*name++) * 16777619u;
+        return h;
+}
+
+static int sym_compare(const void *a, const void *b)
+{
+        const struct zpuino_symbol *sa = a, *sb = b;
+
+        if (sa->addr!=sb->addr)
+                return sa->addr < sb->addr ? -1 : 1;
+        return strcmp(sa->name, sb->name);
+}
+
+/* Globals win over statics of the same name, then the lowest address */
+static int symtab_hash(struct zpuino_symtab *tab)
+{
+        unsigned i, h, *slot;
+
+        for (tab->hashsize=16; tab->hashsize < tab->nsyms*2; tab->hashsize<<=1)
+                ;
+        tab->hash = calloc(tab->hashsize, sizeof(*tab->hash));
+        if (tab->hash==NULL)
+                return -1;
+
+        for (i=0; i<tab->nsyms; i++) {
+                h = name_hash(tab->syms[i].name);
+                for (;; h++) {
+                        slot = &tab->hash[h & (tab->hashsize-1)];
+                        if (*slot==0)
+                                break;
+                        if (strcmp(tab->syms[*slot-1].name, tab->syms[i].name)==0) {
+                                if (tab->syms[i].global && !tab->syms[*slot-1].global)
+                                        *slot = i+1;
+                                slot = NULL;
+                                break;
+                        }
+                }
+                if (slot)
+                        *slot = i+1;
+        }
+        return 0;
+}
+
+int zpuino_symtab_read(const struct zpuino_image *img, struct zpuino_symtab *tab)
+{
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr*)img->buf;
+        const Elf32_Shdr *sh, *strsh;
+        const Elf32_Sym *sym;
+        const char *strtab;
+        uint32_t shoff, off, size, stroff, strsize, name;
+        unsigned i, shnum, shentsize, nsyms, type;
+        struct zpuino_symbol *s;
+
+        memset(tab, 0, sizeof(*tab));
+        if (img->format!=ZPUINO_IMAGE_ELF) {
+                errno = ENOEXEC;
+                return -1;
+        }
+        shoff = be32toh(eh->e_shoff);
+        shnum = be16toh(eh->e_shnum);
+        shentsize = be16toh(eh->e_shentsize);
+        if (shoff==0 || shentsize < sizeof(*sh) || shoff > img->buflen ||
+            (uint64_t)shnum * shentsize > img->buflen - shoff)
+                goto bad;
+
+        for (i=0; i<shnum; i++) {
+                sh = (const Elf32_Shdr*)(img->buf + shoff + i * shentsize);
+                if (be32toh(sh->sh_type)==SHT_SYMTAB)
+                        break;
+        }
+        if (i==shnum) {
+                /* Stripped */
+                errno = ENOENT;
+                return -1;
+        }
+        off = be32toh(sh->sh_offset);
+        size = be32toh(sh->sh_size);
+        if (be32toh(sh->sh_link) >= shnum || off > img->buflen || size > img->buflen - off)
+                goto bad;
+        strsh = (const Elf32_Shdr*)(img->buf + shoff + be32toh(sh->sh_link) * shentsize);
+        stroff = be32toh(strsh->sh_offset);
+        strsize = be32toh(strsh->sh_size);
+        if (stroff > img->buflen || strsize > img->buflen - stroff)
+                goto bad;
+        strtab = (const char*)img->buf + stroff;
+
+        nsyms = size / sizeof(*sym);
+        tab->syms = calloc(nsyms ? nsyms : 1, sizeof(*tab->syms));
+        if (tab->syms==NULL)
+                return -1;
+
+        for (i=0; i<nsyms; i++) {
+                sym = (const Elf32_Sym*)(img->buf + off) + i;
+                type = ELF32_ST_TYPE(sym->st_info);
+                name = be32toh(sym->st_name);
+                if ((type!=STT_OBJECT && type!=STT_FUNC) || be16toh(sym->st_shndx)==SHN_UNDEF ||
+                    name==0 || name >= strsize)
+                        continue;
+                /* read_file() terminates the buffer, so the name ends somewhere */
+                s = &tab->syms[tab->nsyms++];
+                s->name = strtab + name;
+                s->addr = be32toh(sym->st_value);
+                s->size = be32toh(sym->st_size);
+                s->type = type==STT_FUNC ? ZPUINO_SYM_FUNC : ZPUINO_SYM_OBJECT;
+                s->global = ELF32_ST_BIND(sym->st_info)!=STB_LOCAL;
+        }
+        qsort(tab->syms, tab->nsyms, sizeof(*tab->syms), sym_compare);
+
+        if (symtab_hash(tab)<0) {
+                zpuino_symtab_free(tab);
+                return -1;
+        }
+        return 0;
+bad:
+        errno = ENOEXEC;
+        return -1;
+}
+
+void zpuino_symtab_free(struct zpuino_symtab *tab)
+{
+        free(tab->syms);
+        free(tab->hash);
+        memset(tab, 0, sizeof(*tab));
+}
+
+const struct zpuino_symbol *zpuino_symbol_lookup(const struct zpuino_symtab *tab,
+                                                 const char *name)
+{
+        unsigned h, slot;
+
+        if (tab->hashsize==0)
+                return NULL;
+        for (h=name_hash(name);; h++) {
+                slot = tab->hash[h & (tab->hashsize-1)];
+                if (slot==0)
+                        return NULL;
+                if (strcmp(tab->syms[slot-1].name, name)==0)
+                        return &tab->syms[slot-1];
+        }
+}
+
+/*
+ * The symbol of a type that holds addr. Sized symbols hold their extent,
+ * and unsized ones (hand-written assembly) everything up to the next.
+ */
+const struct zpuino_symbol *zpuino_symbol_find(const struct zpuino_symtab *tab,
+                                               uint32_t addr, int type)
+{
+        const struct zpuino_symbol *s;
+        unsigned lo = 0, hi = tab->nsyms, mid;
+
+        /* First symbol above addr */
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (tab->syms[mid].addr <= addr)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        while (lo--) {
+                s = &tab->syms[lo];
+                if (s->type!=type)
+                        continue;
+                if (s->size==0 || addr - s->addr < s->size)
+                        return s;
+                /* Sized and ending before addr: nothing of this type holds it */
+                return NULL;
+        }
+        return NULL;
+}
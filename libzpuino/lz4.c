@@ -0,0 +1,205 @@
+/*  lz4.c - LZ4 block codec
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "zpuino.h"
+
+/*
+ * LZ4 block format, as used inside LZ4 frames: sequences of a token,
+ * literals, a 16-bit little-endian offset and extra match length bytes.
+ * Only what the tools need: a greedy single-pass encoder and a decoder
+ * that supports the history of linked blocks.
+ */
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5  /* The block always ends in literals */
+#define LZ4_MFLIMIT      12 /* No match starts closer to the end */
+#define LZ4_MAXOFFSET    65535
+#define LZ4_HASH_BITS    12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline unsigned lz4_hash(uint32_t v)
+{
+        return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Length field continuation bytes */
+static uint8_t *lz4_put_len(uint8_t *op, size_t len)
+{
+        while (len >= 255) {
+                *op++ = 255;
+                len -= 255;
+        }
+        *op++ = len;
+        return op;
+}
+
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *oend,
+                                 const uint8_t *lit, size_t nlit,
+                                 size_t off, size_t ml)
+{
+        uint8_t *token = op++;
+
+        /* Worst case, including the length bytes */
+        if ((size_t)(oend - op) < nlit + nlit/255 + 1 + 2 + ml/255 + 1)
+                return NULL;
+
+        if (nlit >= 15) {
+                *token = 15<<4;
+                op = lz4_put_len(op, nlit - 15);
+        } else {
+                *token = nlit<<4;
+        }
+        memcpy(op, lit, nlit);
+        op += nlit;
+
+        if (ml==0)
+                return op; /* Last sequence */
+
+        *op++ = off & 0xFF;
+        *op++ = off >> 8;
+        ml -= LZ4_MINMATCH;
+        if (ml >= 15) {
+                *token |= 15;
+                op = lz4_put_len(op, ml - 15);
+        } else {
+                *token |= ml;
+        }
+        return op;
+}
+
+/*
+ * Encode len bytes into dst. Returns the encoded size, or -1 if it does
+ * not fit in dstcap; callers then keep the data uncompressed.
+ */
+long zpuino_lz4_encode(const void *source, size_t len, void *dest, size_t dstcap)
+{
+        const uint8_t *src = (const uint8_t*)source;
+        const uint8_t *ip = src, *anchor = src, *iend = src + len;
+        const uint8_t *mflimit = len > LZ4_MFLIMIT ? iend - LZ4_MFLIMIT : src;
+        const uint8_t *mlimit = iend - LZ4_LASTLITERALS;
+        const uint8_t *match, *p;
+        uint8_t *op = (uint8_t*)dest, *oend = op + dstcap;
+        int32_t table[1<<LZ4_HASH_BITS];
+        unsigned h;
+        uint32_t v;
+
+        memset(table, 0xFF, sizeof(table));
+
+        while (ip < mflimit) {
+                v = read32(ip);
+                h = lz4_hash(v);
+                match = table[h] < 0 ? NULL : src + table[h];
+                table[h] = ip - src;
+
+                if (match==NULL || ip - match > LZ4_MAXOFFSET || read32(match)!=v) {
+                        ip++;
+                        continue;
+                }
+
+                p = ip + LZ4_MINMATCH;
+                match += LZ4_MINMATCH;
+                while (p < mlimit && *p==*match) {
+                        p++;
+                        match++;
+                }
+
+                op = lz4_put_sequence(op, oend, anchor, ip - anchor,
+                                      p - match, p - ip);
+                if (op==NULL)
+                        return -1;
+                ip = anchor = p;
+        }
+
+        op = lz4_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+        if (op==NULL)
+                return -1;
+        return op - (uint8_t*)dest;
+}
+
+/*
+ * Decode one LZ4 block into dst. "hist" bytes right before dst hold
+ * the previous output, which matches may refer to.
+ */
+long zpuino_lz4_decode(const void *source, size_t srclen,
+                       void *dest, size_t dstcap, size_t hist)
+{
+        const uint8_t *src = (const uint8_t*)source;
+        const uint8_t *ip = src, *iend = src + srclen;
+        uint8_t *dst = (uint8_t*)dest;
+        uint8_t *op = dst, *oend = dst + dstcap;
+        const uint8_t *match;
+        size_t lit, ml, off;
+        uint8_t b, token;
+
+        while (ip < iend) {
+                token = *ip++;
+                lit = token >> 4;
+                if (lit==15) {
+                        do {
+                                if (ip>=iend)
+                                        return -1;
+                                b = *ip++;
+                                lit += b;
+                        } while (b==255);
+                }
+                if (lit > (size_t)(iend-ip) || lit > (size_t)(oend-op))
+                        return -1;
+                memcpy(op, ip, lit);
+                op += lit;
+                ip += lit;
+
+                if (ip>=iend)
+                        break; /* Last sequence has no match */
+
+                if (iend-ip < 2)
+                        return -1;
+                off = ip[0] | (ip[1]<<8);
+                ip += 2;
+                if (off==0 || off > (size_t)(op-dst) + hist)
+                        return -1;
+
+                ml = token & 15;
+                if (ml==15) {
+                        do {
+                                if (ip>=iend)
+                                        return -1;
+                                b = *ip++;
+                                ml += b;
+                        } while (b==255);
+                }
+                ml += 4;
+                if (ml > (size_t)(oend-op))
+                        return -1;
+
+                /* Byte copy, matches may overlap the output */
+                match = op - off;
+                while (ml--)
+                        *op++ = *match++;
+        }
+        return op - dst;
+}
@@ -0,0 +1,247 @@
+/*  vars.c - Live access to ZPUino sketch variables
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "zpuino.h"
+
+/*
+ * "symbol", "symbol[index]", or an address, optionally followed by
+ * ":size". The size defaults to the symbol's if it is 1, 2 or 4, and to
+ * a word otherwise; indexes count elements of that size.
+ */
+int zpuino_var_parse(const struct zpuino_symtab *tab, const char *spec, struct zpuino_var *var)
+{
+        const struct zpuino_symbol *sym = NULL;
+        char name[256], *p, *end;
+        unsigned long index = 0, size = 0;
+        uint32_t base;
+
+        if (strlen(spec) >= sizeof(name)) {
+                errno = EINVAL;
+                return -1;
+        }
+        strcpy(name, spec);
+
+        p = strrchr(name, ':');
+        if (p) {
+                *p++ = '\0';
+                size = strtoul(p, &end, 0);
+                if (*end || (size!=1 && size!=2 && size!=4)) {
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+        p = strchr(name, '[');
+        if (p) {
+                *p++ = '\0';
+                index = strtoul(p, &end, 0);
+                if (end==p || strcmp(end, "]")!=0) {
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+
+        if (isdigit((unsigned char)name[0])) {
+                base = strtoul(name, &end, 0);
+                if (*end) {
+                        errno = EINVAL;
+                        return -1;
+                }
+        } else {
+                sym = tab ? zpuino_symbol_lookup(tab, name) : NULL;
+                if (sym==NULL) {
+                        errno = ENOENT;
+                        return -1;
+                }
+                base = sym->addr;
+        }
+        if (size==0)
+                size = sym && (sym->size==1 || sym->size==2) ? sym->size : 4;
+
+        if (sym && sym->size && (uint64_t)(index + 1) * size > sym->size) {
+                errno = ERANGE;
+                return -1;
+        }
+        var->name = spec;
+        var->addr = base + index * size;
+        var->size = size;
+        if (var->addr & (size-1)) {
+                errno = EINVAL;
+                return -1;
+        }
+        return 0;
+}
+
+/* Memory words are big-endian, so the first byte is the top one */
+static inline unsigned var_shift(const struct zpuino_var *v)
+{
+        return (4 - (v->addr&3) - v->size) * 8;
+}
+
+static inline uint32_t var_mask(const struct zpuino_var *v)
+{
+        return (v->size==4 ? 0xFFFFFFFFU : (1U << (v->size*8)) - 1) << var_shift(v);
+}
+
+static inline unsigned var_lanes(const struct zpuino_var *v)
+{
+        return ((1U << v->size) - 1) << (v->addr&3);
+}
+
+static int addr_compare(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Runs of consecutive words having any of "flags" */
+static unsigned add_runs(struct zpuino_iov *iov, uint32_t *data, const uint32_t *addr,
+                         const uint8_t *flags, unsigned nwords, unsigned want, int write)
+{
+        unsigned i, n = 0;
+
+        for (i=0; i<nwords; i++) {
+                if (!(flags[i] & want))
+                        continue;
+                if (n && iov[n-1].offset + iov[n-1].len==addr[i] &&
+                    (uint32_t*)iov[n-1].buf + (iov[n-1].len>>2)==&data[i]) {
+                        iov[n-1].len += 4;
+                        continue;
+                }
+                iov[n].buf = &data[i];
+                iov[n].offset = addr[i];
+                iov[n].len = 4;
+                iov[n].write = write;
+                n++;
+        }
+        return n;
+}
+
+#define WORD_READ 0x10  /* Low nibble: lanes written */
+#define WORD_RMW  0x20
+
+int zpuino_varset_init(struct zpuino_varset *vs, const struct zpuino_var *vars, unsigned count)
+{
+        uint32_t *addr = NULL, *a;
+        uint8_t *flags = NULL;
+        unsigned i, n, w;
+
+        memset(vs, 0, sizeof(*vs));
+        vs->vars = malloc((count ? count : 1) * sizeof(*vs->vars));
+        vs->word = malloc((count ? count : 1) * sizeof(*vs->word));
+        addr = malloc((count ? count : 1) * sizeof(*addr));
+        if (vs->vars==NULL || vs->word==NULL || addr==NULL)
+                goto fail;
+        memcpy(vs->vars, vars, count * sizeof(*vars));
+        vs->nvars = count;
+
+        for (i=0; i<count; i++) {
+                if (vars[i].size!=1 && vars[i].size!=2 && vars[i].size!=4) {
+                        errno = EINVAL;
+                        goto fail;
+                }
+                if (vars[i].addr & (vars[i].size-1)) {
+                        errno = EINVAL;
+                        goto fail;
+                }
+                addr[i] = vars[i].addr & ~3;
+        }
+        qsort(addr, count, sizeof(*addr), addr_compare);
+        for (i=0, n=0; i<count; i++) {
+                if (n==0 || addr[n-1]!=addr[i])
+                        addr[n++] = addr[i];
+        }
+
+        vs->data = calloc(n ? n : 1, sizeof(*vs->data));
+        vs->iov = malloc((n ? 2*n : 1) * sizeof(*vs->iov));
+        vs->rmw = malloc((n ? n : 1) * sizeof(*vs->rmw));
+        flags = calloc(n ? n : 1, 1);
+        if (vs->data==NULL || vs->iov==NULL || vs->rmw==NULL || flags==NULL)
+                goto fail;
+
+        for (i=0; i<count; i++) {
+                w = vars[i].addr & ~3;
+                a = bsearch(&w, addr, n, sizeof(*addr), addr_compare);
+                vs->word[i] = a - addr;
+                if (vars[i].write)
+                        flags[vs->word[i]] |= var_lanes(&vars[i]);
+                else
+                        flags[vs->word[i]] |= WORD_READ;
+        }
+        for (i=0; i<n; i++) {
+                if ((flags[i] & 0xF) && (flags[i] & 0xF)!=0xF)
+                        flags[i] |= WORD_RMW;
+        }
+
+        vs->nrmw = add_runs(vs->rmw, vs->data, addr, flags, n, WORD_RMW, 0);
+        vs->niov = add_runs(vs->iov, vs->data, addr, flags, n, 0xF, 1);
+        vs->niov += add_runs(vs->iov + vs->niov, vs->data, addr, flags, n, WORD_READ, 0);
+
+        free(flags);
+        free(addr);
+        return 0;
+fail:
+        free(flags);
+        free(addr);
+        zpuino_varset_free(vs);
+        return -1;
+}
+
+void zpuino_varset_free(struct zpuino_varset *vs)
+{
+        free(vs->vars);
+        free(vs->word);
+        free(vs->data);
+        free(vs->iov);
+        free(vs->rmw);
+        memset(vs, 0, sizeof(*vs));
+}
+
+int zpuino_varset_xfer(struct zpuino *zp, struct zpuino_varset *vs)
+{
+        struct zpuino_var *v;
+        uint32_t *d;
+        unsigned i;
+
+        if (vs->nrmw && zpuino_xfer(zp, vs->rmw, vs->nrmw)<0)
+                return -1;
+
+        for (i=0; i<vs->nvars; i++) {
+                v = &vs->vars[i];
+                d = &vs->data[vs->word[i]];
+                if (v->write)
+                        *d = (*d & ~var_mask(v)) | ((v->value << var_shift(v)) & var_mask(v));
+        }
+
+        if (zpuino_xfer(zp, vs->iov, vs->niov)<0)
+                return -1;
+
+        for (i=0; i<vs->nvars; i++) {
+                v = &vs->vars[i];
+                if (!v->write)
+                        v->value = (vs->data[vs->word[i]] & var_mask(v)) >> var_shift(v);
+        }
+        return 0;
+}
@@ -0,0 +1,1052 @@
+/*  zpuino.c - ZPUino userspace access library
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <byteswap.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "zpuinodrv.h"
+#include "zpuino.h"
+
+#define DEFAULT_MOCK_SIZE 0x20000
+#define BOUNCE_WORDS      4096
+#define READY_POLL_NS     50000
+#define XFER_BATCH        64
+
+struct zpuino_backend_ops {
+        const char *name;
+        int (*reset)(struct zpuino *zp, int hold);
+        int (*setswap)(struct zpuino *zp, int swap);
+        ssize_t (*pread)(struct zpuino *zp, void *buf, size_t len, uint32_t offset);
+        ssize_t (*pwrite)(struct zpuino *zp, const void *buf, size_t len, uint32_t offset);
+        int (*checksum)(struct zpuino *zp, uint32_t offset, size_t len, uint16_t *crc);
+        int (*memset)(struct zpuino *zp, uint32_t offset, size_t len, uint32_t value);
+        int (*wait_ready)(struct zpuino *zp, uint32_t offset, uint32_t mask, uint32_t value,
+                          unsigned timeout_ms, uint64_t *ns);
+        int (*xfer)(struct zpuino *zp, const struct zpuino_iov *iov, unsigned count);
+        int (*loadtag)(struct zpuino *zp, int set, uint64_t *tag);
+        void (*close)(struct zpuino *zp);
+};
+
+struct zpuino {
+        const struct zpuino_backend_ops *be;
+        /* Driver and UIO */
+        int fd;
+        /* Mapped backends: either a mapped window or a register model */
+        volatile uint32_t *regs;
+        size_t maplen;
+        const struct zpuino_regops *rops;
+        void *ctx;
+
+        size_t memsize;
+        unsigned core;
+        uint32_t cursor;
+        int swap;       /* Swap requested */
+        int swap_emul;  /* ...and done here, the driver cannot */
+        uint64_t released; /* CLOCK_MONOTONIC ns of the last reset release */
+};
+
+/* Clamp a transfer to memory, the same way the driver does */
+static ssize_t check_range(struct zpuino *zp, size_t len, uint32_t offset, int writing)
+{
+        if ((len&3) || (offset&3)) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (offset >= zp->memsize) {
+                if (writing) {
+                        errno = ENOSPC;
+                        return -1;
+                }
+                return 0;
+        }
+        if (len > zp->memsize - offset)
+                len = zp->memsize - offset;
+        return len;
+}
+
+/*
+ * Mapped access. MADDR is programmed once per transfer and every MACCESS
+ * access moves one word, so a transfer is a tight loop of loads or
+ * stores with no syscalls. Buffers need not be aligned.
+ */
+static inline uint32_t reg_read(struct zpuino *zp, unsigned reg)
+{
+        return zp->regs ? zp->regs[reg] : zp->rops->read(zp->ctx, reg);
+}
+
+static inline void reg_write(struct zpuino *zp, unsigned reg, uint32_t val)
+{
+        if (zp->regs)
+                zp->regs[reg] = val;
+        else
+                zp->rops->write(zp->ctx, reg, val);
+}
+
+static ssize_t mapped_pread(struct zpuino *zp, void *buf, size_t len, uint32_t offset)
+{
+        uint8_t *p = (uint8_t*)buf;
+        ssize_t r = check_range(zp, len, offset, 0);
+        size_t i, words;
+        uint32_t v;
+
+        if (r<=0)
+                return r;
+        words = r>>2;
+
+        reg_write(zp, ZPUINO_REG_MADDR, offset);
+        if (zp->regs) {
+                volatile uint32_t *maccess = &zp->regs[ZPUINO_REG_MACCESS];
+                for (i=0; i<words; i++, p+=4) {
+                        v = *maccess;
+                        if (zp->swap)
+                                v = bswap_32(v);
+                        memcpy(p, &v, 4);
+                }
+        } else {
+                for (i=0; i<words; i++, p+=4) {
+                        v = zp->rops->read(zp->ctx, ZPUINO_REG_MACCESS);
+                        if (zp->swap)
+                                v = bswap_32(v);
+                        memcpy(p, &v, 4);
+                }
+        }
+        return r;
+}
+
+static ssize_t mapped_pwrite(struct zpuino *zp, const void *buf, size_t len, uint32_t offset)
+{
+        const uint8_t *p = (const uint8_t*)buf;
+        ssize_t r = check_range(zp, len, offset, 1);
+        size_t i, words;
+        uint32_t v;
+
+        if (r<=0)
+                return r;
+        words = r>>2;
+
+        reg_write(zp, ZPUINO_REG_MADDR, offset);
+        if (zp->regs) {
+                volatile uint32_t *maccess = &zp->regs[ZPUINO_REG_MACCESS];
+                for (i=0; i<words; i++, p+=4) {
+                        memcpy(&v, p, 4);
+                        *maccess = zp->swap ? bswap_32(v) : v;
+                }
+        } else {
+                for (i=0; i<words; i++, p+=4) {
+                        memcpy(&v, p, 4);
+                        zp->rops->write(zp->ctx, ZPUINO_REG_MACCESS, zp->swap ? bswap_32(v) : v);
+                }
+        }
+        return r;
+}
+
+static int mapped_memset(struct zpuino *zp, uint32_t offset, size_t len, uint32_t value)
+{
+        size_t i;
+
+        reg_write(zp, ZPUINO_REG_MADDR, offset);
+        if (zp->regs) {
+                volatile uint32_t *maccess = &zp->regs[ZPUINO_REG_MACCESS];
+                for (i=0; i<len>>2; i++)
+                        *maccess = value;
+        } else {
+                for (i=0; i<len>>2; i++)
+                        zp->rops->write(zp->ctx, ZPUINO_REG_MACCESS, value);
+        }
+        return 0;
+}
+
+static int mapped_reset(struct zpuino *zp, int hold)
+{
+        uint32_t v = reg_read(zp, ZPUINO_REG_RSTCTL);
+
+        if (hold)
+                v |= 1U<<zp->core;
+        else
+                v &= ~(1U<<zp->core);
+        reg_write(zp, ZPUINO_REG_RSTCTL, v);
+        return 0;
+}
+
+/*
+ * Same detection as the driver's probe: memory wraps around, so the
+ * first power of two whose write shows up at address 0 is the size.
+ * That scribbles over the ZPU's memory, so it is only done while every
+ * core is held in reset; otherwise the size has to be given by name
+ * ("uio:/dev/uioN:SIZE").
+ */
+static int mapped_probe(struct zpuino *zp, size_t memsize)
+{
+        uint32_t signature, save0, saved, all, addr = 0x100;
+        unsigned ncores;
+
+        signature = reg_read(zp, ZPUINO_REG_SIGNATURE);
+        if ((signature&0xFFFFFF00)!=0x5A505500) {
+                errno = ENODEV;
+                return -1;
+        }
+        if (memsize) {
+                zp->memsize = memsize;
+                return 0;
+        }
+
+        ncores = 1+((reg_read(zp, ZPUINO_REG_ZPUCONFIG)>>16)&0xFF);
+        all = ncores>=32 ? 0xFFFFFFFF : (1U<<ncores)-1;
+        if ((reg_read(zp, ZPUINO_REG_RSTCTL) & all)!=all) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        reg_write(zp, ZPUINO_REG_MADDR, 0);
+        save0 = reg_read(zp, ZPUINO_REG_MACCESS);
+        reg_write(zp, ZPUINO_REG_MADDR, 0);
+        reg_write(zp, ZPUINO_REG_MACCESS, 0);
+
+        do {
+                reg_write(zp, ZPUINO_REG_MADDR, addr);
+                saved = reg_read(zp, ZPUINO_REG_MACCESS);
+                reg_write(zp, ZPUINO_REG_MADDR, addr);
+                reg_write(zp, ZPUINO_REG_MACCESS, 0x5A5AA5A5);
+                reg_write(zp, ZPUINO_REG_MADDR, 0);
+                if (reg_read(zp, ZPUINO_REG_MACCESS)==0x5A5AA5A5)
+                        break;
+                reg_write(zp, ZPUINO_REG_MADDR, addr);
+                reg_write(zp, ZPUINO_REG_MACCESS, saved);
+                addr<<=1;
+        } while (addr!=0x40000000);
+
+        reg_write(zp, ZPUINO_REG_MADDR, 0);
+        reg_write(zp, ZPUINO_REG_MACCESS, save0);
+
+        if (addr==0x40000000) {
+                errno = EIO;
+                return -1;
+        }
+        zp->memsize = addr;
+        return 0;
+}
+
+static void regs_close(struct zpuino *zp)
+{
+        if (zp->rops->release)
+                zp->rops->release(zp->ctx);
+}
+
+static const struct zpuino_backend_ops regs_backend = {
+        .name     = "regs",
+        .reset    = mapped_reset,
+        .pread    = mapped_pread,
+        .pwrite   = mapped_pwrite,
+        .memset   = mapped_memset,
+        .close    = regs_close,
+};
+
+static void uio_close(struct zpuino *zp)
+{
+        munmap((void*)zp->regs, zp->maplen);
+        close(zp->fd);
+}
+
+static const struct zpuino_backend_ops uio_backend = {
+        .name     = "uio",
+        .reset    = mapped_reset,
+        .pread    = mapped_pread,
+        .pwrite   = mapped_pwrite,
+        .memset   = mapped_memset,
+        .close    = uio_close,
+};
+
+/*
+ * Kernel driver. Offsets go with every call, so the driver's file
+ * position is never used.
+ */
+static ssize_t drv_pread(struct zpuino *zp, void *buf, size_t len, uint32_t offset)
+{
+        ssize_t r = pread(zp->fd, buf, len, offset);
+        uint32_t *w = (uint32_t*)buf;
+        ssize_t i;
+
+        if (r>0 && zp->swap_emul) {
+                for (i=0; i<r>>2; i++)
+                        w[i] = bswap_32(w[i]);
+        }
+        return r;
+}
+
+static ssize_t drv_pwrite(struct zpuino *zp, const void *buf, size_t len, uint32_t offset)
+{
+        uint32_t bounce[BOUNCE_WORDS];
+        size_t done = 0, chunk, i;
+        ssize_t r;
+
+        if (!zp->swap_emul)
+                return pwrite(zp->fd, buf, len, offset);
+
+        while (done < len) {
+                chunk = len - done;
+                if (chunk > sizeof(bounce))
+                        chunk = sizeof(bounce);
+                memcpy(bounce, (const uint8_t*)buf + done, chunk);
+                for (i=0; i<chunk>>2; i++)
+                        bounce[i] = bswap_32(bounce[i]);
+                r = pwrite(zp->fd, bounce, chunk, offset + done);
+                if (r<0)
+                        return done ? (ssize_t)done : -1;
+                done += r;
+                if ((size_t)r!=chunk)
+                        break;
+        }
+        return done;
+}
+
+static int drv_reset(struct zpuino *zp, int hold)
+{
+        return ioctl(zp->fd, ZPU_IOCTL_SETRESET, hold ? 1 : 0);
+}
+
+static int drv_setswap(struct zpuino *zp, int swap)
+{
+        if (ioctl(zp->fd, ZPU_IOCTL_SETSWAP, swap ? 1 : 0)==0) {
+                zp->swap_emul = 0;
+                return 0;
+        }
+        if (errno!=ENOTTY)
+                return -1;
+        zp->swap_emul = swap;
+        return 0;
+}
+
+static int drv_checksum(struct zpuino *zp, uint32_t offset, size_t len, uint16_t *crc)
+{
+        struct zpu_checksum cs;
+
+        cs.offset = offset;
+        cs.len = len;
+        if (ioctl(zp->fd, ZPU_IOCTL_CHECKSUM, &cs)<0)
+                return -1;
+        *crc = cs.crc;
+        return 0;
+}
+
+static int drv_memset(struct zpuino *zp, uint32_t offset, size_t len, uint32_t value)
+{
+        struct zpu_memop op;
+
+        op.dst = offset;
+        op.src = 0;
+        op.len = len;
+        op.value = value;
+        return ioctl(zp->fd, ZPU_IOCTL_MEMSET, &op);
+}
+
+static int drv_wait_ready(struct zpuino *zp, uint32_t offset, uint32_t mask, uint32_t value,
+                          unsigned timeout_ms, uint64_t *ns)
+{
+        struct zpu_ready rd;
+
+        rd.offset = offset;
+        rd.mask = mask;
+        rd.value = value;
+        rd.timeout_ms = timeout_ms;
+        rd.ns = 0;
+        if (ioctl(zp->fd, ZPU_IOCTL_WAIT_READY, &rd)<0)
+                return -1;
+        *ns = rd.ns;
+        return 0;
+}
+
+static int drv_xfer(struct zpuino *zp, const struct zpuino_iov *iov, unsigned count)
+{
+        struct zpu_iovec kiov[XFER_BATCH];
+        struct zpu_iovec_xfer xfer;
+        unsigned i, batch;
+
+        /* The driver would not swap these */
+        if (zp->swap_emul) {
+                errno = ENOTTY;
+                return -1;
+        }
+        for (; count; count -= batch, iov += batch) {
+                batch = count < XFER_BATCH ? count : XFER_BATCH;
+                for (i=0; i<batch; i++) {
+                        kiov[i].buf = (uintptr_t)iov[i].buf;
+                        kiov[i].offset = iov[i].offset;
+                        kiov[i].len = iov[i].len;
+                        kiov[i].dir = iov[i].write ? ZPU_IOV_WRITE : ZPU_IOV_READ;
+                        kiov[i].reserved = 0;
+                }
+                xfer.iov = (uintptr_t)kiov;
+                xfer.count = batch;
+                xfer.done = 0;
+                if (ioctl(zp->fd, ZPU_IOCTL_XFER, &xfer)<0)
+                        return -1;
+        }
+        return 0;
+}
+
+static int drv_loadtag(struct zpuino *zp, int set, uint64_t *tag)
+{
+        return ioctl(zp->fd, set ? ZPU_IOCTL_SET_LOADTAG : ZPU_IOCTL_GET_LOADTAG, tag);
+}
+
+static void drv_close(struct zpuino *zp)
+{
+        close(zp->fd);
+}
+
+static const struct zpuino_backend_ops drv_backend = {
+        .name     = "zpuinodrv",
+        .reset    = drv_reset,
+        .setswap  = drv_setswap,
+        .pread    = drv_pread,
+        .pwrite   = drv_pwrite,
+        .checksum = drv_checksum,
+        .memset   = drv_memset,
+        .wait_ready = drv_wait_ready,
+        .xfer     = drv_xfer,
+        .loadtag  = drv_loadtag,
+        .close    = drv_close,
+};
+
+/*
+ * Mock register model: the register window and memory of a single-core
+ * ZPUino, kept in process memory. Memory wraps around like the real one.
+ */
+struct zpuino_mock {
+        uint32_t regs[ZPUINO_NREGS];
+        uint32_t *mem;
+        size_t memsize;
+};
+
+static uint32_t mock_read(void *ctx, unsigned reg)
+{
+        struct zpuino_mock *m = (struct zpuino_mock*)ctx;
+        uint32_t v;
+
+        if (reg!=ZPUINO_REG_MACCESS)
+                return m->regs[reg];
+
+        v = m->mem[(m->regs[ZPUINO_REG_MADDR] & (m->memsize-1))>>2];
+        m->regs[ZPUINO_REG_MADDR] += 4;
+        return v;
+}
+
+static void mock_write(void *ctx, unsigned reg, uint32_t val)
+{
+        struct zpuino_mock *m = (struct zpuino_mock*)ctx;
+
+        switch (reg) {
+        case ZPUINO_REG_MACCESS:
+                m->mem[(m->regs[ZPUINO_REG_MADDR] & (m->memsize-1))>>2] = val;
+                m->regs[ZPUINO_REG_MADDR] += 4;
+                break;
+        case ZPUINO_REG_MADDR:
+                m->regs[reg] = val & ~3;
+                break;
+        case ZPUINO_REG_RSTCTL:
+                m->regs[reg] = val & 1;
+                break;
+        default:
+                break;
+        }
+}
+
+static void mock_release(void *ctx)
+{
+        struct zpuino_mock *m = (struct zpuino_mock*)ctx;
+
+        free(m->mem);
+        free(m);
+}
+
+const struct zpuino_regops zpuino_mock_ops = {
+        .read    = mock_read,
+        .write   = mock_write,
+        .release = mock_release,
+};
+
+void *zpuino_mock_new(size_t memsize)
+{
+        struct zpuino_mock *m;
+
+        if (memsize<0x100 || (memsize & (memsize-1))) {
+                errno = EINVAL;
+                return NULL;
+        }
+        m = calloc(1, sizeof(*m));
+        if (m==NULL)
+                return NULL;
+        m->mem = calloc(1, memsize);
+        if (m->mem==NULL) {
+                free(m);
+                return NULL;
+        }
+        m->memsize = memsize;
+        m->regs[ZPUINO_REG_SIGNATURE] = 0x5A505501;
+        m->regs[ZPUINO_REG_RSTCTL] = 1;
+        return m;
+}
+
+/*
+ * Opening
+ */
+static struct zpuino *zpuino_alloc(const struct zpuino_backend_ops *be)
+{
+        struct zpuino *zp = calloc(1, sizeof(*zp));
+
+        if (zp) {
+                zp->be = be;
+                zp->fd = -1;
+        }
+        return zp;
+}
+
+struct zpuino *zpuino_open_regs(const struct zpuino_regops *ops, void *ctx)
+{
+        struct zpuino *zp = zpuino_alloc(&regs_backend);
+
+        if (zp==NULL)
+                return NULL;
+        zp->rops = ops;
+        zp->ctx = ctx;
+        if (mapped_probe(zp, 0)<0) {
+                free(zp);
+                return NULL;
+        }
+        return zp;
+}
+
+static struct zpuino *open_mock(const char *arg)
+{
+        size_t memsize = DEFAULT_MOCK_SIZE;
+        struct zpuino *zp;
+        void *m;
+
+        if (*arg==':')
+                memsize = strtoul(arg+1, NULL, 0);
+        else if (*arg) {
+                errno = EINVAL;
+                return NULL;
+        }
+        m = zpuino_mock_new(memsize);
+        if (m==NULL)
+                return NULL;
+        zp = zpuino_open_regs(&zpuino_mock_ops, m);
+        if (zp==NULL)
+                mock_release(m);
+        return zp;
+}
+
+/* The register window is UIO map 0, whose size sysfs knows */
+static struct zpuino *open_uio(const char *arg)
+{
+        const char *sep = strchr(arg, ':');
+        char devname[256], path[sizeof(devname)+64];
+        const char *base;
+        unsigned long maplen = 0;
+        size_t memsize = 0;
+        struct zpuino *zp;
+        FILE *f;
+
+        if (sep) {
+                memsize = strtoul(sep+1, NULL, 0);
+                if (memsize==0 || (memsize & 3)) {
+                        errno = EINVAL;
+                        return NULL;
+                }
+        }
+        snprintf(devname, sizeof(devname), "%.*s",
+                 sep ? (int)(sep-arg) : (int)strlen(arg), arg);
+        base = strrchr(devname, '/');
+
+        snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/size", base ? base+1 : devname);
+        f = fopen(path, "r");
+        if (f) {
+                if (fscanf(f, "%lx", &maplen)!=1)
+                        maplen = 0;
+                fclose(f);
+        }
+        if (maplen < ZPUINO_NREGS*sizeof(uint32_t))
+                maplen = sysconf(_SC_PAGESIZE);
+
+        zp = zpuino_alloc(&uio_backend);
+        if (zp==NULL)
+                return NULL;
+
+        zp->fd = open(devname, O_RDWR | O_SYNC);
+        if (zp->fd<0) {
+                free(zp);
+                return NULL;
+        }
+        zp->maplen = maplen;
+        zp->regs = (volatile uint32_t*)mmap(NULL, maplen, PROT_READ|PROT_WRITE,
+                                            MAP_SHARED, zp->fd, 0);
+        if (zp->regs==MAP_FAILED) {
+                close(zp->fd);
+                free(zp);
+                return NULL;
+        }
+        if (mapped_probe(zp, memsize)<0) {
+                int e = errno;
+                uio_close(zp);
+                free(zp);
+                errno = e;
+                return NULL;
+        }
+        return zp;
+}
+
+static struct zpuino *open_drv(const char *devname, int flags)
+{
+        struct zpuino *zp = zpuino_alloc(&drv_backend);
+        off_t last;
+
+        if (zp==NULL)
+                return NULL;
+        zp->fd = open(devname, flags);
+        if (zp->fd<0) {
+                free(zp);
+                return NULL;
+        }
+        /* The driver refuses to seek to memsize itself */
+        last = lseek(zp->fd, -4, SEEK_END);
+        if (last<0) {
+                int e = errno;
+                close(zp->fd);
+                free(zp);
+                errno = e;
+                return NULL;
+        }
+        zp->memsize = last + 4;
+        return zp;
+}
+
+static struct zpuino *open_name(const char *name, int flags)
+{
+        if (strncmp(name, "mock", 4)==0)
+                return open_mock(name+4);
+        if (strncmp(name, "uio:", 4)==0)
+                return open_uio(name+4);
+        if (strncmp(name, "/dev/uio", 8)==0)
+                return open_uio(name);
+        return open_drv(name, flags);
+}
+
+struct zpuino *zpuino_open(const char *name)
+{
+        return open_name(name, O_RDWR);
+}
+
+struct zpuino *zpuino_open_ro(const char *name)
+{
+        return open_name(name, O_RDONLY);
+}
+
+void zpuino_close(struct zpuino *zp)
+{
+        if (zp==NULL)
+                return;
+        zp->be->close(zp);
+        free(zp);
+}
+
+const char *zpuino_backend(const struct zpuino *zp)
+{
+        return zp->rops==&zpuino_mock_ops ? "mock" : zp->be->name;
+}
+
+size_t zpuino_memsize(const struct zpuino *zp)
+{
+        return zp->memsize;
+}
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+int zpuino_reset(struct zpuino *zp, int hold)
+{
+        if (zp->be->reset(zp, hold)<0)
+                return -1;
+        if (!hold)
+                zp->released = now_ns();
+        return 0;
+}
+
+int zpuino_setswap(struct zpuino *zp, int swap)
+{
+        if (zp->be->setswap && zp->be->setswap(zp, swap)<0)
+                return -1;
+        zp->swap = !!swap;
+        return 0;
+}
+
+ssize_t zpuino_pread(struct zpuino *zp, void *buf, size_t len, uint32_t offset)
+{
+        return zp->be->pread(zp, buf, len, offset);
+}
+
+ssize_t zpuino_pwrite(struct zpuino *zp, const void *buf, size_t len, uint32_t offset)
+{
+        return zp->be->pwrite(zp, buf, len, offset);
+}
+
+int zpuino_xfer(struct zpuino *zp, const struct zpuino_iov *iov, unsigned count)
+{
+        unsigned i;
+        ssize_t r;
+
+        for (i=0; i<count; i++) {
+                if ((iov[i].offset&3) || (iov[i].len&3) ||
+                    (uint64_t)iov[i].offset + iov[i].len > zp->memsize) {
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+        if (zp->be->xfer) {
+                if (zp->be->xfer(zp, iov, count)==0)
+                        return 0;
+                if (errno!=ENOTTY)
+                        return -1;
+        }
+
+        /* Mapped backends, older driver: one call per descriptor */
+        for (i=0; i<count; i++) {
+                if (iov[i].write)
+                        r = zpuino_pwrite(zp, iov[i].buf, iov[i].len, iov[i].offset);
+                else
+                        r = zpuino_pread(zp, iov[i].buf, iov[i].len, iov[i].offset);
+                if (r!=(ssize_t)iov[i].len) {
+                        if (r>=0)
+                                errno = EIO;
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+int zpuino_seek(struct zpuino *zp, uint32_t offset)
+{
+        if ((offset&3) || offset >= zp->memsize) {
+                errno = EINVAL;
+                return -1;
+        }
+        zp->cursor = offset;
+        return 0;
+}
+
+ssize_t zpuino_read(struct zpuino *zp, void *buf, size_t len)
+{
+        ssize_t r = zpuino_pread(zp, buf, len, zp->cursor);
+
+        if (r>0)
+                zp->cursor += r;
+        return r;
+}
+
+ssize_t zpuino_write(struct zpuino *zp, const void *buf, size_t len)
+{
+        ssize_t r = zpuino_pwrite(zp, buf, len, zp->cursor);
+
+        if (r>0)
+                zp->cursor += r;
+        return r;
+}
+
+int zpuino_memset(struct zpuino *zp, uint32_t offset, size_t len, uint32_t value)
+{
+        uint32_t buf[BOUNCE_WORDS];
+        size_t done, chunk, i;
+
+        if ((offset&3) || (len&3) || (uint64_t)offset + len > zp->memsize) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (zp->be->memset(zp, offset, len, value)==0)
+                return 0;
+        if (errno!=ENOTTY)
+                return -1;
+
+        /* Older driver: write a filled buffer, in host order */
+        for (i=0; i<BOUNCE_WORDS; i++)
+                buf[i] = zp->swap ? bswap_32(value) : value;
+        for (done=0; done<len; done+=chunk) {
+                chunk = len - done;
+                if (chunk > sizeof(buf))
+                        chunk = sizeof(buf);
+                if (zpuino_pwrite(zp, buf, chunk, offset + done)!=(ssize_t)chunk)
+                        return -1;
+        }
+        return 0;
+}
+
+/*
+ * Polls the ready word through the normal read path, for the mapped
+ * backends and drivers without ZPU_IOCTL_WAIT_READY. The word is compared
+ * as the ZPU sees it, whatever the swap setting.
+ */
+static int poll_ready(struct zpuino *zp, uint32_t offset, uint32_t mask, uint32_t value,
+                      unsigned timeout_ms, uint64_t *ns)
+{
+        struct timespec pause = { 0, READY_POLL_NS };
+        uint64_t deadline = now_ns() + timeout_ms*1000000ULL;
+        uint32_t word;
+
+        for (;;) {
+                if (zpuino_pread(zp, &word, 4, offset)!=4) {
+                        if (errno==0)
+                                errno = EINVAL;
+                        return -1;
+                }
+                if (zp->swap)
+                        word = bswap_32(word);
+                if ((word & mask)==value)
+                        break;
+                if (timeout_ms==0) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+                if (now_ns() >= deadline) {
+                        errno = ETIMEDOUT;
+                        return -1;
+                }
+                nanosleep(&pause, NULL);
+        }
+        *ns = now_ns() - zp->released;
+        return 0;
+}
+
+int zpuino_wait_ready(struct zpuino *zp, uint32_t offset, uint32_t mask, uint32_t value,
+                      unsigned timeout_ms, uint64_t *ns)
+{
+        uint64_t dummy;
+
+        if (ns==NULL)
+                ns = &dummy;
+        if ((offset&3) || offset >= zp->memsize) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (zp->be->wait_ready) {
+                if (zp->be->wait_ready(zp, offset, mask, value, timeout_ms, ns)==0)
+                        return 0;
+                if (errno!=ENOTTY)
+                        return -1;
+        }
+        return poll_ready(zp, offset, mask, value, timeout_ms, ns);
+}
+
+int zpuino_ready_parse(const char *arg, struct zpuino_ready *ready)
+{
+        char *end;
+
+        ready->offset = strtoul(arg, &end, 0);
+        ready->value = 1;
+        ready->mask = 0xFFFFFFFF;
+        if (*end==',') {
+                ready->value = strtoul(end + 1, &end, 0);
+                if (*end==',')
+                        ready->mask = strtoul(end + 1, &end, 0);
+        }
+        if (end==arg || *end!='\0' || (ready->offset&3)) {
+                errno = EINVAL;
+                return -1;
+        }
+        ready->set = 1;
+        return 0;
+}
+
+/*
+ * CRC16
+ */
+/* Byte-at-a-time table for poly 0x8408 */
+static const uint16_t crc16_table[256] = {
+        0x0000, 0x1189, 0x2312, 0x329B, 0x4624, 0x57AD, 0x6536, 0x74BF,
+        0x8C48, 0x9DC1, 0xAF5A, 0xBED3, 0xCA6C, 0xDBE5, 0xE97E, 0xF8F7,
+        0x1081, 0x0108, 0x3393, 0x221A, 0x56A5, 0x472C, 0x75B7, 0x643E,
+        0x9CC9, 0x8D40, 0xBFDB, 0xAE52, 0xDAED, 0xCB64, 0xF9FF, 0xE876,
+        0x2102, 0x308B, 0x0210, 0x1399, 0x6726, 0x76AF, 0x4434, 0x55BD,
+        0xAD4A, 0xBCC3, 0x8E58, 0x9FD1, 0xEB6E, 0xFAE7, 0xC87C, 0xD9F5,
+        0x3183, 0x200A, 0x1291, 0x0318, 0x77A7, 0x662E, 0x54B5, 0x453C,
+        0xBDCB, 0xAC42, 0x9ED9, 0x8F50, 0xFBEF, 0xEA66, 0xD8FD, 0xC974,
+        0x4204, 0x538D, 0x6116, 0x709F, 0x0420, 0x15A9, 0x2732, 0x36BB,
+        0xCE4C, 0xDFC5, 0xED5E, 0xFCD7, 0x8868, 0x99E1, 0xAB7A, 0xBAF3,
+        0x5285, 0x430C, 0x7197, 0x601E, 0x14A1, 0x0528, 0x37B3, 0x263A,
+        0xDECD, 0xCF44, 0xFDDF, 0xEC56, 0x98E9, 0x8960, 0xBBFB, 0xAA72,
+        0x6306, 0x728F, 0x4014, 0x519D, 0x2522, 0x34AB, 0x0630, 0x17B9,
+        0xEF4E, 0xFEC7, 0xCC5C, 0xDDD5, 0xA96A, 0xB8E3, 0x8A78, 0x9BF1,
+        0x7387, 0x620E, 0x5095, 0x411C, 0x35A3, 0x242A, 0x16B1, 0x0738,
+        0xFFCF, 0xEE46, 0xDCDD, 0xCD54, 0xB9EB, 0xA862, 0x9AF9, 0x8B70,
+        0x8408, 0x9581, 0xA71A, 0xB693, 0xC22C, 0xD3A5, 0xE13E, 0xF0B7,
+        0x0840, 0x19C9, 0x2B52, 0x3ADB, 0x4E64, 0x5FED, 0x6D76, 0x7CFF,
+        0x9489, 0x8500, 0xB79B, 0xA612, 0xD2AD, 0xC324, 0xF1BF, 0xE036,
+        0x18C1, 0x0948, 0x3BD3, 0x2A5A, 0x5EE5, 0x4F6C, 0x7DF7, 0x6C7E,
+        0xA50A, 0xB483, 0x8618, 0x9791, 0xE32E, 0xF2A7, 0xC03C, 0xD1B5,
+        0x2942, 0x38CB, 0x0A50, 0x1BD9, 0x6F66, 0x7EEF, 0x4C74, 0x5DFD,
+        0xB58B, 0xA402, 0x9699, 0x8710, 0xF3AF, 0xE226, 0xD0BD, 0xC134,
+        0x39C3, 0x284A, 0x1AD1, 0x0B58, 0x7FE7, 0x6E6E, 0x5CF5, 0x4D7C,
+        0xC60C, 0xD785, 0xE51E, 0xF497, 0x8028, 0x91A1, 0xA33A, 0xB2B3,
+        0x4A44, 0x5BCD, 0x6956, 0x78DF, 0x0C60, 0x1DE9, 0x2F72, 0x3EFB,
+        0xD68D, 0xC704, 0xF59F, 0xE416, 0x90A9, 0x8120, 0xB3BB, 0xA232,
+        0x5AC5, 0x4B4C, 0x79D7, 0x685E, 0x1CE1, 0x0D68, 0x3FF3, 0x2E7A,
+        0xE70E, 0xF687, 0xC41C, 0xD595, 0xA12A, 0xB0A3, 0x8238, 0x93B1,
+        0x6B46, 0x7ACF, 0x4854, 0x59DD, 0x2D62, 0x3CEB, 0x0E70, 0x1FF9,
+        0xF78F, 0xE606, 0xD49D, 0xC514, 0xB1AB, 0xA022, 0x92B9, 0x8330,
+        0x7BC7, 0x6A4E, 0x58D5, 0x495C, 0x3DE3, 0x2C6A, 0x1EF1, 0x0F78,
+};
+
+uint16_t zpuino_crc16(uint16_t crc, const void *buf, size_t len)
+{
+        const uint8_t *p = (const uint8_t*)buf;
+
+        while (len--)
+                crc = (crc>>8) ^ crc16_table[(crc ^ *p++) & 0xFF];
+        return crc;
+}
+
+/* Read the range back and checksum it here */
+static int readback_checksum(struct zpuino *zp, uint32_t offset, size_t len, uint16_t *crc)
+{
+        uint32_t buf[BOUNCE_WORDS];
+        size_t done = 0, chunk, i;
+        ssize_t r;
+
+        *crc = ZPUINO_CRC16_INIT;
+        while (done < len) {
+                chunk = len - done;
+                if (chunk > sizeof(buf))
+                        chunk = sizeof(buf);
+                r = zpuino_pread(zp, buf, chunk, offset + done);
+                if (r<0)
+                        return -1;
+                if ((size_t)r!=chunk) {
+                        errno = EIO;
+                        return -1;
+                }
+                for (i=0; i<chunk>>2; i++)
+                        buf[i] = htobe32(zp->swap ? bswap_32(buf[i]) : buf[i]);
+                *crc = zpuino_crc16(*crc, buf, chunk);
+                done += chunk;
+        }
+        return 0;
+}
+
+int zpuino_checksum(struct zpuino *zp, uint32_t offset, size_t len, uint16_t *crc)
+{
+        if ((offset&3) || (len&3) || (uint64_t)offset + len > zp->memsize) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (zp->be->checksum) {
+                if (zp->be->checksum(zp, offset, len, crc)==0)
+                        return 0;
+                if (errno!=ENOTTY)
+                        return -1;
+        }
+        return readback_checksum(zp, offset, len, crc);
+}
+
+/*
+ * Sketches
+ */
+int zpuino_sketch_check(const uint32_t *hdr)
+{
+        if (be32toh(hdr[0])!=ZPUINO_SKETCH_SIGNATURE || be32toh(hdr[1])!=ZPUINO_SKETCH_BOARD) {
+                errno = ENOEXEC;
+                return -1;
+        }
+        return 0;
+}
+
+int zpuino_load(struct zpuino *zp, const void *image, size_t len)
+{
+        size_t aligned = len & ~3;
+        uint8_t tail[4] = { 0, 0, 0, 0 };
+        int swap = zp->swap;
+        ssize_t r;
+
+        if (zpuino_setswap(zp, 1)<0)
+                return -1;
+
+        r = zpuino_pwrite(zp, image, aligned, ZPUINO_SKETCH_OFFSET);
+        if (r==(ssize_t)aligned && aligned!=len) {
+                memcpy(tail, (const uint8_t*)image + aligned, len - aligned);
+                r = zpuino_pwrite(zp, tail, 4, ZPUINO_SKETCH_OFFSET + aligned);
+                if (r==4)
+                        r = aligned;
+        }
+        zpuino_setswap(zp, swap);
+
+        if (r<0)
+                return -1;
+        if ((size_t)r!=aligned) {
+                errno = ENOSPC;
+                return -1;
+        }
+        return 0;
+}
+
+int zpuino_verify(struct zpuino *zp, const void *image, size_t len)
+{
+        static const uint8_t zero[4];
+        size_t aligned = (len + 3) & ~3;
+        uint16_t expected, crc;
+
+        expected = zpuino_crc16(ZPUINO_CRC16_INIT, image, len);
+        expected = zpuino_crc16(expected, zero, aligned - len);
+
+        if (zpuino_checksum(zp, ZPUINO_SKETCH_OFFSET, aligned, &crc)<0)
+                return -1;
+        if (crc!=expected) {
+                errno = EIO;
+                return -1;
+        }
+        return 0;
+}
+
+int zpuino_loadtag_set(struct zpuino *zp, uint64_t tag)
+{
+        if (zp->be->loadtag==NULL) {
+                errno = ENOTTY;
+                return -1;
+        }
+        return zp->be->loadtag(zp, 1, &tag);
+}
+
+int zpuino_loadtag_get(struct zpuino *zp, uint64_t *tag)
+{
+        if (zp->be->loadtag==NULL) {
+                errno = ENOTTY;
+                return -1;
+        }
+        return zp->be->loadtag(zp, 0, tag);
+}
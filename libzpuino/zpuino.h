@@ -0,0 +1,287 @@
+/*  zpuino.h - ZPUino userspace access library
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef __ZPUINO_H__
+#define __ZPUINO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * One handle per ZPU core. zpuino_open() picks a backend from the name:
+ *
+ *   /dev/zpuinodrvN       the kernel driver, one syscall per transfer
+ *   uio:/dev/uioN[:SIZE]  the register window mapped through UIO, with
+ *                         MADDR/MACCESS driven directly from userspace.
+ *                         Without SIZE, memory is sized by probing it,
+ *                         which needs every core held in reset (EBUSY
+ *                         otherwise)
+ *   mock[:SIZE]           an in-process register model with SIZE bytes
+ *                         of memory (default 128KiB)
+ *
+ * The mapped backends do no locking of their own: a UIO-bound ZPUino is
+ * not also handled by zpuinodrv, and a handle must not be shared between
+ * threads without external serialization.
+ *
+ * All offsets and lengths are in bytes and must be word multiples.
+ * Functions return 0 (or a byte count) on success and -1 with errno set
+ * on failure.
+ */
+struct zpuino;
+
+/* ZPUino register window, as seen by the host */
+#define ZPUINO_REG_SIGNATURE 0
+#define ZPUINO_REG_ZPUCONFIG 1
+#define ZPUINO_REG_RSTCTL    3
+#define ZPUINO_REG_MADDR     4
+#define ZPUINO_REG_MACCESS   7
+#define ZPUINO_NREGS         8
+
+/*
+ * A register model, for zpuino_open_regs(). read/write are called with
+ * register numbers, and must implement MADDR auto-increment on MACCESS.
+ */
+struct zpuino_regops {
+        uint32_t (*read)(void *ctx, unsigned reg);
+        void (*write)(void *ctx, unsigned reg, uint32_t val);
+        void (*release)(void *ctx);
+};
+
+struct zpuino *zpuino_open(const char *name);
+/*
+ * For handles that only read. The driver lets any number of read-only
+ * files share a core with its single writer, so this does not get EBUSY
+ * while a loader or zpuinod has the core open. The mapped backends have
+ * to write MADDR even to read, and open as zpuino_open() does.
+ */
+struct zpuino *zpuino_open_ro(const char *name);
+struct zpuino *zpuino_open_regs(const struct zpuino_regops *ops, void *ctx);
+void zpuino_close(struct zpuino *zp);
+
+/* Built-in model used by "mock". Returns a context for zpuino_regops */
+void *zpuino_mock_new(size_t memsize);
+extern const struct zpuino_regops zpuino_mock_ops;
+
+const char *zpuino_backend(const struct zpuino *zp);
+size_t zpuino_memsize(const struct zpuino *zp);
+
+/* Hold (1) or release (0) this core's reset */
+int zpuino_reset(struct zpuino *zp, int hold);
+
+/*
+ * With swap set, words are byte-swapped between the buffer and ZPU
+ * memory, so buffers hold ZPU (big-endian) byte order.
+ */
+int zpuino_setswap(struct zpuino *zp, int swap);
+
+ssize_t zpuino_pread(struct zpuino *zp, void *buf, size_t len, uint32_t offset);
+ssize_t zpuino_pwrite(struct zpuino *zp, const void *buf, size_t len, uint32_t offset);
+
+/* Fill len bytes with a word, inside the device where the driver can */
+int zpuino_memset(struct zpuino *zp, uint32_t offset, size_t len, uint32_t value);
+
+/*
+ * Wait up to timeout_ms for the sketch to store "value" (under "mask")
+ * in the word at offset, as the ZPU sees it. On success *ns is the time
+ * since zpuino_reset(zp, 0). Fails with ETIMEDOUT, or EAGAIN when
+ * timeout_ms is 0 and the sketch is not ready yet. Clear the word before
+ * releasing reset.
+ */
+int zpuino_wait_ready(struct zpuino *zp, uint32_t offset, uint32_t mask, uint32_t value,
+                      unsigned timeout_ms, uint64_t *ns);
+
+/*
+ * A ready word as given to the tools' -r option, "offset[,value[,mask]]".
+ * value defaults to 1 and mask to all ones. Fails with EINVAL.
+ */
+#define ZPUINO_READY_DEFAULT_TIMEOUT 1000 /* ms */
+
+struct zpuino_ready {
+        int set;
+        uint32_t offset;
+        uint32_t value;
+        uint32_t mask;
+        unsigned timeout_ms;
+};
+
+int zpuino_ready_parse(const char *arg, struct zpuino_ready *ready);
+
+/*
+ * Vectored transfer: all descriptors in one go, in order, under one
+ * driver lock. Offsets and lengths must be word multiples.
+ */
+struct zpuino_iov {
+        void *buf;
+        uint32_t offset;
+        uint32_t len;
+        int write;              /* Else read */
+};
+
+int zpuino_xfer(struct zpuino *zp, const struct zpuino_iov *iov, unsigned count);
+
+/* Sequential access from a cursor, like read()/write() on the device */
+int zpuino_seek(struct zpuino *zp, uint32_t offset);
+ssize_t zpuino_read(struct zpuino *zp, void *buf, size_t len);
+ssize_t zpuino_write(struct zpuino *zp, const void *buf, size_t len);
+
+/*
+ * CRC16-CCITT, reflected (poly 0x8408, init 0xFFFF), over ZPU byte order.
+ * This is what the ZPUino bootloader programs into the CRC16 unit.
+ */
+#define ZPUINO_CRC16_INIT 0xFFFF
+
+uint16_t zpuino_crc16(uint16_t crc, const void *buf, size_t len);
+int zpuino_checksum(struct zpuino *zp, uint32_t offset, size_t len, uint16_t *crc);
+
+/* Write a sketch image (without its 8-byte header, in file byte order) */
+int zpuino_load(struct zpuino *zp, const void *image, size_t len);
+/* Compare the CRC of a loaded image against the image itself */
+int zpuino_verify(struct zpuino *zp, const void *image, size_t len);
+
+/*
+ * The driver's load tag (see zpuinodrv.h): set after a load, and read
+ * as 0 once anything else has written ZPU memory. Fails with ENOTTY on
+ * the mapped backends, which cannot tell.
+ */
+int zpuino_loadtag_set(struct zpuino *zp, uint64_t tag);
+int zpuino_loadtag_get(struct zpuino *zp, uint64_t *tag);
+
+#define ZPUINO_SKETCH_OFFSET 0x1008
+
+/*
+ * Sketch binaries start with two big-endian words, the signature and the
+ * board. zpuino_sketch_check() takes them as read from the file and fails
+ * with ENOEXEC if either one is wrong.
+ */
+#define ZPUINO_SKETCH_SIGNATURE 0x310AFADE
+#define ZPUINO_SKETCH_BOARD     0xBC010000
+
+int zpuino_sketch_check(const uint32_t *hdr);
+
+/*
+ * ELF executables and Intel HEX files. Only what they place in memory is
+ * loaded: ELF PT_LOAD segments, with their zero fill, or runs of HEX data
+ * records. Segment data is in ZPU byte order, as in the file, and must
+ * start on a word at or above the sketch header.
+ */
+#define ZPUINO_IMAGE_ELF  1
+#define ZPUINO_IMAGE_IHEX 2
+
+struct zpuino_segment {
+        uint32_t addr;
+        uint32_t filesz;        /* Bytes of data... */
+        uint32_t memsz;         /* ...then zeroes up to memsz */
+        const uint8_t *data;
+};
+
+struct zpuino_image {
+        int format;
+        uint32_t entry;
+        struct zpuino_segment *segs;
+        unsigned nsegs;
+        uint8_t *buf;           /* The file */
+        size_t buflen;
+};
+
+struct zpuino_image_stats {
+        size_t written;         /* Bytes written */
+        size_t filled;          /* Bytes zeroed inside the device */
+        size_t span;            /* Lowest to highest address loaded */
+};
+
+/* ZPUINO_IMAGE_* from the first bytes of a file, or 0 */
+int zpuino_image_detect(const char *path);
+int zpuino_image_read(const char *path, struct zpuino_image *img);
+void zpuino_image_free(struct zpuino_image *img);
+/* Zero runs and fill are done with zpuino_memset(). Leaves swap off */
+int zpuino_image_write(struct zpuino *zp, const struct zpuino_image *img,
+                       struct zpuino_image_stats *st);
+/* Compare the CRC of every segment against the image */
+int zpuino_image_verify(struct zpuino *zp, const struct zpuino_image *img);
+
+/*
+ * ELF symbol table, sorted by address. Names point into the image
+ * buffer, so the image must outlive the table.
+ */
+#define ZPUINO_SYM_OBJECT 1
+#define ZPUINO_SYM_FUNC   2
+
+struct zpuino_symbol {
+        const char *name;
+        uint32_t addr;
+        uint32_t size;
+        int type;
+        int global;
+};
+
+struct zpuino_symtab {
+        struct zpuino_symbol *syms;
+        unsigned nsyms;
+        unsigned *hash;         /* Index + 1 into syms, open addressing */
+        unsigned hashsize;
+};
+
+int zpuino_symtab_read(const struct zpuino_image *img, struct zpuino_symtab *tab);
+void zpuino_symtab_free(struct zpuino_symtab *tab);
+const struct zpuino_symbol *zpuino_symbol_lookup(const struct zpuino_symtab *tab,
+                                                 const char *name);
+const struct zpuino_symbol *zpuino_symbol_find(const struct zpuino_symtab *tab,
+                                               uint32_t addr, int type);
+
+/*
+ * Variables in ZPU memory, read and written while the sketch runs. A
+ * varset is laid out once, and then every zpuino_varset_xfer() writes
+ * the values of the "write" variables and reads the others with as few
+ * vectored transfers as possible: one, unless some written variable
+ * shares a word with bytes it does not cover. Those words are read
+ * first and written back whole, which races with the sketch writing
+ * the other bytes. Words are accessed unswapped.
+ */
+struct zpuino_var {
+        const char *name;
+        uint32_t addr;
+        unsigned size;          /* 1, 2 or 4, naturally aligned */
+        uint32_t value;         /* As the ZPU sees it */
+        int write;
+};
+
+struct zpuino_varset {
+        struct zpuino_var *vars;
+        unsigned nvars;
+        uint32_t *data;         /* One per touched word, ascending */
+        unsigned *word;         /* Word index of each variable */
+        struct zpuino_iov *iov; /* Writes then reads... */
+        unsigned niov;
+        struct zpuino_iov *rmw; /* ...after reading these */
+        unsigned nrmw;
+};
+
+int zpuino_var_parse(const struct zpuino_symtab *tab, const char *spec, struct zpuino_var *var);
+int zpuino_varset_init(struct zpuino_varset *vs, const struct zpuino_var *vars, unsigned count);
+void zpuino_varset_free(struct zpuino_varset *vs);
+int zpuino_varset_xfer(struct zpuino *zp, struct zpuino_varset *vs);
+
+/*
+ * LZ4 block codec. encode returns -1 if the result would not fit in
+ * dstcap; decode may refer back to "hist" bytes of output before dst.
+ */
+long zpuino_lz4_encode(const void *src, size_t len, void *dst, size_t dstcap);
+long zpuino_lz4_decode(const void *src, size_t srclen, void *dst, size_t dstcap, size_t hist);
+
+#endif
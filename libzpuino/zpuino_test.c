@@ -0,0 +1,266 @@
+/*  zpuino_test.c - libzpuino checks against the mock device
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <byteswap.h>
+#include <endian.h>
+
+#include "zpuino.h"
+
+/*
+ * Run by "make check". Every test opens its own "mock:" device, so the
+ * library is driven through the mapped paths and its fallbacks for what
+ * only the driver does (checksum, xfer); nothing else is needed.
+ */
+#define TEST_MEMSIZE 0x10000
+
+static unsigned failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        fprintf(stderr,"%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+static struct zpuino *test_open(void)
+{
+        char name[32];
+        struct zpuino *zp;
+
+        snprintf(name, sizeof(name), "mock:0x%x", TEST_MEMSIZE);
+        zp = zpuino_open(name);
+        if (zp==NULL) {
+                fprintf(stderr,"%s: %s\n", name, strerror(errno));
+                exit(1);
+        }
+        return zp;
+}
+
+static void fill(uint32_t *buf, unsigned words, uint32_t seed)
+{
+        unsigned i;
+
+        for (i=0; i<words; i++)
+                buf[i] = seed + i * 0x9E3779B9;
+}
+
+/* CRC-16/MCRF4XX: reflected 0x8408, init 0xFFFF, no final xor */
+static void test_crc16(void)
+{
+        static const char check[] = "123456789";
+        uint16_t crc;
+
+        CHECK(zpuino_crc16(ZPUINO_CRC16_INIT, check, 0)==0xFFFF);
+        CHECK(zpuino_crc16(ZPUINO_CRC16_INIT, check, 9)==0x6F91);
+        CHECK(zpuino_crc16(ZPUINO_CRC16_INIT, "A", 1)==0x5C0A);
+        CHECK(zpuino_crc16(0, check, 9)==0x2189);
+
+        /* Chained over pieces, as the checksum readback does */
+        crc = zpuino_crc16(ZPUINO_CRC16_INIT, check, 4);
+        crc = zpuino_crc16(crc, check + 4, 5);
+        CHECK(crc==0x6F91);
+}
+
+static void test_pread_pwrite(void)
+{
+        struct zpuino *zp = test_open();
+        uint32_t out[64], in[64];
+
+        CHECK(zpuino_memsize(zp)==TEST_MEMSIZE);
+        CHECK(strcmp(zpuino_backend(zp), "mock")==0);
+
+        fill(out, 64, 1);
+        CHECK(zpuino_pwrite(zp, out, sizeof(out), 0x100)==(ssize_t)sizeof(out));
+        memset(in, 0, sizeof(in));
+        CHECK(zpuino_pread(zp, in, sizeof(in), 0x100)==(ssize_t)sizeof(in));
+        CHECK(memcmp(in, out, sizeof(in))==0);
+
+        /* Words only */
+        CHECK(zpuino_pwrite(zp, out, 6, 0x100)<0 && errno==EINVAL);
+        CHECK(zpuino_pread(zp, in, 4, 0x102)<0 && errno==EINVAL);
+
+        /* Short at the end of memory, nothing past it */
+        CHECK(zpuino_pread(zp, in, sizeof(in), TEST_MEMSIZE - 8)==8);
+        CHECK(zpuino_pread(zp, in, 4, TEST_MEMSIZE)==0);
+        CHECK(zpuino_pwrite(zp, out, sizeof(out), TEST_MEMSIZE - 8)==8);
+        CHECK(zpuino_pwrite(zp, out, 4, TEST_MEMSIZE)<0 && errno==ENOSPC);
+
+        /* The cursor calls go through the same paths */
+        CHECK(zpuino_seek(zp, 0x200)==0);
+        CHECK(zpuino_write(zp, out, 16)==16);
+        CHECK(zpuino_write(zp, out + 4, 16)==16);
+        CHECK(zpuino_seek(zp, 0x200)==0);
+        CHECK(zpuino_read(zp, in, 32)==32);
+        CHECK(memcmp(in, out, 32)==0);
+        CHECK(zpuino_seek(zp, 0x201)<0 && errno==EINVAL);
+
+        zpuino_close(zp);
+}
+
+static void test_setswap(void)
+{
+        struct zpuino *zp = test_open();
+        uint32_t w = 0x11223344, back;
+        uint8_t bytes[4];
+
+        CHECK(zpuino_setswap(zp, 1)==0);
+        CHECK(zpuino_pwrite(zp, &w, 4, 0x40)==4);
+        CHECK(zpuino_pread(zp, &back, 4, 0x40)==4);
+        CHECK(back==w);
+
+        CHECK(zpuino_setswap(zp, 0)==0);
+        CHECK(zpuino_pread(zp, &back, 4, 0x40)==4);
+        CHECK(back==bswap_32(w));
+
+        /* Swapped buffers hold ZPU (big-endian) byte order */
+        w = 0xA1B2C3D4;
+        CHECK(zpuino_pwrite(zp, &w, 4, 0x40)==4);
+        CHECK(zpuino_setswap(zp, 1)==0);
+        CHECK(zpuino_pread(zp, bytes, 4, 0x40)==4);
+        CHECK(bytes[0]==0xA1 && bytes[1]==0xB2 && bytes[2]==0xC3 && bytes[3]==0xD4);
+
+        zpuino_close(zp);
+}
+
+static void test_memset(void)
+{
+        struct zpuino *zp = test_open();
+        uint32_t in[66];
+        unsigned i;
+
+        fill(in, 66, 7);
+        CHECK(zpuino_pwrite(zp, in, sizeof(in), 0x3FC)==(ssize_t)sizeof(in));
+        CHECK(zpuino_memset(zp, 0x400, 256, 0xDEADBEEF)==0);
+        CHECK(zpuino_pread(zp, in, sizeof(in), 0x3FC)==(ssize_t)sizeof(in));
+        for (i=1; i<65; i++)
+                CHECK(in[i]==0xDEADBEEF);
+        /* Neighbours untouched */
+        CHECK(in[0]==7);
+        CHECK(in[65]==7 + 65 * 0x9E3779B9);
+
+        CHECK(zpuino_memset(zp, 0x402, 4, 0)<0 && errno==EINVAL);
+        CHECK(zpuino_memset(zp, TEST_MEMSIZE - 4, 8, 0)<0 && errno==EINVAL);
+
+        zpuino_close(zp);
+}
+
+static void test_xfer(void)
+{
+        struct zpuino *zp = test_open();
+        uint32_t a[16], b[32], ra[16], rb[32];
+        struct zpuino_iov iov[4] = {
+                { a, 0x1000, sizeof(a), 1 },
+                { b, 0x2000, sizeof(b), 1 },
+                { rb, 0x2000, sizeof(rb), 0 },
+                { ra, 0x1000, sizeof(ra), 0 },
+        };
+
+        fill(a, 16, 0x100);
+        fill(b, 32, 0x200);
+        CHECK(zpuino_xfer(zp, iov, 4)==0);
+        CHECK(memcmp(ra, a, sizeof(a))==0);
+        CHECK(memcmp(rb, b, sizeof(b))==0);
+
+        /* In order: a read after a write to the same words sees it */
+        iov[0].buf = b;
+        iov[1].offset = 0x1000;
+        iov[1].len = sizeof(ra);
+        iov[1].buf = ra;
+        iov[1].write = 0;
+        CHECK(zpuino_xfer(zp, iov, 2)==0);
+        CHECK(memcmp(ra, b, sizeof(ra))==0);
+
+        /* Checked up front, nothing is done */
+        iov[0].buf = a;
+        iov[1].offset = 0x1002;
+        CHECK(zpuino_xfer(zp, iov, 2)<0 && errno==EINVAL);
+        CHECK(zpuino_pread(zp, ra, sizeof(ra), 0x1000)==(ssize_t)sizeof(ra));
+        CHECK(memcmp(ra, b, sizeof(ra))==0);
+
+        zpuino_close(zp);
+}
+
+static void test_checksum(void)
+{
+        struct zpuino *zp = test_open();
+        uint32_t words[256], be[256];
+        uint16_t crc;
+        unsigned i;
+
+        /* Over ZPU byte order, whichever way the buffers are swapped */
+        fill(words, 256, 3);
+        for (i=0; i<256; i++)
+                be[i] = htobe32(words[i]);
+        CHECK(zpuino_pwrite(zp, words, sizeof(words), 0x800)==(ssize_t)sizeof(words));
+        CHECK(zpuino_checksum(zp, 0x800, sizeof(words), &crc)==0);
+        CHECK(crc==zpuino_crc16(ZPUINO_CRC16_INIT, be, sizeof(be)));
+
+        CHECK(zpuino_setswap(zp, 1)==0);
+        CHECK(zpuino_checksum(zp, 0x800, sizeof(words), &crc)==0);
+        CHECK(crc==zpuino_crc16(ZPUINO_CRC16_INIT, be, sizeof(be)));
+
+        CHECK(zpuino_checksum(zp, 0x802, 4, &crc)<0 && errno==EINVAL);
+        CHECK(zpuino_checksum(zp, TEST_MEMSIZE - 4, 8, &crc)<0 && errno==EINVAL);
+
+        zpuino_close(zp);
+}
+
+/* An image of odd length is padded with zeroes, and the CRC covers them */
+static void test_load_verify(void)
+{
+        struct zpuino *zp = test_open();
+        uint8_t image[1023];
+        uint64_t tag;
+        unsigned i;
+
+        for (i=0; i<sizeof(image); i++)
+                image[i] = i * 7;
+        CHECK(zpuino_load(zp, image, sizeof(image))==0);
+        CHECK(zpuino_verify(zp, image, sizeof(image))==0);
+        image[100] ^= 1;
+        CHECK(zpuino_verify(zp, image, sizeof(image))<0 && errno==EIO);
+
+        /* Only the driver knows what else wrote memory since */
+        CHECK(zpuino_loadtag_set(zp, 1)<0 && errno==ENOTTY);
+        CHECK(zpuino_loadtag_get(zp, &tag)<0 && errno==ENOTTY);
+
+        zpuino_close(zp);
+}
+
+int main(int argc, char **argv)
+{
+        test_crc16();
+        test_pread_pwrite();
+        test_setswap();
+        test_memset();
+        test_xfer();
+        test_checksum();
+        test_load_verify();
+
+        if (failures) {
+                fprintf(stderr,"%u checks failed\n", failures);
+                return 1;
+        }
+        printf("libzpuino: all checks passed\n");
+        return 0;
+}
@@ -0,0 +1,170 @@
+/*  zpuinobench.c - Compare ZPUino memory access paths
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "zpuino.h"
+
+/*
+ * Times writes and reads of the same region through every device given,
+ * e.g. "zpuinobench /dev/zpuinodrv uio:/dev/uio0" for the syscall and
+ * mapped paths on the same board. The region is overwritten and the core
+ * is left in reset. What is read back must match what was written, so a
+ * run also checks the transfer paths; with the driver built with
+ * ZPUINODRV_SIM=y and loaded with sim_memsize=, that needs no board.
+ */
+
+static double now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+static int bench(const char *name, uint32_t offset, size_t size, size_t block, unsigned iterations)
+{
+        struct zpuino *zp;
+        uint32_t *buf, *back;
+        double t, wms, rms;
+        size_t done;
+        unsigned i;
+
+        zp = zpuino_open(name);
+        if (zp==NULL) {
+                fprintf(stderr,"%s: %s\n", name, strerror(errno));
+                return -1;
+        }
+        if (offset + size > zpuino_memsize(zp)) {
+                fprintf(stderr,"%s: region does not fit in %zu bytes of memory\n",
+                        name, zpuino_memsize(zp));
+                zpuino_close(zp);
+                return -1;
+        }
+        buf = malloc(size);
+        back = malloc(size);
+        if (buf==NULL || back==NULL || zpuino_reset(zp, 1)<0) {
+                fprintf(stderr,"%s: %s\n", name, strerror(errno));
+                free(buf);
+                free(back);
+                zpuino_close(zp);
+                return -1;
+        }
+        for (i=0; i<size>>2; i++)
+                buf[i] = i * 0x9E3779B9;
+
+        t = now_ms();
+        for (i=0; i<iterations; i++) {
+                for (done=0; done<size; done+=block) {
+                        if (zpuino_pwrite(zp, (uint8_t*)buf + done, block, offset + done)!=(ssize_t)block)
+                                goto fail;
+                }
+        }
+        wms = now_ms() - t;
+
+        t = now_ms();
+        for (i=0; i<iterations; i++) {
+                for (done=0; done<size; done+=block) {
+                        if (zpuino_pread(zp, (uint8_t*)back + done, block, offset + done)!=(ssize_t)block)
+                                goto fail;
+                }
+        }
+        rms = now_ms() - t;
+
+        if (memcmp(buf, back, size)!=0) {
+                fprintf(stderr,"%s: read back differs from what was written\n", name);
+                free(buf);
+                free(back);
+                zpuino_close(zp);
+                return -1;
+        }
+
+        printf("%-24s %-10s write %9.2f MB/s  read %9.2f MB/s  (%.3f/%.3f us per call)\n",
+               name, zpuino_backend(zp),
+               wms>0 ? (size/1e3)*iterations/wms : 0.0,
+               rms>0 ? (size/1e3)*iterations/rms : 0.0,
+               wms*1e3/((double)iterations*(size/block)),
+               rms*1e3/((double)iterations*(size/block)));
+
+        free(buf);
+        free(back);
+        zpuino_close(zp);
+        return 0;
+fail:
+        fprintf(stderr,"%s: transfer failed: %s\n", name, strerror(errno));
+        free(buf);
+        free(back);
+        zpuino_close(zp);
+        return -1;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-o offset] [-s size] [-b block] [-n iterations] [device...]\n", name);
+        fprintf(stderr,"  Devices are as for zpuino_open(), default \"mock\"\n");
+}
+
+int main(int argc, char **argv)
+{
+        uint32_t offset = 0x1000;
+        size_t size = 0x4000, block = 0;
+        unsigned iterations = 100;
+        int c, r = 0;
+
+        while ((c = getopt(argc, argv, "o:s:b:n:h")) != -1) {
+                switch (c) {
+                case 'o':
+                        offset = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        block = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        iterations = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (block==0)
+                block = size;
+        if ((offset&3) || size==0 || (size&3) || (block&3) || block==0 ||
+            size%block || iterations==0) {
+                fprintf(stderr,"Offset, size and block must be word multiples, and block divide size\n");
+                return -1;
+        }
+
+        if (optind>=argc)
+                return bench("mock", offset, size, block, iterations)<0 ? -1 : 0;
+
+        for (; optind<argc; optind++) {
+                if (bench(argv[optind], offset, size, block, iterations)<0)
+                        r = -1;
+        }
+        return r;
+}
@@ -24,14 +24,53 @@
 #include <linux/interrupt.h>
 #include <linux/miscdevice.h>
 #include <linux/fcntl.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/rmap.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/crc-ccitt.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include <linux/cdev.h>
+#include <linux/idr.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/uio.h>
+#include <linux/irq_work.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/signal.h>
 #include <linux/of_address.h>
 #include <linux/of_device.h>
 #include <linux/of_platform.h>
 #include <asm/uaccess.h>
 
+#include "zpuinodrv.h"
+
+#define CREATE_TRACE_POINTS
+#include "zpuinodrv_trace.h"
+
 #define DRIVER_NAME "zpuinodrv"
-#define ZPUCFG_DEVICES 1
+#define ZPUCFG_DEVICES 16 /* Minors, one per ZPU core across all instances */
+#define ZPUCFG_MAX_CORES min(32, ZPUCFG_DEVICES) /* RSTCTL has 32 reset bits */
+#define ZPUCFG_TLM_MINOR(m) (ZPUCFG_DEVICES + (m)) /* Telemetry minors follow */
+#define ZPUCFG_WATCH_MINOR(m) (2*ZPUCFG_DEVICES + (m)) /* Then watch minors */
+#define ZPUCFG_MINORS ZPUCFG_WATCH_MINOR(ZPUCFG_DEVICES)
+#define ZPUCFG_BOUNCE_SIZE 4096 /* Bytes moved per MACCESS burst */
+#define ZPUCFG_IOV_BATCH 8 /* Descriptors copied in per batch */
+#define ZPUCFG_HIST_BUCKETS 32 /* Latency histogram, log2(ns) */
+#define ZPUCFG_READY_POLL_US 50 /* Ready word polling interval */
+#define ZPUCFG_TLM_POLL_MS 10 /* Telemetry drain interval without interrupts */
+#define ZPUCFG_TLM_FIFO 4096 /* Telemetry records buffered in the kernel */
+#define ZPUCFG_TLM_BATCH 64 /* Telemetry records per copy to userspace */
+#define ZPUCFG_WATCH_FIFO 4096 /* Watch records buffered in the kernel */
+#define ZPUCFG_WATCH_BATCH 64 /* Watch records per copy to userspace */
+#define ZPUCFG_WATCH_SLACK_NS 2000 /* Timer slack allowed to the sampler */
 
 #define ZPUCTL_MINOR 129
 
@@ -39,289 +78,2540 @@
 #define ZPUREG_ZPUCONFIG    1
 #define ZPUREG_RSTCTL       3
 #define ZPUREG_MADDR        4
+#define ZPUREG_INTCTL       5 /* Host to ZPU interrupt lines, see zpuinodrv.h */
+#define ZPUREG_INTSTAT      6 /* ZPU to host interrupt status, see zpuinodrv.h */
 #define ZPUREG_MACCESS      7
 
+#define ZPU_INTCTL_EXT1     (1<<0) /* Raise INTRLINE_EXT1: requests posted */
+#define ZPU_INTCTL_EXT2     (1<<1) /* Raise INTRLINE_EXT2: responses consumed */
 
-#define ZPU_IOCTL_SETRESET _IOW('Z', 0, unsigned)
+struct zpuinodrv_drvdata;
 
-struct zpuinodrv_drvdata {
+enum {
+	ZPU_STAT_READ,
+	ZPU_STAT_WRITE,
+	ZPU_STAT_SEEK,
+	ZPU_STAT_RESET,
+	ZPU_STAT_IOCTL,
+	ZPU_STAT_OPS
+};
+
+static const char * const zpuinodrv_stat_names[ZPU_STAT_OPS] = {
+	"read", "write", "seek", "reset", "ioctl"
+};
+
+/* Per-instance counters, updated with the device lock held */
+struct zpuinodrv_stats {
+	u64 ops[ZPU_STAT_OPS];
+	u64 errors[ZPU_STAT_OPS];
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 ns_mmio;
+	u64 ns_copy;
+	u64 hist[ZPU_STAT_OPS][ZPUCFG_HIST_BUCKETS];
+};
+
+/*
+ * One character device per ZPU core. A core may be opened by any number
+ * of readers but by a single writer; each open file has its own offset.
+ */
+struct zpuinodrv_core {
 	struct cdev cdev;
 	dev_t devt;
-	struct class *class;
+	struct device *dev;
+	struct zpuinodrv_drvdata *drvdata;
+	unsigned int index;
+	unsigned int readers;
+	unsigned int writer:1;
+	/* What this core's openers did */
+	u64 ops;
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 released;	/* ktime_get_ns() of the last reset release */
+	/* Telemetry ring, drained into tlm_fifo while the -tlm device is open */
+	struct cdev tlm_cdev;
+	dev_t tlm_devt;
+	struct device *tlm_dev;
+	uint32_t tlm_base;
+	uint32_t tlm_slots;
+	uint32_t tlm_dropped;	/* ZPU drop count already reported */
+	struct mutex tlm_lock;	/* Open and release */
+	bool tlm_open;
+	DECLARE_KFIFO_PTR(tlm_fifo, struct zpu_tlm_record);
+	struct zpu_tlm_record *tlm_buf;
+	wait_queue_head_t tlm_wait;
+	struct delayed_work tlm_work;
+	/* Memory watch, sampled by watch_thread while the -watch device is open */
+	struct cdev watch_cdev;
+	dev_t watch_devt;
+	struct device *watch_dev;
+	struct mutex watch_lock;	/* Setup and teardown of the sampler */
+	bool watch_open;
+	struct task_struct *watch_thread;
+	struct zpu_watch watch;
+	unsigned int watch_words;
+	u32 *watch_prev;
+	u32 *watch_cur;
+	bool watch_first;
+	u64 watch_start;
+	u64 watch_lost;		/* Not reported in-band yet */
+	spinlock_t watch_stats_lock;	/* 64-bit counters on a 32-bit CPU */
+	struct zpu_watch_stats watch_stats;
+	DECLARE_KFIFO_PTR(watch_fifo, struct zpu_watch_record);
+	struct zpu_watch_record *watch_buf;
+	wait_queue_head_t watch_wait;
+};
+
+/* Per open file */
+struct zpuinodrv_file {
+	struct zpuinodrv_core *core;
+	unsigned int swap:1;	/* Byte-swap words on read()/write() */
+	unsigned int ready_set:1;
+	struct zpu_ready ready;	/* Last ready condition waited for, for poll() */
+};
+
+/*
+ * One per ZPUino instance. Cores of an instance share its memory, so
+ * anything going through MADDR/MACCESS is serialized on "lock".
+ *
+ * Files opened on a core keep the instance alive past remove(): every
+ * cdev of the instance has "kobj" as its parent and holds a reference to
+ * it until its last file is closed, and remove() drops the reference
+ * probe() took. The last one frees the instance, see zpuinodrv_free().
+ */
+struct zpuinodrv_drvdata {
+	struct kobject kobj;
+	struct mutex lock;
+	struct zpuinodrv_core *cores;
+	unsigned int ncores;
+	unsigned int nopen;
 	int irq;
 	unsigned long mem_start;
 	unsigned long mem_end;
 	void __iomem *base_addr;
+	struct zpuinodrv_sim *sim;	/* Instead of base_addr, see ZPUINODRV_SIM */
+	uint32_t memsize;
+	u32 *bounce;
+	/* mmap() shadow of ZPU memory, one valid/dirty bit per page */
+	u32 *shadow;
+	unsigned long *shadow_valid;
+	unsigned long *shadow_dirty;
+	unsigned int shadow_pages;
+	struct address_space *mapping;
+	unsigned int nmaps;		/* mmap()ed areas, which outlive close() */
+	/* Write-back cache on top of the shadow, one dirty bit per word */
+	unsigned long *cache_dirty;
+	unsigned int cache:1;
+	/* Mailbox */
+	wait_queue_head_t mbox_wait;
+	atomic_t mbox_events;
+	uint32_t mbox_base;
+	uint32_t mbox_slots;
+	u64 loadtag;			/* Reset by every host write, see zpuinodrv.h */
+	struct zpuinodrv_stats stats;
+	struct dentry *debugfs;
+};
+
+static struct class *zpuinodrv_class;
+static dev_t zpuinodrv_devt;
+static DEFINE_IDA(zpuinodrv_minors);
+static struct dentry *zpuinodrv_debugfs_root;
+
+/*
+ * Simulated register block, built in with ZPUINODRV_SIM=y and with the
+ * KUnit suite. A platform device carrying a zpuinodrv_sim_config is a
+ * ZPUino that lives in kernel memory, with MADDR auto-incrementing on
+ * MACCESS and memory wrapping around like the real one, so that the whole
+ * driver can be run and its transfer paths timed under UML or in any VM.
+ * Loading the module with sim_memsize set adds one. Without the option
+ * the register accessors compile to plain MMIO.
+ */
+struct zpuinodrv_sim_config {
+	uint32_t memsize;
+	unsigned int cores;
+};
+
+struct zpuinodrv_sim {
+	uint32_t regs[ZPUREG_MACCESS + 1];
+	u32 *mem;
 	uint32_t memsize;
-	loff_t mem_offset;
-        unsigned int is_open:1;
+	/* The sketch side, run from irq_work, see zpuinodrv_sim_irq_work() */
+	struct zpuinodrv_drvdata *lp;
+	struct irq_work irq_work;
+	atomic_t raise;		/* INTSTAT bits to raise */
+	uint32_t echo_base;	/* Mailbox the sketch answers, 0 for none */
 };
 
-static DEFINE_MUTEX(zpuctl_mutex);
+static inline bool zpuinodrv_is_sim(struct zpuinodrv_drvdata *lp)
+{
+	return IS_ENABLED(ZPUINODRV_SIM) && lp->sim;
+}
+
+static uint32_t zpuinodrv_sim_read(struct zpuinodrv_sim *sim, uint32_t regno)
+{
+	uint32_t val;
+
+	if (regno != ZPUREG_MACCESS)
+		return sim->regs[regno];
+
+	val = sim->mem[(sim->regs[ZPUREG_MADDR] & (sim->memsize - 1)) >> 2];
+	sim->regs[ZPUREG_MADDR] += 4;
+	return val;
+}
+
+static void zpuinodrv_sim_write(struct zpuinodrv_sim *sim, uint32_t regno, uint32_t val)
+{
+	switch (regno) {
+	case ZPUREG_SIGNATURE:
+	case ZPUREG_ZPUCONFIG:
+		break;
+	case ZPUREG_INTCTL:
+		/* Wakes the sketch up; INTRLINE_EXT1/EXT2 are edges, nothing latches */
+		if (val & (ZPU_INTCTL_EXT1 | ZPU_INTCTL_EXT2))
+			irq_work_queue(&sim->irq_work);
+		break;
+	case ZPUREG_INTSTAT:
+		sim->regs[regno] &= ~val;
+		break;
+	case ZPUREG_MACCESS:
+		sim->mem[(sim->regs[ZPUREG_MADDR] & (sim->memsize - 1)) >> 2] = val;
+		sim->regs[ZPUREG_MADDR] += 4;
+		break;
+	default:
+		sim->regs[regno] = val;
+	}
+}
+
+static void zpuinodrv_release_regs(struct zpuinodrv_drvdata *lp)
+{
+	if (zpuinodrv_is_sim(lp)) {
+		irq_work_sync(&lp->sim->irq_work);
+		vfree(lp->sim->mem);
+		kfree(lp->sim);
+		lp->sim = NULL;
+		return;
+	}
+	if (lp->base_addr)
+		iounmap(lp->base_addr);
+	if (lp->mem_end)
+		release_mem_region(lp->mem_start, lp->mem_end - lp->mem_start + 1);
+}
+
+static inline void __iomem *zpuinodrv_regaddr(struct zpuinodrv_drvdata *lp, uint32_t regno)
+{
+	return (&((uint32_t*)lp->base_addr)[regno]);
+}
 
 static inline void zpuinodrv_writereg(struct zpuinodrv_drvdata *lp, uint32_t regno, uint32_t val)
 {
-	void __iomem *regaddr = (&((uint32_t*)lp->base_addr)[regno]);
-	iowrite32(val, regaddr);
+	if (zpuinodrv_is_sim(lp))
+		zpuinodrv_sim_write(lp->sim, regno, val);
+	else
+		iowrite32(val, zpuinodrv_regaddr(lp, regno));
 }
 
 static inline uint32_t zpuinodrv_readreg(struct zpuinodrv_drvdata *lp, uint32_t regno)
 {
-	void __iomem *regaddr = (&((uint32_t*)lp->base_addr)[regno]);
-	return ioread32(regaddr);
+	if (zpuinodrv_is_sim(lp))
+		return zpuinodrv_sim_read(lp->sim, regno);
+	return ioread32(zpuinodrv_regaddr(lp, regno));
 }
 
+/* Burst of words through MACCESS, from the current MADDR */
+static inline void zpuinodrv_maccess_read(struct zpuinodrv_drvdata *lp, void *buf, unsigned int words)
+{
+	u32 *p = buf;
 
-static int zpuinodrv_remove(struct platform_device *pdev)
+	if (zpuinodrv_is_sim(lp)) {
+		while (words--)
+			*p++ = zpuinodrv_sim_read(lp->sim, ZPUREG_MACCESS);
+		return;
+	}
+	ioread32_rep(zpuinodrv_regaddr(lp, ZPUREG_MACCESS), buf, words);
+}
+
+static inline void zpuinodrv_maccess_write(struct zpuinodrv_drvdata *lp, const void *buf,
+					   unsigned int words)
 {
-	struct device *dev = &pdev->dev;
-	struct zpuinodrv_drvdata *drvdata = dev_get_drvdata(dev);
-	//free_irq(drvdata->irq, drvdata);
+	const u32 *p = buf;
 
-	drvdata = platform_get_drvdata(pdev);
+	if (zpuinodrv_is_sim(lp)) {
+		while (words--)
+			zpuinodrv_sim_write(lp->sim, ZPUREG_MACCESS, *p++);
+		return;
+	}
+	iowrite32_rep(zpuinodrv_regaddr(lp, ZPUREG_MACCESS), buf, words);
+}
+static inline void zpuinodrv_mem_write32(struct zpuinodrv_drvdata *lp, uint32_t offset, uint32_t val)
+{
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+	zpuinodrv_writereg( lp, ZPUREG_MACCESS, val);
+}
 
-	if (!drvdata)
-		return -ENODEV;
+static inline uint32_t zpuinodrv_mem_read32(struct zpuinodrv_drvdata *lp, uint32_t offset)
+{
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+	return zpuinodrv_readreg( lp, ZPUREG_MACCESS);
+}
 
-	unregister_chrdev_region(drvdata->devt, ZPUCFG_DEVICES);
+static void zpuinodrv_stat_op(struct zpuinodrv_core *core, int op, u64 start, long ret)
+{
+	struct zpuinodrv_stats *st = &core->drvdata->stats;
+	u64 ns = ktime_get_ns() - start;
+
+	st->ops[op]++;
+	if (ret < 0)
+		st->errors[op]++;
+	st->hist[op][min_t(unsigned int, ilog2(ns | 1), ZPUCFG_HIST_BUCKETS-1)]++;
+	core->ops++;
+}
 
-	//sysfs_remove_group(&pdev->dev.kobj, &xdevcfg_attr_group);
+static void zpuinodrv_shadow_update(struct zpuinodrv_drvdata *lp, loff_t offset,
+				    const void *data, size_t len);
+
+/*
+ * Streaming engine. MADDR auto-increments on every MACCESS access, so
+ * whole bursts can be moved with the string accessors on the single
+ * MACCESS register, staged through the fixed per-device bounce buffer.
+ * Data comes from or goes to an iov_iter, so the same engine serves
+ * read()/write(), readv()/writev(), aio and the vectored transfer ioctl.
+ * On a faulting user copy MADDR is moved back to the first word not
+ * transferred, and the number of bytes already moved is returned.
+ * With "swap" each word is byte-swapped on its way, so callers can hand
+ * over data in ZPU (big-endian) byte order.
+ */
+static inline void zpuinodrv_swap_words(u32 *buf, size_t words)
+{
+	while (words--) {
+		swab32s(buf);
+		buf++;
+	}
+}
+
+static ssize_t zpuinodrv_stream_to_iter(struct zpuinodrv_drvdata *lp, struct iov_iter *to,
+					loff_t offset, size_t count, bool swap)
+{
+	size_t done = 0, chunk, copied;
+	u64 t;
+
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+
+	while (done < count) {
+		chunk = min_t(size_t, count - done, ZPUCFG_BOUNCE_SIZE);
+
+		t = ktime_get_ns();
+		zpuinodrv_maccess_read(lp, lp->bounce, chunk>>2);
+		lp->stats.ns_mmio += ktime_get_ns() - t;
+
+		if (swap)
+			zpuinodrv_swap_words(lp->bounce, chunk>>2);
+
+		t = ktime_get_ns();
+		copied = copy_to_iter(lp->bounce, chunk, to);
+		lp->stats.ns_copy += ktime_get_ns() - t;
+
+		/* Only whole words are read; take back a trailing fragment */
+		if (copied != chunk) {
+			iov_iter_revert(to, copied & 3);
+			done += copied & ~3;
+			zpuinodrv_writereg( lp, ZPUREG_MADDR, offset + done);
+			break;
+		}
+		done += chunk;
+	}
+	lp->stats.bytes_read += done;
+
+	/* Only a faulting user copy stops the loop early */
+	return (done < count && !done) ? -EFAULT : done;
+}
+
+static ssize_t zpuinodrv_stream_from_iter(struct zpuinodrv_drvdata *lp, struct iov_iter *from,
+					  loff_t offset, size_t count, bool swap)
+{
+	size_t done = 0, chunk, copied;
+	bool fault = false;
+	u64 t;
+
+	lp->loadtag = 0;
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+
+	while (done < count && !fault) {
+		chunk = min_t(size_t, count - done, ZPUCFG_BOUNCE_SIZE);
+
+		t = ktime_get_ns();
+		copied = copy_from_iter(lp->bounce, chunk, from);
+		lp->stats.ns_copy += ktime_get_ns() - t;
+
+		/* Only whole words are written; give back a trailing fragment */
+		if (copied != chunk) {
+			iov_iter_revert(from, copied & 3);
+			chunk = copied & ~3;
+			fault = true;
+		}
+
+		if (swap)
+			zpuinodrv_swap_words(lp->bounce, chunk>>2);
+
+		t = ktime_get_ns();
+		zpuinodrv_maccess_write(lp, lp->bounce, chunk>>2);
+		lp->stats.ns_mmio += ktime_get_ns() - t;
+
+		zpuinodrv_shadow_update(lp, offset + done, lp->bounce, chunk);
+		done += chunk;
+	}
+	lp->stats.bytes_written += done;
+
+	/* Only a faulting user copy stops the loop early */
+	return (done < count && !done) ? -EFAULT : done;
+}
+
+
+/*
+ * Shadow pages. mmap() exposes the whole ZPU memory through a vmalloc'ed
+ * shadow copy. Pages are read over MACCESS on first touch, and writes are
+ * tracked per page through page_mkwrite. Dirty pages are written back on
+ * fsync()/msync() and when the ZPU is released from reset; they are then
+ * write-protected again so the next store marks them dirty once more.
+ * Clean pages are dropped when the ZPU is put back into reset, since the
+ * running sketch may have changed the memory behind them.
+ *
+ * All of these are called with the device lock held.
+ */
+static int zpuinodrv_shadow_alloc(struct zpuinodrv_drvdata *lp)
+{
+	if (lp->shadow)
+		return 0;
+
+	lp->shadow_pages = DIV_ROUND_UP(lp->memsize, PAGE_SIZE);
+	lp->shadow = vmalloc_user(lp->shadow_pages << PAGE_SHIFT);
+	lp->shadow_valid = kcalloc(BITS_TO_LONGS(lp->shadow_pages), sizeof(long), GFP_KERNEL);
+	lp->shadow_dirty = kcalloc(BITS_TO_LONGS(lp->shadow_pages), sizeof(long), GFP_KERNEL);
+	lp->cache_dirty = kcalloc(BITS_TO_LONGS(lp->memsize>>2), sizeof(long), GFP_KERNEL);
+
+	if (!lp->shadow || !lp->shadow_valid || !lp->shadow_dirty || !lp->cache_dirty) {
+		vfree(lp->shadow);
+		kfree(lp->shadow_valid);
+		kfree(lp->shadow_dirty);
+		kfree(lp->cache_dirty);
+		lp->shadow = NULL;
+		lp->shadow_valid = NULL;
+		lp->shadow_dirty = NULL;
+		lp->cache_dirty = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void zpuinodrv_shadow_free(struct zpuinodrv_drvdata *lp)
+{
+	unsigned int i;
+
+	if (!lp->shadow)
+		return;
+
+	for (i=0; i<lp->shadow_pages; i++)
+		vmalloc_to_page((char*)lp->shadow + (i << PAGE_SHIFT))->mapping = NULL;
+
+	vfree(lp->shadow);
+	kfree(lp->shadow_valid);
+	kfree(lp->shadow_dirty);
+	kfree(lp->cache_dirty);
+	lp->shadow = NULL;
+	lp->cache = 0;
+}
+
+static inline size_t zpuinodrv_shadow_page_len(struct zpuinodrv_drvdata *lp, unsigned int pg)
+{
+	return min_t(size_t, PAGE_SIZE, lp->memsize - (pg << PAGE_SHIFT));
+}
+
+static void zpuinodrv_shadow_fill(struct zpuinodrv_drvdata *lp, unsigned int pg)
+{
+	loff_t offset = pg << PAGE_SHIFT;
+
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+	zpuinodrv_maccess_read(lp, (char*)lp->shadow + offset,
+			       zpuinodrv_shadow_page_len(lp, pg)>>2);
+	set_bit(pg, lp->shadow_valid);
+}
+
+/* Write cached words back as runs of consecutive dirty words, in address order */
+static void zpuinodrv_cache_flush(struct zpuinodrv_drvdata *lp)
+{
+	unsigned int words = lp->memsize>>2;
+	unsigned int w, end;
+
+	for (w = find_first_bit(lp->cache_dirty, words); w < words;
+	     w = find_next_bit(lp->cache_dirty, words, end)) {
+		end = find_next_zero_bit(lp->cache_dirty, words, w);
+
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, w<<2);
+		zpuinodrv_maccess_write(lp, lp->shadow + w, end - w);
+		bitmap_clear(lp->cache_dirty, w, end - w);
+	}
+}
+
+static void zpuinodrv_shadow_flush(struct zpuinodrv_drvdata *lp)
+{
+	struct page *page;
+	loff_t offset;
+	unsigned int pg;
+
+	if (!lp->shadow)
+		return;
+
+	zpuinodrv_cache_flush(lp);
+
+	for_each_set_bit(pg, lp->shadow_dirty, lp->shadow_pages) {
+		offset = pg << PAGE_SHIFT;
+		page = vmalloc_to_page((char*)lp->shadow + offset);
+
+		lock_page(page);
+		page_mkclean(page);
+		clear_bit(pg, lp->shadow_dirty);
+		lp->loadtag = 0;
+
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+		zpuinodrv_maccess_write(lp, (char*)lp->shadow + offset,
+					zpuinodrv_shadow_page_len(lp, pg)>>2);
+		unlock_page(page);
+	}
+}
+
+static void zpuinodrv_shadow_invalidate(struct zpuinodrv_drvdata *lp)
+{
+	if (!lp->shadow)
+		return;
+
+	/* Cached words live in pages about to be dropped */
+	zpuinodrv_cache_flush(lp);
+	bitmap_copy(lp->shadow_valid, lp->shadow_dirty, lp->shadow_pages);
+	if (lp->mapping)
+		unmap_mapping_range(lp->mapping, 0, 0, 1);
+}
+
+/* Keep valid shadow pages coherent with data written through write() */
+static void zpuinodrv_shadow_update(struct zpuinodrv_drvdata *lp, loff_t offset,
+				    const void *data, size_t len)
+{
+	if (lp->shadow)
+		memcpy((char*)lp->shadow + offset, data, len);
+}
+
+/*
+ * Once the device is neither open nor mapped, the next user starts from
+ * what the ZPU holds: valid pages are forgotten and the cache turned off.
+ */
+static void zpuinodrv_shadow_release(struct zpuinodrv_drvdata *lp)
+{
+	if (lp->nopen || lp->nmaps)
+		return;
+
+	if (lp->shadow)
+		bitmap_zero(lp->shadow_valid, lp->shadow_pages);
+	lp->mapping = NULL;
+	lp->cache = 0;
+}
+
+/*
+ * Write-back cache. With ZPU_IOCTL_SETCACHE, and while every core of the
+ * instance is held in reset, read() and write() go to the shadow instead
+ * of MMIO: pages are read in on first use, written words are marked in
+ * cache_dirty, and nothing reaches the ZPU until the shadow is flushed
+ * (reset release, ZPU_IOCTL_FLUSH, fsync() or close()). Repeated patches
+ * of the same words then cost a single write each.
+ */
+static bool zpuinodrv_cache_active(struct zpuinodrv_drvdata *lp)
+{
+	u32 all = GENMASK(lp->ncores - 1, 0);
+
+	return lp->cache &&
+		(zpuinodrv_readreg( lp, ZPUREG_RSTCTL) & all) == all;
+}
+
+static void zpuinodrv_cache_fill(struct zpuinodrv_drvdata *lp, loff_t offset, size_t len)
+{
+	unsigned int pg;
+
+	for (pg = offset >> PAGE_SHIFT; pg <= (offset + len - 1) >> PAGE_SHIFT; pg++) {
+		if (!test_bit(pg, lp->shadow_valid))
+			zpuinodrv_shadow_fill(lp, pg);
+	}
+}
+
+static ssize_t zpuinodrv_cache_to_iter(struct zpuinodrv_drvdata *lp, struct iov_iter *to,
+				       loff_t offset, size_t count, bool swap)
+{
+	size_t done = 0, chunk, copied;
+
+	while (done < count) {
+		chunk = min_t(size_t, count - done, ZPUCFG_BOUNCE_SIZE);
+
+		zpuinodrv_cache_fill(lp, offset + done, chunk);
+		memcpy(lp->bounce, (char*)lp->shadow + offset + done, chunk);
+		if (swap)
+			zpuinodrv_swap_words(lp->bounce, chunk>>2);
+
+		copied = copy_to_iter(lp->bounce, chunk, to);
+		/* Only whole words are read; take back a trailing fragment */
+		if (copied != chunk) {
+			iov_iter_revert(to, copied & 3);
+			done += copied & ~3;
+			break;
+		}
+		done += chunk;
+	}
+	lp->stats.bytes_read += done;
+
+	return (done < count && !done) ? -EFAULT : done;
+}
+
+static ssize_t zpuinodrv_cache_from_iter(struct zpuinodrv_drvdata *lp, struct iov_iter *from,
+					 loff_t offset, size_t count, bool swap)
+{
+	size_t done = 0, chunk, copied;
+	bool fault = false;
+
+	lp->loadtag = 0;
+	while (done < count && !fault) {
+		chunk = min_t(size_t, count - done, ZPUCFG_BOUNCE_SIZE);
+
+		copied = copy_from_iter(lp->bounce, chunk, from);
+		if (copied != chunk) {
+			iov_iter_revert(from, copied & 3);
+			chunk = copied & ~3;
+			fault = true;
+			if (!chunk)
+				break;
+		}
+		if (swap)
+			zpuinodrv_swap_words(lp->bounce, chunk>>2);
+
+		zpuinodrv_cache_fill(lp, offset + done, chunk);
+		memcpy((char*)lp->shadow + offset + done, lp->bounce, chunk);
+		bitmap_set(lp->cache_dirty, (offset + done)>>2, chunk>>2);
+		done += chunk;
+	}
+	lp->stats.bytes_written += done;
+
+	return (done < count && !done) ? -EFAULT : done;
+}
+
+static int zpuinodrv_cache_enable(struct zpuinodrv_drvdata *lp, bool enable)
+{
+	int r;
+
+	if (enable) {
+		r = zpuinodrv_shadow_alloc(lp);
+		if (r)
+			return r;
+	} else {
+		zpuinodrv_shadow_flush(lp);
+	}
+	lp->cache = enable;
+	return 0;
+}
+
+/*
+ * Vectored transfer. Descriptors are copied in a few at a time and run
+ * back to back through the streaming engine.
+ */
+static int zpuinodrv_xfer(struct zpuinodrv_drvdata *lp, struct zpu_iovec_xfer *xfer,
+			  bool writable, bool swap)
+{
+	struct zpu_iovec iov[ZPUCFG_IOV_BATCH];
+	struct zpu_iovec __user *uiov = (struct zpu_iovec __user *)(uintptr_t)xfer->iov;
+	struct iovec uvec;
+	struct iov_iter iter;
+	unsigned int batch, i;
+	ssize_t r;
+
+	zpuinodrv_shadow_flush(lp);
+
+	for (xfer->done = 0; xfer->done < xfer->count; ) {
+		batch = min_t(unsigned int, xfer->count - xfer->done, ZPUCFG_IOV_BATCH);
+
+		if (copy_from_user(iov, uiov + xfer->done, batch * sizeof(struct zpu_iovec)))
+			return -EFAULT;
+
+		for (i=0; i<batch; i++) {
+			if ((iov[i].offset&3) || (iov[i].len&3) ||
+			    (uint64_t)iov[i].offset + iov[i].len > lp->memsize)
+				return -EINVAL;
+
+			if (iov[i].dir != ZPU_IOV_READ && iov[i].dir != ZPU_IOV_WRITE)
+				return -EINVAL;
+			if (iov[i].dir == ZPU_IOV_WRITE && !writable)
+				return -EBADF;
+
+			r = import_single_range(iov[i].dir == ZPU_IOV_READ ? READ : WRITE,
+						(void __user *)(uintptr_t)iov[i].buf,
+						iov[i].len, &uvec, &iter);
+			if (r < 0)
+				return r;
+
+			if (iov[i].dir == ZPU_IOV_READ)
+				r = zpuinodrv_stream_to_iter(lp, &iter, iov[i].offset, iov[i].len, swap);
+			else
+				r = zpuinodrv_stream_from_iter(lp, &iter, iov[i].offset, iov[i].len, swap);
+
+			if (r < 0)
+				return r;
+			if (r != iov[i].len)
+				return -EFAULT;
+
+			xfer->done++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Memory operations run entirely inside ZPU memory, staged through the
+ * bounce buffer. All ranges must be word aligned and inside memory.
+ */
+static inline bool zpuinodrv_range_ok(struct zpuinodrv_drvdata *lp, uint32_t offset, uint32_t len)
+{
+	return !(offset&3) && !(len&3) && (uint64_t)offset + len <= lp->memsize;
+}
+
+static int zpuinodrv_memset(struct zpuinodrv_drvdata *lp, struct zpu_memop *op)
+{
+	size_t done = 0, chunk, i;
+
+	if (!zpuinodrv_range_ok(lp, op->dst, op->len))
+		return -EINVAL;
+
+	zpuinodrv_shadow_flush(lp);
+	lp->loadtag = 0;
+
+	for (i=0; i<ZPUCFG_BOUNCE_SIZE>>2; i++)
+		lp->bounce[i] = op->value;
+
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, op->dst);
+
+	while (done < op->len) {
+		chunk = min_t(size_t, op->len - done, ZPUCFG_BOUNCE_SIZE);
+		zpuinodrv_maccess_write(lp, lp->bounce, chunk>>2);
+		zpuinodrv_shadow_update(lp, op->dst + done, lp->bounce, chunk);
+		done += chunk;
+	}
+	lp->stats.bytes_written += done;
+	return 0;
+}
+
+static int zpuinodrv_memmove(struct zpuinodrv_drvdata *lp, struct zpu_memop *op)
+{
+	size_t done = 0, chunk;
+	uint32_t src, dst;
+	bool backwards = op->dst > op->src && op->dst < op->src + op->len;
+
+	if (!zpuinodrv_range_ok(lp, op->dst, op->len) ||
+	    !zpuinodrv_range_ok(lp, op->src, op->len))
+		return -EINVAL;
+
+	zpuinodrv_shadow_flush(lp);
+	lp->loadtag = 0;
+
+	/* Overlapping moves to a higher address go from the end down */
+	while (done < op->len) {
+		chunk = min_t(size_t, op->len - done, ZPUCFG_BOUNCE_SIZE);
+		if (backwards) {
+			src = op->src + op->len - done - chunk;
+			dst = op->dst + op->len - done - chunk;
+		} else {
+			src = op->src + done;
+			dst = op->dst + done;
+		}
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, src);
+		zpuinodrv_maccess_read(lp, lp->bounce, chunk>>2);
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, dst);
+		zpuinodrv_maccess_write(lp, lp->bounce, chunk>>2);
+		zpuinodrv_shadow_update(lp, dst, lp->bounce, chunk);
+		done += chunk;
+	}
+	lp->stats.bytes_read += done;
+	lp->stats.bytes_written += done;
+	return 0;
+}
+
+/* Sets op->value to the offset of the first differing word, or ~0 */
+static int zpuinodrv_memcmp(struct zpuinodrv_drvdata *lp, struct zpu_memop *op)
+{
+	const size_t half = ZPUCFG_BOUNCE_SIZE / 2;
+	u32 *a = lp->bounce, *b = lp->bounce + (half>>2);
+	size_t done = 0, chunk, i;
+
+	if (!zpuinodrv_range_ok(lp, op->dst, op->len) ||
+	    !zpuinodrv_range_ok(lp, op->src, op->len))
+		return -EINVAL;
+
+	zpuinodrv_shadow_flush(lp);
+
+	op->value = ~0U;
+
+	while (done < op->len) {
+		chunk = min_t(size_t, op->len - done, half);
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, op->dst + done);
+		zpuinodrv_maccess_read(lp, a, chunk>>2);
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, op->src + done);
+		zpuinodrv_maccess_read(lp, b, chunk>>2);
+
+		for (i=0; i<chunk>>2; i++) {
+			if (a[i] != b[i]) {
+				op->value = done + (i<<2);
+				return 0;
+			}
+		}
+		done += chunk;
+	}
+	return 0;
+}
+
+/*
+ * CRC16 of a memory range, computed as the loader and the ZPU CRC16 unit
+ * do, so a load can be verified without copying it back to userspace.
+ */
+static int zpuinodrv_checksum(struct zpuinodrv_drvdata *lp, struct zpu_checksum *cs)
+{
+	size_t done = 0, chunk, i;
+	u16 crc = 0xFFFF;
+
+	if ((cs->offset&3) || (cs->len&3) ||
+	    (uint64_t)cs->offset + cs->len > lp->memsize)
+		return -EINVAL;
+
+	zpuinodrv_shadow_flush(lp);
+
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, cs->offset);
+
+	while (done < cs->len) {
+		chunk = min_t(size_t, cs->len - done, ZPUCFG_BOUNCE_SIZE);
+
+		zpuinodrv_maccess_read(lp, lp->bounce, chunk>>2);
+		for (i=0; i<chunk>>2; i++)
+			lp->bounce[i] = (__force u32)cpu_to_be32(lp->bounce[i]);
+
+		crc = crc_ccitt(crc, (u8*)lp->bounce, chunk);
+		done += chunk;
+	}
+	cs->crc = crc;
+	return 0;
+}
+
+/*
+ * Mailbox. Ring state lives in ZPU memory and is only accessed with
+ * the device lock held. The interrupt handler just counts events and wakes
+ * up waiters, which then look at the rings again.
+ */
+#define ZPU_MBOX_FIELD(lp, f) ((lp)->mbox_base + offsetof(struct zpu_mbox_header, f))
+#define ZPU_MBOX_REQ_SLOT(lp, i) ((lp)->mbox_base + sizeof(struct zpu_mbox_header) + \
+				  ((i) % (lp)->mbox_slots) * ZPU_MBOX_MSG_SIZE)
+#define ZPU_MBOX_RESP_SLOT(lp, i) (ZPU_MBOX_REQ_SLOT(lp, i) + (lp)->mbox_slots * ZPU_MBOX_MSG_SIZE)
+#define ZPU_MBOX_BATCH (ZPUCFG_BOUNCE_SIZE / ZPU_MBOX_MSG_SIZE)
+
+static irqreturn_t zpuinodrv_irq(int irq, void *dev_id)
+{
+	struct zpuinodrv_drvdata *lp = dev_id;
+	uint32_t status = zpuinodrv_readreg( lp, ZPUREG_INTSTAT);
+	unsigned int i;
+
+	if (!status)
+		return IRQ_NONE;
+
+	zpuinodrv_writereg( lp, ZPUREG_INTSTAT, status);
+
+	atomic_inc(&lp->mbox_events);
+	wake_up_interruptible(&lp->mbox_wait);
+
+	for (i=0; lp->cores && i<lp->ncores; i++) {
+		if (READ_ONCE(lp->cores[i].tlm_open))
+			mod_delayed_work(system_wq, &lp->cores[i].tlm_work, 0);
+	}
+
+	return IRQ_HANDLED;
+}
+
+/* The simulated ZPUino interrupts through irq_work instead of an IRQ line */
+static inline bool zpuinodrv_has_irq(struct zpuinodrv_drvdata *lp)
+{
+	return lp->irq >= 0 || zpuinodrv_is_sim(lp);
+}
+
+static int zpuinodrv_mbox_setup(struct zpuinodrv_drvdata *lp, uint32_t base)
+{
+	uint32_t slots;
+
+	if (!zpuinodrv_has_irq(lp))
+		return -ENXIO;
+
+	if ((base&3) || base + sizeof(struct zpu_mbox_header) > lp->memsize)
+		return -EINVAL;
+
+	if (zpuinodrv_mem_read32(lp, base) != ZPU_MBOX_MAGIC)
+		return -ENOENT;
+
+	slots = zpuinodrv_mem_read32(lp, base + offsetof(struct zpu_mbox_header, slots));
+
+	if (slots==0 || base + sizeof(struct zpu_mbox_header) +
+	    2 * (uint64_t)slots * ZPU_MBOX_MSG_SIZE > lp->memsize)
+		return -EINVAL;
+
+	lp->mbox_base = base;
+	lp->mbox_slots = slots;
+
+	return 0;
+}
+
+static int zpuinodrv_mbox_send(struct zpuinodrv_drvdata *lp, struct iov_iter *from,
+			       unsigned count)
+{
+	uint32_t head, tail;
+	unsigned i;
+
+	head = zpuinodrv_mem_read32(lp, ZPU_MBOX_FIELD(lp, req_head));
+	tail = zpuinodrv_mem_read32(lp, ZPU_MBOX_FIELD(lp, req_tail));
+
+	count = min3(count, lp->mbox_slots - (head - tail), (unsigned)ZPU_MBOX_BATCH);
+	if (!count)
+		return 0;
+
+	if (copy_from_iter(lp->bounce, count * ZPU_MBOX_MSG_SIZE, from) !=
+	    count * ZPU_MBOX_MSG_SIZE)
+		return -EFAULT;
+
+	for (i=0; i<count; i++) {
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, ZPU_MBOX_REQ_SLOT(lp, head + i));
+		zpuinodrv_maccess_write(lp, (char*)lp->bounce + i * ZPU_MBOX_MSG_SIZE,
+					ZPU_MBOX_MSG_SIZE>>2);
+	}
+
+	zpuinodrv_mem_write32(lp, ZPU_MBOX_FIELD(lp, req_head), head + count);
+	zpuinodrv_writereg( lp, ZPUREG_INTCTL, ZPU_INTCTL_EXT1);
+
+	return count;
+}
+
+static int zpuinodrv_mbox_recv(struct zpuinodrv_drvdata *lp, struct iov_iter *to,
+			       unsigned count)
+{
+	uint32_t head, tail;
+	unsigned i;
+
+	head = zpuinodrv_mem_read32(lp, ZPU_MBOX_FIELD(lp, resp_head));
+	tail = zpuinodrv_mem_read32(lp, ZPU_MBOX_FIELD(lp, resp_tail));
+
+	count = min3(count, head - tail, (unsigned)ZPU_MBOX_BATCH);
+	if (!count)
+		return 0;
+
+	for (i=0; i<count; i++) {
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, ZPU_MBOX_RESP_SLOT(lp, tail + i));
+		zpuinodrv_maccess_read(lp, (char*)lp->bounce + i * ZPU_MBOX_MSG_SIZE,
+				       ZPU_MBOX_MSG_SIZE>>2);
+	}
+
+	if (copy_to_iter(lp->bounce, count * ZPU_MBOX_MSG_SIZE, to) !=
+	    count * ZPU_MBOX_MSG_SIZE)
+		return -EFAULT;
+
+	zpuinodrv_mem_write32(lp, ZPU_MBOX_FIELD(lp, resp_tail), tail + count);
+	zpuinodrv_writereg( lp, ZPUREG_INTCTL, ZPU_INTCTL_EXT2);
+
+	return count;
+}
+
+/*
+ * Telemetry. The drain runs with the device lock held and is the only
+ * producer into tlm_fifo; the single reader of the -tlm device is the
+ * only consumer. Events stay in the ZPU ring when the FIFO is full, so
+ * that the sketch sees the backpressure and counts its own drops.
+ */
+#define ZPU_TLM_FIELD(core, f) ((core)->tlm_base + offsetof(struct zpu_tlm_header, f))
+#define ZPU_TLM_SLOT(core, i) ((core)->tlm_base + sizeof(struct zpu_tlm_header) + \
+			       ((i) % (core)->tlm_slots) * sizeof(struct zpu_tlm_event))
+#define ZPU_TLM_BATCH (ZPUCFG_BOUNCE_SIZE / sizeof(struct zpu_tlm_event))
+
+static int zpuinodrv_tlm_setup(struct zpuinodrv_core *core, uint32_t base)
+{
+	struct zpuinodrv_drvdata *lp = core->drvdata;
+	uint32_t slots;
+
+	if ((base&3) || base + sizeof(struct zpu_tlm_header) > lp->memsize)
+		return -EINVAL;
+
+	if (zpuinodrv_mem_read32(lp, base) != ZPU_TLM_MAGIC)
+		return -ENOENT;
+
+	slots = zpuinodrv_mem_read32(lp, base + offsetof(struct zpu_tlm_header, slots));
+
+	if (slots==0 || base + sizeof(struct zpu_tlm_header) +
+	    (uint64_t)slots * sizeof(struct zpu_tlm_event) > lp->memsize)
+		return -EINVAL;
+
+	core->tlm_base = base;
+	core->tlm_slots = slots;
+	core->tlm_dropped = zpuinodrv_mem_read32(lp, ZPU_TLM_FIELD(core, dropped));
+
+	return 0;
+}
+
+static void zpuinodrv_tlm_drain(struct zpuinodrv_core *core)
+{
+	struct zpuinodrv_drvdata *lp = core->drvdata;
+	struct zpu_tlm_event *ev = (struct zpu_tlm_event *)lp->bounce;
+	struct zpu_tlm_record rec;
+	uint32_t head, tail, dropped;
+	unsigned int count, i;
+	bool added = false;
+
+	if (!core->tlm_open || !core->tlm_slots)
+		return;
+
+	rec.host_ns = ktime_get_real_ns();
+
+	dropped = zpuinodrv_mem_read32(lp, ZPU_TLM_FIELD(core, dropped));
+	if (dropped != core->tlm_dropped && kfifo_avail(&core->tlm_fifo)) {
+		rec.tsc = 0;
+		rec.id = ZPU_TLM_ID_DROPPED;
+		rec.arg[0] = dropped - core->tlm_dropped;
+		rec.arg[1] = 0;
+		kfifo_put(&core->tlm_fifo, rec);
+		core->tlm_dropped = dropped;
+		added = true;
+	}
+
+	head = zpuinodrv_mem_read32(lp, ZPU_TLM_FIELD(core, head));
+	tail = zpuinodrv_mem_read32(lp, ZPU_TLM_FIELD(core, tail));
+
+	/* A head that ran past the tail means the ring was overwritten */
+	if (head - tail > core->tlm_slots)
+		tail = head - core->tlm_slots;
+
+	while (head != tail) {
+		/* Up to the end of the ring, in one MACCESS burst */
+		count = min3(head - tail, core->tlm_slots - tail % core->tlm_slots,
+			     (unsigned int)ZPU_TLM_BATCH);
+		count = min(count, kfifo_avail(&core->tlm_fifo));
+		if (!count)
+			break;
+
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, ZPU_TLM_SLOT(core, tail));
+		zpuinodrv_maccess_read(lp, ev, count * sizeof(*ev) / 4);
+
+		for (i=0; i<count; i++) {
+			rec.tsc = ev[i].tsc;
+			rec.id = ev[i].id;
+			rec.arg[0] = ev[i].arg[0];
+			rec.arg[1] = ev[i].arg[1];
+			kfifo_put(&core->tlm_fifo, rec);
+		}
+		tail += count;
+		added = true;
+	}
+
+	zpuinodrv_mem_write32(lp, ZPU_TLM_FIELD(core, tail), tail);
+
+	if (added)
+		wake_up_interruptible(&core->tlm_wait);
+}
+
+static void zpuinodrv_tlm_work(struct work_struct *work)
+{
+	struct zpuinodrv_core *core = container_of(to_delayed_work(work),
+						   struct zpuinodrv_core, tlm_work);
+	struct zpuinodrv_drvdata *lp = core->drvdata;
+
+	mutex_lock(&lp->lock);
+	zpuinodrv_tlm_drain(core);
+	if (core->tlm_open)
+		schedule_delayed_work(&core->tlm_work, msecs_to_jiffies(ZPUCFG_TLM_POLL_MS));
+	mutex_unlock(&lp->lock);
+}
+
+/*
+ * Memory watch. The sampler thread reads all ranges into watch_cur under
+ * the device lock, then queues the words that differ from watch_prev.
+ * Sampling does not go through the write-back cache: it sees ZPU memory.
+ */
+static void zpuinodrv_watch_sample(struct zpuinodrv_core *core)
+{
+	struct zpuinodrv_drvdata *lp = core->drvdata;
+	struct zpu_watch_record rec;
+	unsigned int r, i, w, words;
+	u64 start, queued = 0, lost = 0;
+	u32 *tmp;
+
+	start = ktime_get_ns();
+	mutex_lock(&lp->lock);
+	for (r=0, w=0; r<core->watch.count; r++) {
+		words = core->watch.range[r].len >> 2;
+		zpuinodrv_writereg( lp, ZPUREG_MADDR, core->watch.range[r].offset);
+		zpuinodrv_maccess_read(lp, core->watch_cur + w, words);
+		w += words;
+	}
+	rec.ns = ktime_get_ns();
+	mutex_unlock(&lp->lock);
+
+	if (core->watch_lost && kfifo_avail(&core->watch_fifo)) {
+		rec.offset = ZPU_WATCH_DROPPED;
+		rec.value = min_t(u64, core->watch_lost, U32_MAX);
+		kfifo_put(&core->watch_fifo, rec);
+		core->watch_lost -= rec.value;
+		queued++;
+	}
+
+	for (r=0, w=0; r<core->watch.count; r++) {
+		words = core->watch.range[r].len >> 2;
+		for (i=0; i<words; i++, w++) {
+			if (!core->watch_first && core->watch_cur[w] == core->watch_prev[w])
+				continue;
+			rec.offset = core->watch.range[r].offset + (i<<2);
+			rec.value = core->watch_cur[w];
+			if (kfifo_put(&core->watch_fifo, rec))
+				queued++;
+			else
+				lost++;
+		}
+	}
+	core->watch_first = false;
+	core->watch_lost += lost;
+
+	tmp = core->watch_prev;
+	core->watch_prev = core->watch_cur;
+	core->watch_cur = tmp;
+
+	spin_lock(&core->watch_stats_lock);
+	core->watch_stats.samples++;
+	core->watch_stats.busy_ns += ktime_get_ns() - start;
+	core->watch_stats.changes += queued;
+	core->watch_stats.dropped += lost;
+	spin_unlock(&core->watch_stats_lock);
+
+	if (queued)
+		wake_up_interruptible(&core->watch_wait);
+}
+
+static int zpuinodrv_watch_thread(void *data)
+{
+	struct zpuinodrv_core *core = data;
+	u64 period = core->watch.period_ns;
+	ktime_t next = ktime_get(), now;
+	u64 missed;
+
+	while (!kthread_should_stop()) {
+		zpuinodrv_watch_sample(core);
+
+		/* Skip the periods already gone rather than sampling back to back */
+		next = ktime_add_ns(next, period);
+		now = ktime_get();
+		if (ktime_after(now, next)) {
+			missed = div64_u64(ktime_to_ns(ktime_sub(now, next)), period) + 1;
+			next = ktime_add_ns(next, missed * period);
+			spin_lock(&core->watch_stats_lock);
+			core->watch_stats.missed += missed;
+			spin_unlock(&core->watch_stats_lock);
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_hrtimeout_range(&next, ZPUCFG_WATCH_SLACK_NS, HRTIMER_MODE_ABS);
+	}
+	return 0;
+}
+
+static void zpuinodrv_watch_stop(struct zpuinodrv_core *core)
+{
+	if (core->watch_thread) {
+		kthread_stop(core->watch_thread);
+		core->watch_thread = NULL;
+	}
+	kfree(core->watch_prev);
+	kfree(core->watch_cur);
+	core->watch_prev = NULL;
+	core->watch_cur = NULL;
+}
+
+/* Called with watch_lock held */
+static int zpuinodrv_watch_setup(struct zpuinodrv_core *core, const struct zpu_watch *watch)
+{
+	struct zpuinodrv_drvdata *lp = core->drvdata;
+	struct task_struct *thread;
+	unsigned int r, words = 0;
+
+	zpuinodrv_watch_stop(core);
+
+	if (!watch->period_ns)
+		return 0;
+	if (watch->period_ns < ZPU_WATCH_MIN_PERIOD || !watch->count ||
+	    watch->count > ZPU_WATCH_RANGES)
+		return -EINVAL;
+	for (r=0; r<watch->count; r++) {
+		if ((watch->range[r].offset&3) || (watch->range[r].len&3) || !watch->range[r].len ||
+		    (uint64_t)watch->range[r].offset + watch->range[r].len > lp->memsize)
+			return -EINVAL;
+		words += watch->range[r].len >> 2;
+		if (words > ZPU_WATCH_WORDS)
+			return -E2BIG;
+	}
+
+	core->watch_prev = kmalloc_array(words, sizeof(u32), GFP_KERNEL);
+	core->watch_cur = kmalloc_array(words, sizeof(u32), GFP_KERNEL);
+	if (!core->watch_prev || !core->watch_cur) {
+		zpuinodrv_watch_stop(core);
+		return -ENOMEM;
+	}
+	core->watch = *watch;
+	core->watch_words = words;
+	core->watch_first = true;
+
+	spin_lock(&core->watch_stats_lock);
+	memset(&core->watch_stats, 0, sizeof(core->watch_stats));
+	spin_unlock(&core->watch_stats_lock);
+	core->watch_start = ktime_get_ns();
+
+	thread = kthread_run(zpuinodrv_watch_thread, core, "zpuwatch%u", MINOR(core->devt));
+	if (IS_ERR(thread)) {
+		zpuinodrv_watch_stop(core);
+		return PTR_ERR(thread);
+	}
+	core->watch_thread = thread;
+	return 0;
+}
+
+/*
+ * debugfs: <debugfs>/zpuinodrv/<instance>/stats holds the counters, and
+ * "histogram" the per-operation latency histograms. Writing to either
+ * clears all counters.
+ */
+static int zpuinodrv_stats_show(struct seq_file *m, void *v)
+{
+	struct zpuinodrv_drvdata *lp = m->private;
+	struct zpuinodrv_stats *st = &lp->stats;
+	unsigned int i;
+
+	mutex_lock(&lp->lock);
+	for (i=0; i<ZPU_STAT_OPS; i++)
+		seq_printf(m, "%s_ops %llu\n%s_errors %llu\n",
+			   zpuinodrv_stat_names[i], st->ops[i],
+			   zpuinodrv_stat_names[i], st->errors[i]);
+	seq_printf(m, "bytes_read %llu\nbytes_written %llu\n",
+		   st->bytes_read, st->bytes_written);
+	seq_printf(m, "ns_mmio %llu\nns_copy %llu\n", st->ns_mmio, st->ns_copy);
+	for (i=0; i<lp->ncores; i++)
+		seq_printf(m, "core%u ops %llu bytes_read %llu bytes_written %llu\n", i,
+			   lp->cores[i].ops, lp->cores[i].bytes_read,
+			   lp->cores[i].bytes_written);
+	mutex_unlock(&lp->lock);
+	return 0;
+}
+
+static int zpuinodrv_histogram_show(struct seq_file *m, void *v)
+{
+	struct zpuinodrv_drvdata *lp = m->private;
+	unsigned int i, b;
+
+	mutex_lock(&lp->lock);
+	for (i=0; i<ZPU_STAT_OPS; i++) {
+		seq_printf(m, "%s:", zpuinodrv_stat_names[i]);
+		for (b=0; b<ZPUCFG_HIST_BUCKETS; b++)
+			seq_printf(m, " %llu", lp->stats.hist[i][b]);
+		seq_puts(m, "\n");
+	}
+	mutex_unlock(&lp->lock);
+	return 0;
+}
+
+static int zpuinodrv_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zpuinodrv_stats_show, inode->i_private);
+}
+
+static int zpuinodrv_histogram_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zpuinodrv_histogram_show, inode->i_private);
+}
+
+static ssize_t zpuinodrv_stats_clear(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct zpuinodrv_drvdata *lp = ((struct seq_file *)file->private_data)->private;
+	unsigned int i;
+
+	mutex_lock(&lp->lock);
+	memset(&lp->stats, 0, sizeof(lp->stats));
+	for (i=0; i<lp->ncores; i++) {
+		lp->cores[i].ops = 0;
+		lp->cores[i].bytes_read = 0;
+		lp->cores[i].bytes_written = 0;
+	}
+	mutex_unlock(&lp->lock);
+	return count;
+}
+
+static const struct file_operations zpuinodrv_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= zpuinodrv_stats_open,
+	.read		= seq_read,
+	.write		= zpuinodrv_stats_clear,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations zpuinodrv_histogram_fops = {
+	.owner		= THIS_MODULE,
+	.open		= zpuinodrv_histogram_open,
+	.read		= seq_read,
+	.write		= zpuinodrv_stats_clear,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zpuinodrv_debugfs_init(struct zpuinodrv_drvdata *lp, struct device *dev)
+{
+	if (!zpuinodrv_debugfs_root)
+		return;
+
+	lp->debugfs = debugfs_create_dir(dev_name(dev), zpuinodrv_debugfs_root);
+	if (IS_ERR_OR_NULL(lp->debugfs)) {
+		lp->debugfs = NULL;
+		return;
+	}
+	debugfs_create_file("stats", 0600, lp->debugfs, lp, &zpuinodrv_stats_fops);
+	debugfs_create_file("histogram", 0600, lp->debugfs, lp, &zpuinodrv_histogram_fops);
+}
+
+static void zpuinodrv_destroy_cores(struct zpuinodrv_drvdata *lp, unsigned int count)
+{
+	struct zpuinodrv_core *core;
+
+	while (count--) {
+		core = &lp->cores[count];
+		/* The sampler would outlive the instance */
+		mutex_lock(&core->watch_lock);
+		zpuinodrv_watch_stop(core);
+		mutex_unlock(&core->watch_lock);
+		device_destroy(zpuinodrv_class, core->watch_devt);
+		cdev_del(&core->watch_cdev);
+		device_destroy(zpuinodrv_class, core->tlm_devt);
+		cdev_del(&core->tlm_cdev);
+		device_destroy(zpuinodrv_class, core->devt);
+		cdev_del(&core->cdev);
+		ida_simple_remove(&zpuinodrv_minors, MINOR(core->devt));
+	}
+}
+
+/* Whatever probe() got this far, once nothing uses the instance any more */
+static void zpuinodrv_free(struct kobject *kobj)
+{
+	struct zpuinodrv_drvdata *lp = container_of(kobj, struct zpuinodrv_drvdata, kobj);
+
+	zpuinodrv_release_regs(lp);
+	zpuinodrv_shadow_free(lp);
+	kfree(lp->cores);
+	kfree(lp->bounce);
+	kfree(lp);
+}
+
+static struct kobj_type zpuinodrv_ktype = {
+	.release	= zpuinodrv_free,
+};
+
+static int zpuinodrv_remove(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct zpuinodrv_drvdata *drvdata = dev_get_drvdata(dev);
+
+	drvdata = platform_get_drvdata(pdev);
+
+	if (!drvdata)
+		return -ENODEV;
+
+	if (drvdata->irq >= 0)
+		free_irq(drvdata->irq, drvdata);
+	else if (zpuinodrv_is_sim(drvdata))
+		irq_work_sync(&drvdata->sim->irq_work);
+
+	/* Files still open lose the mailbox, instead of waiting on a dead IRQ */
+	mutex_lock(&drvdata->lock);
+	drvdata->irq = -1;
+	drvdata->mbox_slots = 0;
+	mutex_unlock(&drvdata->lock);
+	atomic_inc(&drvdata->mbox_events);
+	wake_up_interruptible(&drvdata->mbox_wait);
+
+	//sysfs_remove_group(&pdev->dev.kobj, &xdevcfg_attr_group);
+	debugfs_remove_recursive(drvdata->debugfs);
+
+	zpuinodrv_destroy_cores(drvdata, drvdata->ncores);
+
+	dev_set_drvdata(dev, NULL);
+	kobject_put(&drvdata->kobj);
+	return 0;
+}
+
+#ifdef CONFIG_OF
+static struct of_device_id zpuinodrv_of_match[] = {
+	{ .compatible = "xlnx,zynq-zpuino-top-1.0", },
+	{ /* end of list */ },
+};
+MODULE_DEVICE_TABLE(of, zpuinodrv_of_match);
+#else
+# define zpuinodrv_of_match
+#endif
+
+
+
+static loff_t zpuctl_llseek(struct file *file, loff_t offset, int origin)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	loff_t new_offset;
+	u64 start = ktime_get_ns();
+
+	/* SEEK_CUR reads f_pos, so the whole update is done under the lock */
+	mutex_lock(&drvdata->lock);
+
+	switch (origin) {
+	case SEEK_SET:
+		new_offset = offset;
+		break;
+	case SEEK_CUR:
+		new_offset = file->f_pos + offset;
+		break;
+	case SEEK_END:
+		new_offset = drvdata->memsize + offset;
+		break;
+	default:
+		new_offset = -1;
+		break;
+	}
+
+	if (new_offset<0 || new_offset>=drvdata->memsize) {
+		zpuinodrv_stat_op(core, ZPU_STAT_SEEK, start, -EINVAL);
+		trace_zpuinodrv_seek(MINOR(core->devt), offset, origin, -EINVAL);
+		mutex_unlock(&drvdata->lock);
+		return -EINVAL;
+	}
+
+	/* MADDR is programmed by each transfer, only the file offset moves */
+	file->f_pos = new_offset;
+	zpuinodrv_stat_op(core, ZPU_STAT_SEEK, start, 0);
+	mutex_unlock(&drvdata->lock);
+
+	trace_zpuinodrv_seek(MINOR(core->devt), offset, origin, new_offset);
+
+	return new_offset;
+}
+
+/*
+ * read()/write() and their vectored and asynchronous forms all end up
+ * here, with the offset in the kiocb: pread/preadv, aio and io_uring
+ * pass their own and never touch the file position. Transfers complete
+ * synchronously; with IOCB_NOWAIT a busy device returns -EAGAIN so the
+ * submitter can retry from a worker instead of sleeping on the lock.
+ */
+static int zpuctl_iocb_lock(struct kiocb *iocb, struct zpuinodrv_drvdata *drvdata)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&drvdata->lock))
+			return -EAGAIN;
+		return 0;
+	}
+	mutex_lock(&drvdata->lock);
+	return 0;
+}
+
+static ssize_t zpuctl_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t status;
+	struct file *file = iocb->ki_filp;
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	size_t count = iov_iter_count(to);
+	loff_t cpos, offset;
+	u64 start = ktime_get_ns();
+
+	if ((count&3)!=0) { /* Allow only word-multiples (i.e., multiples of 4 bytes */
+		return -EINVAL;
+	}
+
+	offset = iocb->ki_pos;
+
+	if (offset < 0)
+		return -EINVAL;
+	if (offset >= drvdata->memsize)
+		return 0;
+
+	cpos = offset + count;
+
+	if (cpos > drvdata->memsize) {
+		count -= (cpos-drvdata->memsize);
+	}
+
+	status = zpuctl_iocb_lock(iocb, drvdata);
+	if (status)
+		return status;
+
+	if (zpuinodrv_cache_active(drvdata)) {
+		status = zpuinodrv_cache_to_iter(drvdata, to, offset, count, zf->swap);
+	} else {
+		zpuinodrv_shadow_flush(drvdata);
+		status = zpuinodrv_stream_to_iter(drvdata, to, offset, count, zf->swap);
+	}
+
+	if (status > 0) {
+		iocb->ki_pos = offset + status;
+		core->bytes_read += status;
+	}
+	zpuinodrv_stat_op(core, ZPU_STAT_READ, start, status);
+
+	mutex_unlock(&drvdata->lock);
+
+	trace_zpuinodrv_read(MINOR(core->devt), offset, count, status,
+			     ktime_get_ns() - start);
+
+	return status;
+}
+
+static ssize_t zpuctl_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	size_t count = iov_iter_count(from);
+	ssize_t status;
+	loff_t cpos, offset;
+	u64 start = ktime_get_ns();
+
+	if ((count&3)!=0) { /* Allow only word-multiples (i.e., multiples of 4 bytes */
+		return -EIO;
+	}
+
+	offset = iocb->ki_pos;
+
+	if (offset < 0)
+		return -EINVAL;
+	if (offset >= drvdata->memsize)
+		return -ENOSPC;
+
+	cpos = offset + count;
+
+	if (cpos > drvdata->memsize) {
+		count -= (cpos-drvdata->memsize);
+	}
+
+	status = zpuctl_iocb_lock(iocb, drvdata);
+	if (status)
+		return status;
+
+	if (zpuinodrv_cache_active(drvdata))
+		status = zpuinodrv_cache_from_iter(drvdata, from, offset, count, zf->swap);
+	else
+		status = zpuinodrv_stream_from_iter(drvdata, from, offset, count, zf->swap);
+
+	if (status > 0) {
+		iocb->ki_pos = offset + status;
+		core->bytes_written += status;
+	}
+	zpuinodrv_stat_op(core, ZPU_STAT_WRITE, start, status);
+
+	mutex_unlock(&drvdata->lock);
+
+	trace_zpuinodrv_write(MINOR(core->devt), offset, count, status,
+			      ktime_get_ns() - start);
+
+	return status;
+}
+
+static int zpuctl_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int status;
+	uint32_t prev, now;
+	struct zpu_checksum cs;
+	struct zpu_iovec_xfer xfer;
+	struct zpu_memop op;
+	u64 tag;
+
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+
+	switch (cmd) {
+	case ZPU_IOCTL_SETRESET:
+		/* RSTCTL holds one reset bit per core */
+		prev = zpuinodrv_readreg( drvdata, ZPUREG_RSTCTL);
+
+		if (arg) {
+			zpuinodrv_shadow_invalidate(drvdata);
+			/* The mailbox is core 0's, see zpuinodrv.h */
+			if (core->index == 0)
+				drvdata->mbox_slots = 0;
+			core->tlm_slots = 0;
+			now = prev | BIT(core->index);
+		} else {
+			zpuinodrv_shadow_flush(drvdata);
+			now = prev & ~BIT(core->index);
+			if (prev & BIT(core->index))
+				core->released = ktime_get_ns();
+		}
+
+		zpuinodrv_writereg( drvdata, ZPUREG_RSTCTL, now);
+
+		now = zpuinodrv_readreg( drvdata, ZPUREG_RSTCTL);
+
+		trace_zpuinodrv_reset(MINOR(core->devt), prev, now);
+
+		status = 0;
+		break;
+	case ZPU_IOCTL_MBOX_SETUP:
+		status = zpuinodrv_mbox_setup(drvdata, (uint32_t)arg);
+		break;
+	case ZPU_IOCTL_TLM_SETUP:
+		status = zpuinodrv_tlm_setup(core, (uint32_t)arg);
+		break;
+	case ZPU_IOCTL_SET_LOADTAG:
+		if (copy_from_user(&tag, (void __user *)arg, sizeof(tag))) {
+			status = -EFAULT;
+			break;
+		}
+		/* Stores still in the shadow would reset it later */
+		zpuinodrv_shadow_flush(drvdata);
+		drvdata->loadtag = tag;
+		status = 0;
+		break;
+	case ZPU_IOCTL_GET_LOADTAG:
+		tag = drvdata->loadtag;
+		if (drvdata->shadow && !bitmap_empty(drvdata->shadow_dirty, drvdata->shadow_pages))
+			tag = 0;
+		status = copy_to_user((void __user *)arg, &tag, sizeof(tag)) ? -EFAULT : 0;
+		break;
+	case ZPU_IOCTL_CHECKSUM:
+		if (copy_from_user(&cs, (void __user *)arg, sizeof(cs))) {
+			status = -EFAULT;
+			break;
+		}
+		status = zpuinodrv_checksum(drvdata, &cs);
+		if (status==0 && copy_to_user((void __user *)arg, &cs, sizeof(cs)))
+			status = -EFAULT;
+		break;
+	case ZPU_IOCTL_XFER:
+		if (copy_from_user(&xfer, (void __user *)arg, sizeof(xfer))) {
+			status = -EFAULT;
+			break;
+		}
+		status = zpuinodrv_xfer(drvdata, &xfer, file->f_mode & FMODE_WRITE, zf->swap);
+		if (copy_to_user((void __user *)arg, &xfer, sizeof(xfer)))
+			status = -EFAULT;
+		break;
+	case ZPU_IOCTL_MEMSET:
+	case ZPU_IOCTL_MEMMOVE:
+	case ZPU_IOCTL_MEMCMP:
+		if (copy_from_user(&op, (void __user *)arg, sizeof(op))) {
+			status = -EFAULT;
+			break;
+		}
+		if (cmd == ZPU_IOCTL_MEMSET)
+			status = zpuinodrv_memset(drvdata, &op);
+		else if (cmd == ZPU_IOCTL_MEMMOVE)
+			status = zpuinodrv_memmove(drvdata, &op);
+		else
+			status = zpuinodrv_memcmp(drvdata, &op);
+		if (status==0 && cmd == ZPU_IOCTL_MEMCMP &&
+		    copy_to_user((void __user *)arg, &op, sizeof(op)))
+			status = -EFAULT;
+		break;
+	case ZPU_IOCTL_SETSWAP:
+		zf->swap = !!arg;
+		status = 0;
+		break;
+	case ZPU_IOCTL_SETCACHE:
+		status = zpuinodrv_cache_enable(drvdata, !!arg);
+		break;
+	case ZPU_IOCTL_FLUSH:
+		zpuinodrv_shadow_flush(drvdata);
+		status = 0;
+		break;
+	default:
+		status = -ENOTTY;
+	}
+
+	return status;
+}
+
+
+static vm_fault_t zpuctl_vm_fault(struct vm_fault *vmf)
+{
+	struct zpuinodrv_drvdata *drvdata = vmf->vma->vm_private_data;
+	struct page *page;
+	unsigned int pg = vmf->pgoff;
+
+	if (pg >= drvdata->shadow_pages)
+		return VM_FAULT_SIGBUS;
+
+	mutex_lock(&drvdata->lock);
+	if (!test_bit(pg, drvdata->shadow_valid))
+		zpuinodrv_shadow_fill(drvdata, pg);
+	mutex_unlock(&drvdata->lock);
+
+	page = vmalloc_to_page((char*)drvdata->shadow + (pg << PAGE_SHIFT));
+	get_page(page);
+	page->mapping = vmf->vma->vm_file->f_mapping;
+	page->index = vmf->pgoff;
+	vmf->page = page;
+
+	return 0;
+}
+
+static vm_fault_t zpuctl_vm_page_mkwrite(struct vm_fault *vmf)
+{
+	struct zpuinodrv_drvdata *drvdata = vmf->vma->vm_private_data;
+
+	lock_page(vmf->page);
+	set_bit(vmf->page->index, drvdata->shadow_dirty);
+
+	return VM_FAULT_LOCKED;
+}
+
+/* Called for areas split or copied from a mapping, not for the first one */
+static void zpuctl_vm_open(struct vm_area_struct *vma)
+{
+	struct zpuinodrv_drvdata *drvdata = vma->vm_private_data;
+
+	mutex_lock(&drvdata->lock);
+	drvdata->nmaps++;
+	mutex_unlock(&drvdata->lock);
+}
+
+static void zpuctl_vm_close(struct vm_area_struct *vma)
+{
+	struct zpuinodrv_drvdata *drvdata = vma->vm_private_data;
+
+	mutex_lock(&drvdata->lock);
+	drvdata->nmaps--;
+	zpuinodrv_shadow_release(drvdata);
+	mutex_unlock(&drvdata->lock);
+}
+
+static const struct vm_operations_struct zpuctl_vm_ops = {
+	.open		= zpuctl_vm_open,
+	.close		= zpuctl_vm_close,
+	.fault		= zpuctl_vm_fault,
+	.page_mkwrite	= zpuctl_vm_page_mkwrite,
+};
+
+static int zpuctl_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int status;
+
+	if ((vma->vm_pgoff << PAGE_SHIFT) + size > PAGE_ALIGN(drvdata->memsize))
+		return -EINVAL;
+
+	mutex_lock(&drvdata->lock);
+	status = zpuinodrv_shadow_alloc(drvdata);
+	if (!status) {
+		drvdata->mapping = file->f_mapping;
+		drvdata->nmaps++;
+	}
+	mutex_unlock(&drvdata->lock);
+
+	if (status)
+		return status;
+
+	vma->vm_ops = &zpuctl_vm_ops;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = drvdata;
+
+	return 0;
+}
+
+static int zpuctl_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+
+	mutex_lock(&drvdata->lock);
+	zpuinodrv_shadow_flush(drvdata);
+	mutex_unlock(&drvdata->lock);
+
+	return 0;
+}
+
+static int zpuctl_release(struct inode *inode, struct file *file)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+
+	mutex_lock(&drvdata->lock);
+	zpuinodrv_shadow_flush(drvdata);
+	drvdata->nopen--;
+	if (file->f_mode & FMODE_WRITE)
+		core->writer = 0;
+	else
+		core->readers--;
+	zpuinodrv_shadow_release(drvdata);
+	mutex_unlock(&drvdata->lock);
+
+	kfree(zf);
+
+        return 0;
+}
+
+static int zpuctl_open(struct inode *inode, struct file *file)
+{
+	struct zpuinodrv_file *zf;
+	struct zpuinodrv_core *core;
+	struct zpuinodrv_drvdata *drvdata;
+	int status = -EIO;
+
+        core = container_of(inode->i_cdev, struct zpuinodrv_core, cdev);
+	drvdata = core->drvdata;
+
+	zf = kzalloc(sizeof(struct zpuinodrv_file), GFP_KERNEL);
+	if (!zf)
+		return -ENOMEM;
+	zf->core = core;
+
+	mutex_lock(&drvdata->lock);
+
+	if (file->f_mode & FMODE_WRITE) {
+		if (core->writer) {
+			printk(KERN_INFO "Device busy");
+			status = -EBUSY;
+			goto error;
+		}
+		core->writer = 1;
+	} else {
+		core->readers++;
+	}
+
+	/*
+	 * All cores of an instance share one address space for the mmap()
+	 * shadow, so that dirty tracking sees every mapping of a page.
+	 */
+	if (!drvdata->mapping)
+		drvdata->mapping = inode->i_mapping;
+	drvdata->nopen++;
+	file->f_mapping = drvdata->mapping;
+
+	file->private_data = zf;
+	/* zpuctl_iocb_lock() honours IOCB_NOWAIT */
+	file->f_mode |= FMODE_NOWAIT;
+
+	status = 0;
+error:
+	mutex_unlock(&drvdata->lock);
+	if (status)
+		kfree(zf);
+        return status;
+}
+
+/*
+ * Mailbox transfers may block waiting for the ZPU, so they only take
+ * the device lock around each attempt to move messages. Returns the
+ * number of messages moved.
+ */
+static int zpuinodrv_mbox_xfer(struct zpuinodrv_drvdata *lp, unsigned int cmd,
+			       struct iov_iter *iter, unsigned count, bool nonblock)
+{
+	int seen, status;
+
+	for (;;) {
+		seen = atomic_read(&lp->mbox_events);
+
+		mutex_lock(&lp->lock);
+		if (!lp->mbox_slots)
+			status = -ENXIO;
+		else if (!count)
+			status = 0;
+		else if (cmd == ZPU_IOCTL_MBOX_SEND)
+			status = zpuinodrv_mbox_send(lp, iter, count);
+		else
+			status = zpuinodrv_mbox_recv(lp, iter, count);
+		mutex_unlock(&lp->lock);
+
+		if (status || !count)
+			return status;
+
+		if (nonblock)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(lp->mbox_wait,
+					     atomic_read(&lp->mbox_events) != seen))
+			return -ERESTARTSYS;
+	}
+}
+
+static int zpuctl_mbox_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	struct zpu_mbox_xfer xfer;
+	struct iov_iter iter;
+	struct iovec iov;
+	int status;
+
+	if (copy_from_user(&xfer, (void __user *)arg, sizeof(xfer)))
+		return -EFAULT;
+
+	/* No more than a batch is moved per call anyway */
+	xfer.count = min_t(u32, xfer.count, ZPU_MBOX_BATCH);
+
+	status = import_single_range(cmd == ZPU_IOCTL_MBOX_SEND ? WRITE : READ,
+				     (void __user *)(uintptr_t)xfer.msgs,
+				     xfer.count * ZPU_MBOX_MSG_SIZE, &iov, &iter);
+	if (status < 0)
+		return status;
+
+	status = zpuinodrv_mbox_xfer(drvdata, cmd, &iter, xfer.count,
+				     file->f_flags & O_NONBLOCK);
+	if (status < 0)
+		return status;
+
+	xfer.done = status;
+
+	if (copy_to_user((void __user *)arg, &xfer, sizeof(xfer)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Ready handshake. The sketch stores a known value in a known word once
+ * it is up, and may raise the host interrupt as well. The word is
+ * re-read on every interrupt, and every ZPUCFG_READY_POLL_US anyway, so
+ * sketches that do not raise the interrupt are seen too.
+ */
+static int zpuinodrv_ready_check(struct zpuinodrv_core *core, const struct zpu_ready *rd,
+				 bool *ready)
+{
+	struct zpuinodrv_drvdata *lp = core->drvdata;
+	int status = 0;
+
+	mutex_lock(&lp->lock);
+	if (zpuinodrv_readreg( lp, ZPUREG_RSTCTL) & BIT(core->index))
+		status = -EINVAL; /* Nothing runs while in reset */
+	else
+		*ready = (zpuinodrv_mem_read32(lp, rd->offset) & rd->mask) == rd->value;
+	mutex_unlock(&lp->lock);
+
+	return status;
+}
+
+static int zpuctl_wait_ready(struct file *file, unsigned long arg)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	struct zpu_ready rd;
+	unsigned long deadline;
+	bool ready = false;
+	int seen, status;
+
+	if (copy_from_user(&rd, (void __user *)arg, sizeof(rd)))
+		return -EFAULT;
+	if ((rd.offset&3) || rd.offset >= drvdata->memsize)
+		return -EINVAL;
+
+	mutex_lock(&drvdata->lock);
+	zf->ready = rd;
+	zf->ready_set = 1;
+	mutex_unlock(&drvdata->lock);
+
+	deadline = jiffies + msecs_to_jiffies(rd.timeout_ms);
+
+	for (;;) {
+		seen = atomic_read(&drvdata->mbox_events);
+
+		status = zpuinodrv_ready_check(core, &rd, &ready);
+		if (status)
+			return status;
+		if (ready)
+			break;
+
+		if (!rd.timeout_ms || (file->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+		if (time_after(jiffies, deadline))
+			return -ETIMEDOUT;
+
+		/* usecs_to_jiffies() would round the interval up to a whole tick */
+		if (zpuinodrv_has_irq(drvdata)) {
+			if (wait_event_interruptible_hrtimeout(drvdata->mbox_wait,
+							       atomic_read(&drvdata->mbox_events) != seen,
+							       us_to_ktime(ZPUCFG_READY_POLL_US)) == -ERESTARTSYS)
+				return -ERESTARTSYS;
+		} else {
+			usleep_range(ZPUCFG_READY_POLL_US, 2*ZPUCFG_READY_POLL_US);
+			if (signal_pending(current))
+				return -ERESTARTSYS;
+		}
+	}
+
+	rd.ns = ktime_get_ns() - core->released;
+	if (copy_to_user((void __user *)arg, &rd, sizeof(rd)))
+		return -EFAULT;
+	return 0;
+}
 
-	device_destroy(drvdata->class, drvdata->devt);
-	class_destroy(drvdata->class);
-	cdev_del(&drvdata->cdev);
+static long zpuctl_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	u64 start = ktime_get_ns();
+	int ret;
 
+	/*
+	 * Read-only openers may only look at memory, and point the telemetry
+	 * drain at it: a trace consumer is not the one loading the sketch.
+	 */
+	if (!(file->f_mode & FMODE_WRITE) &&
+	    cmd != ZPU_IOCTL_CHECKSUM && cmd != ZPU_IOCTL_XFER &&
+	    cmd != ZPU_IOCTL_MEMCMP && cmd != ZPU_IOCTL_SETSWAP &&
+	    cmd != ZPU_IOCTL_WAIT_READY && cmd != ZPU_IOCTL_TLM_SETUP &&
+	    cmd != ZPU_IOCTL_GET_LOADTAG)
+		return -EBADF;
+
+	if (cmd == ZPU_IOCTL_MBOX_SEND || cmd == ZPU_IOCTL_MBOX_RECV)
+		return zpuctl_mbox_ioctl(file, cmd, arg);
+	if (cmd == ZPU_IOCTL_WAIT_READY)
+		return zpuctl_wait_ready(file, arg);
+
+	mutex_lock(&drvdata->lock);
+	ret = zpuctl_ioctl(file, cmd, arg);
+	zpuinodrv_stat_op(core, cmd == ZPU_IOCTL_SETRESET ? ZPU_STAT_RESET : ZPU_STAT_IOCTL,
+			  start, ret);
+	mutex_unlock(&drvdata->lock);
 
+	return ret;
+}
 
-	release_mem_region(drvdata->mem_start, drvdata->mem_end - drvdata->mem_start + 1);
-	kfree(drvdata);
-	dev_set_drvdata(dev, NULL);
-	return 0;
+static unsigned int zpuctl_poll(struct file *file, poll_table *wait)
+{
+	struct zpuinodrv_file *zf = file->private_data;
+	struct zpuinodrv_core *core = zf->core;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	unsigned int mask = 0;
+	uint32_t head, tail;
+
+	poll_wait(file, &drvdata->mbox_wait, wait);
+
+	mutex_lock(&drvdata->lock);
+	if (drvdata->mbox_slots) {
+		head = zpuinodrv_mem_read32(drvdata, ZPU_MBOX_FIELD(drvdata, resp_head));
+		tail = zpuinodrv_mem_read32(drvdata, ZPU_MBOX_FIELD(drvdata, resp_tail));
+		if (head != tail)
+			mask |= POLLIN | POLLRDNORM;
+
+		head = zpuinodrv_mem_read32(drvdata, ZPU_MBOX_FIELD(drvdata, req_head));
+		tail = zpuinodrv_mem_read32(drvdata, ZPU_MBOX_FIELD(drvdata, req_tail));
+		if (head - tail < drvdata->mbox_slots)
+			mask |= POLLOUT | POLLWRNORM;
+	}
+	/* Only re-evaluated on interrupts; without one, use ZPU_IOCTL_WAIT_READY */
+	if (zf->ready_set &&
+	    !(zpuinodrv_readreg( drvdata, ZPUREG_RSTCTL) & BIT(core->index)) &&
+	    (zpuinodrv_mem_read32(drvdata, zf->ready.offset) & zf->ready.mask) == zf->ready.value)
+		mask |= POLLPRI;
+	mutex_unlock(&drvdata->lock);
+
+	return mask;
 }
 
-#ifdef CONFIG_OF
-static struct of_device_id zpuinodrv_of_match[] = {
-	{ .compatible = "xlnx,zynq-zpuino-top-1.0", },
-	{ /* end of list */ },
+
+const struct file_operations zpuctl_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= zpuctl_llseek,
+	.read_iter	= zpuctl_read_iter,
+        .open           = zpuctl_open,
+	.write_iter	= zpuctl_write_iter,
+	.release      	= zpuctl_release,
+	.unlocked_ioctl	= zpuctl_unlocked_ioctl,
+	.mmap		= zpuctl_mmap,
+	.fsync		= zpuctl_fsync,
+	.poll		= zpuctl_poll,
 };
-MODULE_DEVICE_TABLE(of, zpuinodrv_of_match);
-#else
-# define zpuinodrv_of_match
-#endif
 
+/*
+ * The telemetry and watch devices hand out whole records from a kfifo,
+ * with the record type the FIFO was declared with. read() blocks for the
+ * first record only, then bounces as many as fit through "buf", which
+ * holds "batch" of them.
+ */
+static int zpuctl_fifo_open(struct inode *inode, struct file *file, struct zpuinodrv_core *core)
+{
+	file->private_data = core;
+	file->f_mode |= FMODE_NOWAIT;
+	return nonseekable_open(inode, file);
+}
 
+static bool zpuctl_fifo_empty(struct __kfifo *fifo)
+{
+	return READ_ONCE(fifo->in) == READ_ONCE(fifo->out);
+}
 
-static loff_t zpuctl_llseek(struct file *file, loff_t offset, int origin)
+static ssize_t zpuctl_fifo_read(struct kiocb *iocb, struct iov_iter *to, struct __kfifo *fifo,
+				wait_queue_head_t *wait, void *buf, unsigned int batch)
 {
-	struct zpuinodrv_drvdata *drvdata = file->private_data;
-	loff_t new_offset;
+	const size_t size = fifo->esize;
+	size_t want = iov_iter_count(to) / size;
+	size_t copied;
+	ssize_t done = 0;
+	unsigned int n;
 
-	switch (origin) {
-	case SEEK_SET:
-		new_offset = offset;
-		break;
-	case SEEK_CUR:
-		new_offset = drvdata->mem_offset + offset;
-		break;
-	case SEEK_END:
-		new_offset = drvdata->memsize + offset;
-		break;
-	default:
+	if (!want)
 		return -EINVAL;
 
+	while (zpuctl_fifo_empty(fifo)) {
+		if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(*wait, !zpuctl_fifo_empty(fifo)))
+			return -ERESTARTSYS;
 	}
 
-	if (new_offset<0 || new_offset>=drvdata->memsize) {
-		return -EINVAL;
+	while (want) {
+		n = __kfifo_out_peek(fifo, buf, min_t(size_t, want, batch));
+		if (!n)
+			break;
+		copied = copy_to_iter(buf, n * size, to);
+		if (copied % size)
+			iov_iter_revert(to, copied % size);
+		/* Only whole records leave the FIFO */
+		__kfifo_out(fifo, buf, copied / size);
+		done += copied / size * size;
+		want -= copied / size;
+		if (copied != n * size) {
+			if (!done)
+				return -EFAULT;
+			break;
+		}
 	}
+	return done;
+}
 
-	zpuinodrv_writereg( drvdata, ZPUREG_MADDR, new_offset);
+static unsigned int zpuctl_fifo_poll(struct file *file, poll_table *wait, struct __kfifo *fifo,
+				     wait_queue_head_t *queue)
+{
+	poll_wait(file, queue, wait);
 
-	return new_offset;
+	return zpuctl_fifo_empty(fifo) ? 0 : POLLIN | POLLRDNORM;
 }
 
-static ssize_t zpuctl_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *ppos)
+/*
+ * Telemetry device. One reader at a time; it gets the stream from the
+ * moment it opens, and anything still buffered is dropped on close.
+ */
+static int zpuctl_tlm_open(struct inode *inode, struct file *file)
 {
-	int status = 0;
-	struct zpuinodrv_drvdata *drvdata = file->private_data;
-	u32 *kbuf, *kptr;
-	loff_t cpos;
-	size_t to_read;
+	struct zpuinodrv_core *core = container_of(inode->i_cdev, struct zpuinodrv_core, tlm_cdev);
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+	int status;
 
-	if ((count&3)!=0) { /* Allow only word-multiples (i.e., multiples of 4 bytes */
-		status = -EINVAL;
+	mutex_lock(&core->tlm_lock);
+	if (core->tlm_open) {
+		status = -EBUSY;
 		goto error;
 	}
-
-	cpos = drvdata->mem_offset + count;
-
-	if (cpos > drvdata->memsize) {
-		count -= (cpos-drvdata->memsize);
-	}
-
-	kbuf = kmalloc(count, GFP_KERNEL);
-
-	if (kbuf==NULL) {
+	status = kfifo_alloc(&core->tlm_fifo, ZPUCFG_TLM_FIFO, GFP_KERNEL);
+	if (status)
+		goto error;
+	core->tlm_buf = kmalloc_array(ZPUCFG_TLM_BATCH, sizeof(struct zpu_tlm_record), GFP_KERNEL);
+	if (!core->tlm_buf) {
+		kfifo_free(&core->tlm_fifo);
 		status = -ENOMEM;
 		goto error;
 	}
+	mutex_lock(&drvdata->lock);
+	WRITE_ONCE(core->tlm_open, true);
+	schedule_delayed_work(&core->tlm_work, 0);
+	mutex_unlock(&drvdata->lock);
+error:
+	mutex_unlock(&core->tlm_lock);
+	if (status)
+		return status;
+	return zpuctl_fifo_open(inode, file, core);
+}
 
-	kptr = kbuf;
-	to_read = count;
-	while (to_read) {
-		*kptr++ = zpuinodrv_readreg( drvdata, ZPUREG_MACCESS);
-		to_read-=4;
-	}
+static int zpuctl_tlm_release(struct inode *inode, struct file *file)
+{
+	struct zpuinodrv_core *core = file->private_data;
+	struct zpuinodrv_drvdata *drvdata = core->drvdata;
+
+	/*
+	 * tlm_lock is held until the FIFO is gone, so a new opener cannot
+	 * allocate its own before this one is freed. The drain work takes
+	 * only the device lock, which makes it safe to wait for here.
+	 */
+	mutex_lock(&core->tlm_lock);
+	mutex_lock(&drvdata->lock);
+	WRITE_ONCE(core->tlm_open, false);
+	mutex_unlock(&drvdata->lock);
+
+	cancel_delayed_work_sync(&core->tlm_work);
+	kfifo_free(&core->tlm_fifo);
+	kfree(core->tlm_buf);
+	core->tlm_buf = NULL;
+	mutex_unlock(&core->tlm_lock);
 
-	if (copy_to_user(buf, kbuf, count)) {
-		status = -EFAULT;
-		goto error2;
-	}
-	drvdata->mem_offset += count;
+	return 0;
+}
 
-	if (*ppos)
-		*ppos =drvdata->mem_offset;
+static ssize_t zpuctl_tlm_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct zpuinodrv_core *core = iocb->ki_filp->private_data;
 
-	status = count;
-error2:
-	kfree( kbuf );
-error:
-	return status;
+	return zpuctl_fifo_read(iocb, to, &core->tlm_fifo.kfifo, &core->tlm_wait,
+				core->tlm_buf, ZPUCFG_TLM_BATCH);
 }
 
-static ssize_t zpuctl_write(struct file *file, const char __user *buf,
-			    size_t count, loff_t *ppos)
+static unsigned int zpuctl_tlm_poll(struct file *file, poll_table *wait)
 {
-	struct zpuinodrv_drvdata *drvdata = file->private_data;
-	loff_t cpos = drvdata->mem_offset + count;
-	u32 *kbuf, *kptr;
-	int status;
-	size_t to_copy;
+	struct zpuinodrv_core *core = file->private_data;
 
-	if ((count&3)!=0) { /* Allow only word-multiples (i.e., multiples of 4 bytes */
-		status = -EIO;
-		goto error;
-	}
+	return zpuctl_fifo_poll(file, wait, &core->tlm_fifo.kfifo, &core->tlm_wait);
+}
 
-	if (cpos > drvdata->memsize) {
-		count -= (cpos-drvdata->memsize);
-	}
+static const struct file_operations zpuctl_tlm_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= no_llseek,
+	.read_iter	= zpuctl_tlm_read_iter,
+	.splice_read	= generic_file_splice_read,
+	.open		= zpuctl_tlm_open,
+	.release	= zpuctl_tlm_release,
+	.poll		= zpuctl_tlm_poll,
+};
 
-	kbuf = kmalloc(count, GFP_KERNEL);
+/*
+ * Watch device. One opener at a time, which sets the sampler up with
+ * ZPU_IOCTL_WATCH_SETUP and reads what it finds; closing stops it.
+ */
+static int zpuctl_watch_open(struct inode *inode, struct file *file)
+{
+	struct zpuinodrv_core *core = container_of(inode->i_cdev, struct zpuinodrv_core, watch_cdev);
+	int status = 0;
 
-	if (kbuf==NULL) {
-		status = -ENOMEM;
+	mutex_lock(&core->watch_lock);
+	if (core->watch_open) {
+		status = -EBUSY;
 		goto error;
 	}
-
-	if (copy_from_user(kbuf, buf,count)) {
-		status = -EFAULT;
+	status = kfifo_alloc(&core->watch_fifo, ZPUCFG_WATCH_FIFO, GFP_KERNEL);
+	if (status)
+		goto error;
+	core->watch_buf = kmalloc_array(ZPUCFG_WATCH_BATCH, sizeof(struct zpu_watch_record),
+					GFP_KERNEL);
+	if (!core->watch_buf) {
+		kfifo_free(&core->watch_fifo);
+		status = -ENOMEM;
 		goto error;
 	}
-	kptr = kbuf;
-	to_copy = count;
-	while (to_copy) {
-		zpuinodrv_writereg( drvdata, ZPUREG_MACCESS, *kptr++);
-		to_copy-=4;
-	}
-	status = count;
+	core->watch_lost = 0;
+	core->watch_open = true;
 error:
-	kfree(kbuf);
-	return status;
+	mutex_unlock(&core->watch_lock);
+	if (status)
+		return status;
+	return zpuctl_fifo_open(inode, file, core);
 }
 
-static int zpuctl_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static int zpuctl_watch_release(struct inode *inode, struct file *file)
 {
-	int status;
-	uint32_t prev, now;
-
-	struct zpuinodrv_drvdata *drvdata = file->private_data;
+	struct zpuinodrv_core *core = file->private_data;
 
-	switch (cmd) {
-	case ZPU_IOCTL_SETRESET:
-		prev = zpuinodrv_readreg( drvdata, ZPUREG_RSTCTL);
+	mutex_lock(&core->watch_lock);
+	zpuinodrv_watch_stop(core);
+	kfifo_free(&core->watch_fifo);
+	kfree(core->watch_buf);
+	core->watch_buf = NULL;
+	core->watch_open = false;
+	mutex_unlock(&core->watch_lock);
 
-		zpuinodrv_writereg( drvdata, ZPUREG_RSTCTL, (uint32_t)arg);
+	return 0;
+}
 
-		now = zpuinodrv_readreg( drvdata, ZPUREG_RSTCTL);
+static long zpuctl_watch_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct zpuinodrv_core *core = file->private_data;
+	struct zpu_watch watch;
+	struct zpu_watch_stats stats;
+	int ret;
 
-		status = 0;
-		break;
+	switch (cmd) {
+	case ZPU_IOCTL_WATCH_SETUP:
+		if (copy_from_user(&watch, (void __user *)arg, sizeof(watch)))
+			return -EFAULT;
+		mutex_lock(&core->watch_lock);
+		ret = zpuinodrv_watch_setup(core, &watch);
+		mutex_unlock(&core->watch_lock);
+		return ret;
+	case ZPU_IOCTL_WATCH_STATS:
+		spin_lock(&core->watch_stats_lock);
+		stats = core->watch_stats;
+		spin_unlock(&core->watch_stats_lock);
+		stats.elapsed_ns = stats.samples ? ktime_get_ns() - core->watch_start : 0;
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
 	default:
-		status = -EINVAL;
+		return -ENOTTY;
 	}
+}
 
-	return status;
+static ssize_t zpuctl_watch_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct zpuinodrv_core *core = iocb->ki_filp->private_data;
+
+	return zpuctl_fifo_read(iocb, to, &core->watch_fifo.kfifo, &core->watch_wait,
+				core->watch_buf, ZPUCFG_WATCH_BATCH);
 }
 
+static unsigned int zpuctl_watch_poll(struct file *file, poll_table *wait)
+{
+	struct zpuinodrv_core *core = file->private_data;
 
-static int zpuctl_release(struct inode *inode, struct file *file)
+	return zpuctl_fifo_poll(file, wait, &core->watch_fifo.kfifo, &core->watch_wait);
+}
+
+static const struct file_operations zpuctl_watch_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= no_llseek,
+	.read_iter	= zpuctl_watch_read_iter,
+	.splice_read	= generic_file_splice_read,
+	.open		= zpuctl_watch_open,
+	.release	= zpuctl_watch_release,
+	.unlocked_ioctl	= zpuctl_watch_ioctl,
+	.poll		= zpuctl_watch_poll,
+};
+
+/*static struct miscdevice zpuctl_dev = {
+	ZPUCTL_MINOR,
+	"zpuctl",
+	&zpuctl_fops
+};*/
+
+/*
+ * A simulated ZPUino is probed like a real one, memory sizing included.
+ * Its memory size must be a power of two, as real memory is.
+ */
+static unsigned int sim_memsize;
+static unsigned int sim_cores = 1;
+static struct platform_device *zpuinodrv_sim_pdev;
+
+#if IS_ENABLED(ZPUINODRV_SIM)
+module_param(sim_memsize, uint, 0444);
+MODULE_PARM_DESC(sim_memsize, "Memory bytes of a simulated ZPUino, 0 for none");
+module_param(sim_cores, uint, 0444);
+MODULE_PARM_DESC(sim_cores, "Cores of the simulated ZPUino");
+#endif
+
+/*
+ * The simulated sketch. It runs from irq_work, in interrupt context as the
+ * sketch's own interrupt handler would, whenever the host raises
+ * INTRLINE_EXT1/EXT2 or bits are queued in sim->raise. With echo_base
+ * pointing at a mailbox it answers every request with a copy of it, as
+ * far as the response ring has room, then raises the host interrupt like
+ * a real sketch after posting responses.
+ */
+static bool zpuinodrv_sim_echo(struct zpuinodrv_sim *sim)
 {
-	struct zpuinodrv_drvdata *drvdata = file->private_data;
+	struct zpu_mbox_header *h = (void*)&sim->mem[sim->echo_base>>2];
+	struct zpu_mbox_msg *ring = (void*)(h + 1);
+	uint32_t slots = h->slots;
+	uint32_t req_head, req_tail, resp_head, resp_tail;
+	bool moved = false;
+
+	req_head = READ_ONCE(h->req_head);
+	req_tail = READ_ONCE(h->req_tail);
+	resp_head = READ_ONCE(h->resp_head);
+	resp_tail = READ_ONCE(h->resp_tail);
+	smp_rmb(); /* Slots are read after the heads that published them */
+
+	while (req_tail != req_head && resp_head - resp_tail < slots) {
+		ring[slots + resp_head % slots] = ring[req_tail % slots];
+		req_tail++;
+		resp_head++;
+		moved = true;
+	}
 
-	drvdata->is_open = 0;
+	smp_wmb(); /* Responses are in place before they are published */
+	WRITE_ONCE(h->req_tail, req_tail);
+	WRITE_ONCE(h->resp_head, resp_head);
 
-        return 0;
+	return moved;
 }
 
-static int zpuctl_open(struct inode *inode, struct file *file)
+static void zpuinodrv_sim_irq_work(struct irq_work *work)
 {
-	struct zpuinodrv_drvdata *drvdata;
-	int status = -EIO;
+	struct zpuinodrv_sim *sim = container_of(work, struct zpuinodrv_sim, irq_work);
+	uint32_t status = atomic_xchg(&sim->raise, 0);
 
-        drvdata = container_of(inode->i_cdev, struct zpuinodrv_drvdata, cdev);
+	if (sim->echo_base && zpuinodrv_sim_echo(sim))
+		status |= BIT(0);
 
-	if (NULL==drvdata) {
-		status = -ENODEV;
-		goto error;
+	sim->regs[ZPUREG_INTSTAT] |= status;
+	if (sim->regs[ZPUREG_INTSTAT])
+		zpuinodrv_irq(0, sim->lp);
+}
+
+static int zpuinodrv_sim_init(struct zpuinodrv_drvdata *lp, struct device *dev,
+			      const struct zpuinodrv_sim_config *cfg)
+{
+	struct zpuinodrv_sim *sim;
+
+	if (!is_power_of_2(cfg->memsize) || cfg->memsize < 0x200 || cfg->memsize >= 0x40000000 ||
+	    cfg->cores < 1 || cfg->cores > 256) {
+		dev_err(dev, "invalid simulated ZPUino\n");
+		return -EINVAL;
 	}
-	if (drvdata->is_open) {
-		printk(KERN_INFO "Device busy");
-		status = -EBUSY;
-		goto error;
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
+	sim->mem = vzalloc(cfg->memsize);
+	if (!sim->mem) {
+		kfree(sim);
+		return -ENOMEM;
 	}
+	sim->memsize = cfg->memsize;
+	sim->lp = lp;
+	init_irq_work(&sim->irq_work, zpuinodrv_sim_irq_work);
+	atomic_set(&sim->raise, 0);
+	sim->regs[ZPUREG_SIGNATURE] = 0x5A505500;
+	sim->regs[ZPUREG_ZPUCONFIG] = (cfg->cores - 1) << 16;
+	lp->sim = sim;
 
-	drvdata->is_open = 1;
-	drvdata->mem_offset = 0;
+	return 0;
+}
 
-	zpuinodrv_writereg( drvdata, ZPUREG_MADDR, 0);
+/* The telemetry and watch devices of a core are named after its main device */
+static int zpuinodrv_create_side(struct zpuinodrv_core *core, struct cdev *cdev,
+				 const struct file_operations *fops, dev_t devt,
+				 struct device **dev, const char *suffix, struct device *parent)
+{
+	int rc;
 
-	file->private_data = drvdata;
+	cdev_init(cdev, fops);
+	cdev->owner = THIS_MODULE;
+	cdev_set_parent(cdev, &core->drvdata->kobj);
 
-	status = 0;
-error:
-        return status;
+	rc = cdev_add(cdev, devt, 1);
+	if (rc) {
+		dev_err(parent, "cdev_add() failed\n");
+		return rc;
+	}
+
+	*dev = device_create(zpuinodrv_class, parent, devt, core,
+			     "%s-%s", dev_name(core->dev), suffix);
+	if (IS_ERR(*dev)) {
+		dev_err(parent, "unable to create device\n");
+		cdev_del(cdev);
+		return PTR_ERR(*dev);
+	}
+	return 0;
 }
 
-static long zpuctl_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static int zpuinodrv_create_tlm(struct zpuinodrv_core *core, struct device *parent)
 {
-	int ret;
+	mutex_init(&core->tlm_lock);
+	init_waitqueue_head(&core->tlm_wait);
+	INIT_DELAYED_WORK(&core->tlm_work, zpuinodrv_tlm_work);
 
-	mutex_lock(&zpuctl_mutex);
-	ret = zpuctl_ioctl(file, cmd, arg);
-	mutex_unlock(&zpuctl_mutex);
+	core->tlm_devt = MKDEV(MAJOR(zpuinodrv_devt), ZPUCFG_TLM_MINOR(MINOR(core->devt)));
+	return zpuinodrv_create_side(core, &core->tlm_cdev, &zpuctl_tlm_fops, core->tlm_devt,
+				     &core->tlm_dev, "tlm", parent);
+}
 
-	return ret;
+static int zpuinodrv_create_watch(struct zpuinodrv_core *core, struct device *parent)
+{
+	mutex_init(&core->watch_lock);
+	spin_lock_init(&core->watch_stats_lock);
+	init_waitqueue_head(&core->watch_wait);
+
+	core->watch_devt = MKDEV(MAJOR(zpuinodrv_devt), ZPUCFG_WATCH_MINOR(MINOR(core->devt)));
+	return zpuinodrv_create_side(core, &core->watch_cdev, &zpuctl_watch_fops, core->watch_devt,
+				     &core->watch_dev, "watch", parent);
 }
 
+static int zpuinodrv_create_cores(struct zpuinodrv_drvdata *lp, struct device *parent)
+{
+	struct zpuinodrv_core *core;
+	unsigned int i;
+	int minor, rc;
 
-const struct file_operations zpuctl_fops = {
-	.owner		= THIS_MODULE,
-	.llseek		= zpuctl_llseek,
-        .read		= zpuctl_read,
-        .open           = zpuctl_open,
-	.write		= zpuctl_write,
-	.release      	= zpuctl_release,
-	.unlocked_ioctl	= zpuctl_unlocked_ioctl,
-};
+	lp->cores = kcalloc(lp->ncores, sizeof(struct zpuinodrv_core), GFP_KERNEL);
+	if (!lp->cores)
+		return -ENOMEM;
 
-/*static struct miscdevice zpuctl_dev = {
-	ZPUCTL_MINOR,
-	"zpuctl",
-	&zpuctl_fops
-};*/
+	for (i=0; i<lp->ncores; i++) {
+		core = &lp->cores[i];
+		core->drvdata = lp;
+		core->index = i;
 
+		minor = ida_simple_get(&zpuinodrv_minors, 0, ZPUCFG_DEVICES, GFP_KERNEL);
+		if (minor < 0) {
+			rc = minor;
+			goto error;
+		}
+		core->devt = MKDEV(MAJOR(zpuinodrv_devt), minor);
+
+		cdev_init(&core->cdev, &zpuctl_fops);
+		core->cdev.owner = THIS_MODULE;
+		cdev_set_parent(&core->cdev, &lp->kobj);
+
+		rc = cdev_add(&core->cdev, core->devt, 1);
+		if (rc) {
+			dev_err(parent, "cdev_add() failed\n");
+			goto error_minor;
+		}
+
+		/* The first core keeps the historical /dev/zpuinodrv name */
+		if (minor == 0)
+			core->dev = device_create(zpuinodrv_class, parent, core->devt, core,
+						  DRIVER_NAME);
+		else
+			core->dev = device_create(zpuinodrv_class, parent, core->devt, core,
+						  DRIVER_NAME "%d", minor);
+		if (IS_ERR(core->dev)) {
+			dev_err(parent, "unable to create device\n");
+			rc = PTR_ERR(core->dev);
+			goto error_cdev;
+		}
+
+		rc = zpuinodrv_create_tlm(core, parent);
+		if (rc)
+			goto error_device;
+
+		rc = zpuinodrv_create_watch(core, parent);
+		if (rc)
+			goto error_tlm;
+	}
+	return 0;
+
+error_tlm:
+	device_destroy(zpuinodrv_class, core->tlm_devt);
+	cdev_del(&core->tlm_cdev);
+error_device:
+	device_destroy(zpuinodrv_class, core->devt);
+error_cdev:
+	cdev_del(&core->cdev);
+error_minor:
+	ida_simple_remove(&zpuinodrv_minors, minor);
+error:
+	zpuinodrv_destroy_cores(lp, i);
+	return rc;
+}
 
 static int zpuinodrv_probe(struct platform_device *pdev)
 {
@@ -329,75 +2619,74 @@ static int zpuinodrv_probe(struct platform_device *pdev)
 	struct resource *r_mem; /* IO mem resources */
 	struct device *dev = &pdev->dev;
 	struct zpuinodrv_drvdata *drvdata = NULL;
+	const struct zpuinodrv_sim_config *sim = dev_get_platdata(dev);
 	uint32_t signature;
 	uint32_t revision;
         uint32_t memval;
         uint32_t addr = 0x100;
         int rc = 0;
 
-	/* Get iospace for the device */
-	r_mem = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	if (!r_mem) {
-		dev_err(dev, "invalid address\n");
-		return -ENODEV;
-	}
-	drvdata = (struct zpuinodrv_drvdata *) kmalloc(sizeof(struct zpuinodrv_drvdata), GFP_KERNEL);
+	drvdata = (struct zpuinodrv_drvdata *) kzalloc(sizeof(struct zpuinodrv_drvdata), GFP_KERNEL);
 	if (!drvdata) {
 		dev_err(dev, "Cound not allocate zpuinodrv device\n");
 		return -ENOMEM;
 	}
+	kobject_init(&drvdata->kobj, &zpuinodrv_ktype);
 	dev_set_drvdata(dev, drvdata);
-	drvdata->mem_start = r_mem->start;
-	drvdata->mem_end = r_mem->end;
-
-	if (!request_mem_region(drvdata->mem_start,
-				drvdata->mem_end - drvdata->mem_start + 1,
-				DRIVER_NAME)) {
-		dev_err(dev, "Couldn't lock memory region at %p\n",
-			(void *)drvdata->mem_start);
-		rc = -EBUSY;
-		goto error1;
-	}
+	mutex_init(&drvdata->lock);
+	drvdata->irq = -1;
+
+	if (IS_ENABLED(ZPUINODRV_SIM) && sim) {
+		rc = zpuinodrv_sim_init(drvdata, dev, sim);
+		if (rc)
+			goto error1;
+	} else {
+		/* Get iospace for the device */
+		r_mem = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+		if (!r_mem) {
+			dev_err(dev, "invalid address\n");
+			rc = -ENODEV;
+			goto error1;
+		}
 
-	drvdata->base_addr = ioremap(drvdata->mem_start, drvdata->mem_end - drvdata->mem_start + 1);
-	if (!drvdata->base_addr) {
-		dev_err(dev, "zpuinodrv: Could not allocate iomem\n");
-		rc = -EIO;
-		goto error2;
-        }
-        drvdata->irq = -1;
-#if 0
-	/* Get IRQ for the device */
-	r_irq = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
-	if (!r_irq) {
-		dev_info(dev, "no IRQ found\n");
-		dev_info(dev, "zpuinodrv at 0x%08x mapped to 0x%08x\n",
-			(unsigned int __force)drvdata->mem_start,
-			(unsigned int __force)drvdata->base_addr);
-		return 0;
-	}
-	drvdata->irq = r_irq->start;
-	rc = request_irq(drvdata->irq, &zpuinodrv_irq, 0, DRIVER_NAME, drvdata);
-	if (rc) {
-		dev_err(dev, "zpuinodrv: Could not allocate interrupt %d.\n",
-			drvdata->irq);
-		goto error3;
+		if (!request_mem_region(r_mem->start, r_mem->end - r_mem->start + 1,
+					DRIVER_NAME)) {
+			dev_err(dev, "Couldn't lock memory region at %p\n",
+				(void *)r_mem->start);
+			rc = -EBUSY;
+			goto error1;
+		}
+		/* From here on zpuinodrv_release_regs() gives the region back */
+		drvdata->mem_start = r_mem->start;
+		drvdata->mem_end = r_mem->end;
+
+		drvdata->base_addr = ioremap(drvdata->mem_start, drvdata->mem_end - drvdata->mem_start + 1);
+		if (!drvdata->base_addr) {
+			dev_err(dev, "zpuinodrv: Could not allocate iomem\n");
+			rc = -EIO;
+			goto error1;
+		}
 	}
-#endif
         // Probe
 	signature = zpuinodrv_readreg( drvdata, ZPUREG_SIGNATURE );
 
 	if ((signature&0xFFFFFF00)!=0x5A505500) {
             dev_err(dev,"Invalid signature\n");
-            goto error2;
+            rc = -ENODEV;
+            goto error1;
         }
 
 	revision = zpuinodrv_readreg( drvdata, ZPUREG_ZPUCONFIG );
+	drvdata->ncores = 1+((revision>>16)&0xFF);
 
-	/* Detect memory size */
+	if (drvdata->ncores > ZPUCFG_MAX_CORES) {
+		dev_err(dev, "%u cores, only %d supported\n", drvdata->ncores, ZPUCFG_MAX_CORES);
+		rc = -ENODEV;
+		goto error1;
+	}
 
-	/* Place ZPU under reset */
-	zpuinodrv_writereg( drvdata, ZPUREG_RSTCTL, 1);
+	/* Place all cores under reset */
+	zpuinodrv_writereg( drvdata, ZPUREG_RSTCTL, GENMASK(drvdata->ncores-1, 0));
         /* Detect memory size */
 
         zpuinodrv_writereg( drvdata, ZPUREG_MADDR,   0x00000000);
@@ -419,64 +2708,55 @@ static int zpuinodrv_probe(struct platform_device *pdev)
 	if (addr==0x40000000) {
 		dev_err(dev,"Cannot determine ZPUino memory size");
 		rc = -EIO;
-		goto error2;
+		goto error1;
                 }
 
 	drvdata->memsize = addr;
 
+	drvdata->bounce = kmalloc(ZPUCFG_BOUNCE_SIZE, GFP_KERNEL);
+	if (!drvdata->bounce) {
+		rc = -ENOMEM;
+		goto error1;
+	}
+
+	init_waitqueue_head(&drvdata->mbox_wait);
+	atomic_set(&drvdata->mbox_events, 0);
+
+	/* Get IRQ for the device. Without it the mailbox is unavailable */
+	r_irq = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
+	if (!r_irq) {
+		dev_info(dev, "no IRQ found, mailbox disabled\n");
+	} else {
+		drvdata->irq = r_irq->start;
+		rc = request_irq(drvdata->irq, &zpuinodrv_irq, 0, DRIVER_NAME, drvdata);
+		if (rc) {
+			dev_err(dev, "zpuinodrv: Could not allocate interrupt %d.\n",
+				drvdata->irq);
+			drvdata->irq = -1;
+			goto error1;
+		}
+	}
+
 	dev_info(dev,"Found ZPUino at 0x%08x, rev %d. %d cores, 0x%08x bytes memory.\n",
 		 drvdata->mem_start,
 		 revision & 0xFFFF,
-		 1+((revision>>16)&0xFF),
+		 drvdata->ncores,
 		 drvdata->memsize);
 
-	drvdata->is_open = 0;
-
-	dev_t devt;
-
-	rc = alloc_chrdev_region(&devt, 0, ZPUCFG_DEVICES, DRIVER_NAME);
-	if (rc < 0)
-		goto error2;
-
-	drvdata->devt = devt;
-
-	cdev_init(&drvdata->cdev, &zpuctl_fops);
-
-	drvdata->cdev.owner = THIS_MODULE;
-
-	rc = cdev_add(&drvdata->cdev, devt, 1);
-	if (rc) {
-		dev_err(dev, "cdev_add() failed\n");
-		goto error3;
-	}
-
-	drvdata->class = class_create(THIS_MODULE, DRIVER_NAME);
-	if (IS_ERR(drvdata->class)) {
-		dev_err(dev, "failed to create class\n");
+	rc = zpuinodrv_create_cores(drvdata, &pdev->dev);
+	if (rc)
 		goto error3;
-	}
-
-	dev = device_create(drvdata->class, &pdev->dev, devt, drvdata,
-			    DRIVER_NAME);
-	if (IS_ERR(dev)) {
-		dev_err(dev, "unable to create device\n");
-		goto error4;
-	}
 
+	zpuinodrv_debugfs_init(drvdata, &pdev->dev);
 
 	return 0;
-error4:
-	class_destroy(drvdata->class);
 
 error3:
-	unregister_chrdev_region(devt, ZPUCFG_DEVICES);
-
-	//free_irq(lp->irq, drvdata);
-error2:
-	release_mem_region(drvdata->mem_start, drvdata->mem_end - drvdata->mem_start + 1);
+	if (drvdata->irq >= 0)
+		free_irq(drvdata->irq, drvdata);
 error1:
-	kfree(drvdata);
 	dev_set_drvdata(dev, NULL);
+	kobject_put(&drvdata->kobj);
 	return rc;
 }
 
@@ -496,14 +2776,59 @@ static int __init zpuinodrv_init(void)
 	int ret;
 	printk(KERN_INFO "ZPUino ZYNQ driver (C) Alvaro Lopes 2018\n");
 
+	/* Minors and the class are shared by all instances */
+	ret = alloc_chrdev_region(&zpuinodrv_devt, 0, ZPUCFG_MINORS, DRIVER_NAME);
+	if (ret < 0)
+		return ret;
+
+	zpuinodrv_class = class_create(THIS_MODULE, DRIVER_NAME);
+	if (IS_ERR(zpuinodrv_class)) {
+		ret = PTR_ERR(zpuinodrv_class);
+		goto error1;
+	}
+
+	/* Statistics are optional, carry on without debugfs */
+	zpuinodrv_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+	if (IS_ERR(zpuinodrv_debugfs_root))
+		zpuinodrv_debugfs_root = NULL;
+
 	ret = platform_driver_register(&zpuinodrv_driver);
+	if (ret)
+		goto error2;
+
+	if (IS_ENABLED(ZPUINODRV_SIM) && sim_memsize) {
+		struct zpuinodrv_sim_config cfg = { sim_memsize, sim_cores };
+
+		zpuinodrv_sim_pdev = platform_device_register_data(NULL, DRIVER_NAME, PLATFORM_DEVID_NONE,
+								   &cfg, sizeof(cfg));
+		if (IS_ERR(zpuinodrv_sim_pdev)) {
+			ret = PTR_ERR(zpuinodrv_sim_pdev);
+			zpuinodrv_sim_pdev = NULL;
+			goto error3;
+		}
+	}
+
+	return 0;
+
+error3:
+	platform_driver_unregister(&zpuinodrv_driver);
+error2:
+	debugfs_remove_recursive(zpuinodrv_debugfs_root);
+	class_destroy(zpuinodrv_class);
+error1:
+	unregister_chrdev_region(zpuinodrv_devt, ZPUCFG_MINORS);
 	return ret;
 }
 
 
 static void __exit zpuinodrv_exit(void)
 {
+	if (zpuinodrv_sim_pdev)
+		platform_device_unregister(zpuinodrv_sim_pdev);
 	platform_driver_unregister(&zpuinodrv_driver);
+	debugfs_remove_recursive(zpuinodrv_debugfs_root);
+	class_destroy(zpuinodrv_class);
+	unregister_chrdev_region(zpuinodrv_devt, ZPUCFG_MINORS);
 }
 
 module_init(zpuinodrv_init);
@@ -512,3 +2837,7 @@ module_exit(zpuinodrv_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alvaro Lopes");
 MODULE_DESCRIPTION("zpuinodrv - ZPUino driver for Zynq devices");
+
+#if IS_ENABLED(ZPUINODRV_KUNIT)
+#include "zpuinodrv_test.c"
+#endif
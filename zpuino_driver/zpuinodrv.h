@@ -0,0 +1,260 @@
+/*  zpuinodrv.h - ZPUino driver userspace interface
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef __ZPUINODRV_H__
+#define __ZPUINODRV_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Mailbox. The sketch places a header followed by two rings of
+ * ZPU_MBOX_MSG_SIZE slots (requests, then responses) somewhere in ZPU
+ * memory, and the host is told where through ZPU_IOCTL_MBOX_SETUP.
+ * There is one mailbox per instance, as there is one pair of interrupt
+ * lines, and it belongs to the sketch on core 0: holding that core in
+ * reset forgets it, while resetting the other cores leaves it alone.
+ * Heads and tails are free-running counters; a ring holds head-tail
+ * messages, in slot (index % slots).
+ *
+ * The host raises INTRLINE_EXT1 on the ZPU after posting requests and
+ * INTRLINE_EXT2 after consuming responses. The sketch raises the host
+ * interrupt after posting responses or consuming requests.
+ *
+ * Interrupts take two registers past the original host interface, and
+ * an interrupt line for the instance in the device tree:
+ *
+ *   5  INTCTL   Write only. Bit 0 pulses INTRLINE_EXT1 on the ZPU, bit 1
+ *               INTRLINE_EXT2.
+ *   6  INTSTAT  Bits set from the ZPU side to interrupt the host, which
+ *               writes 1s to clear them. The host interrupt is asserted
+ *               while any bit is set.
+ *
+ * Without the interrupt line ZPU_IOCTL_MBOX_SETUP fails with ENXIO, and
+ * telemetry and ZPU_IOCTL_WAIT_READY fall back to polling ZPU memory.
+ */
+#define ZPU_MBOX_MAGIC      0x4D424F58 /* "MBOX" */
+#define ZPU_MBOX_MSG_WORDS  6
+
+struct zpu_mbox_header {
+	__u32 magic;
+	__u32 slots;
+	__u32 req_head;   /* Written by host */
+	__u32 req_tail;   /* Written by ZPU */
+	__u32 resp_head;  /* Written by ZPU */
+	__u32 resp_tail;  /* Written by host */
+};
+
+struct zpu_mbox_msg {
+	__u32 id;
+	__u32 len;
+	__u32 data[ZPU_MBOX_MSG_WORDS];
+};
+
+#define ZPU_MBOX_MSG_SIZE sizeof(struct zpu_mbox_msg)
+
+/* Batch of messages for ZPU_IOCTL_MBOX_SEND/RECV. "done" is filled in */
+struct zpu_mbox_xfer {
+	__u64 msgs;       /* struct zpu_mbox_msg array */
+	__u32 count;
+	__u32 done;
+};
+
+/*
+ * Telemetry. The sketch places a header followed by "slots" events in
+ * ZPU memory and logs into it as the only producer: it fills slot
+ * (head % slots), then advances head. When the ring is full it counts
+ * the event in "dropped" instead. TSC is the free-running TIMERTSC
+ * counter at the ZPU clock (CLK_FREQ), which wraps around.
+ *
+ * Once told where through ZPU_IOCTL_TLM_SETUP, the driver drains the
+ * ring into a kernel FIFO whenever the sketch raises the host interrupt,
+ * and every few milliseconds anyway, while the core's telemetry device
+ * (zpuinodrv-tlm, zpuinodrvN-tlm) is open. read() on that device returns
+ * whole zpu_tlm_records, stamped with the CLOCK_REALTIME at which they
+ * were drained. Drops are reported in-band, as ZPU_TLM_ID_DROPPED
+ * records carrying the number of events lost in arg[0]. Holding the
+ * core in reset forgets the ring, so a new sketch has to set it up again.
+ */
+#define ZPU_TLM_MAGIC       0x544C4D52 /* "TLMR" */
+#define ZPU_TLM_ID_DROPPED  0xFFFFFFFF
+
+struct zpu_tlm_header {
+	__u32 magic;
+	__u32 slots;
+	__u32 head;       /* Written by ZPU */
+	__u32 tail;       /* Written by host */
+	__u32 dropped;    /* Written by ZPU */
+};
+
+struct zpu_tlm_event {
+	__u32 tsc;
+	__u32 id;
+	__u32 arg[2];
+};
+
+struct zpu_tlm_record {
+	__u64 host_ns;    /* When drained */
+	__u32 tsc;
+	__u32 id;
+	__u32 arg[2];
+};
+
+/*
+ * Memory watch. ZPU_IOCTL_WATCH_SETUP on a core's watch device
+ * (zpuinodrv-watch, zpuinodrvN-watch) samples up to ZPU_WATCH_RANGES
+ * ranges of ZPU memory every period_ns, from a kernel thread woken by an
+ * hrtimer. All ranges of a sample are read under one lock. Every word
+ * that changed since the previous sample (every word, in the first one)
+ * is queued as a zpu_watch_record, which read() returns whole. Records
+ * that did not fit are reported in-band as a ZPU_WATCH_DROPPED record
+ * carrying their number in "value". Periods that the sampler could not
+ * keep up with are skipped, and counted as missed in ZPU_IOCTL_WATCH_STATS.
+ * Setting up again restarts sampling; a period of 0 stops it. Values are
+ * words as the ZPU sees them, whatever the swap setting.
+ */
+#define ZPU_WATCH_RANGES     8
+#define ZPU_WATCH_WORDS      1024 /* Over all ranges */
+#define ZPU_WATCH_MIN_PERIOD 10000
+#define ZPU_WATCH_DROPPED    0xFFFFFFFF
+
+struct zpu_watch_range {
+	__u32 offset;
+	__u32 len;
+};
+
+struct zpu_watch {
+	__u64 period_ns;
+	__u32 count;
+	__u32 reserved;
+	struct zpu_watch_range range[ZPU_WATCH_RANGES];
+};
+
+struct zpu_watch_record {
+	__u64 ns;         /* CLOCK_MONOTONIC of the sample */
+	__u32 offset;
+	__u32 value;
+};
+
+struct zpu_watch_stats {
+	__u64 elapsed_ns; /* Since setup */
+	__u64 samples;
+	__u64 missed;     /* Periods skipped */
+	__u64 busy_ns;    /* Spent sampling */
+	__u64 changes;    /* Records queued */
+	__u64 dropped;    /* Records that did not fit */
+};
+
+/*
+ * CRC16-CCITT (reflected poly 0x8408, init 0xFFFF, as programmed into
+ * the ZPU CRC16 unit by the bootloader) of len bytes at offset, taken
+ * in ZPU byte order.
+ */
+struct zpu_checksum {
+	__u32 offset;
+	__u32 len;
+	__u32 crc;        /* Filled in */
+};
+
+/*
+ * Scatter-gather transfer: every descriptor moves len bytes between ZPU
+ * memory at offset and the user buffer, all under one lock. Offsets and
+ * lengths must be word multiples. "done" is the number of descriptors
+ * completed, also when the ioctl fails.
+ */
+#define ZPU_IOV_READ     0 /* ZPU memory to buffer */
+#define ZPU_IOV_WRITE    1 /* Buffer to ZPU memory */
+
+struct zpu_iovec {
+	__u64 buf;
+	__u32 offset;
+	__u32 len;
+	__u32 dir;
+	__u32 reserved;
+};
+
+struct zpu_iovec_xfer {
+	__u64 iov;        /* struct zpu_iovec array */
+	__u32 count;
+	__u32 done;
+};
+
+/*
+ * Operations inside ZPU memory. MEMSET fills len bytes at dst with the
+ * word "value"; MEMMOVE copies len bytes from src to dst, which may
+ * overlap; MEMCMP compares len bytes at dst and src and sets "value" to
+ * the offset of the first differing word, or 0xFFFFFFFF if they match.
+ */
+struct zpu_memop {
+	__u32 dst;
+	__u32 src;
+	__u32 len;
+	__u32 value;
+};
+
+/*
+ * Ready handshake. Once running, the sketch stores "value" in the word at
+ * "offset" (compared under "mask"), and may raise the host interrupt.
+ * ZPU_IOCTL_WAIT_READY waits up to timeout_ms for it (0 checks once and
+ * fails with EAGAIN) and returns the time since reset was released. Fails
+ * with ETIMEDOUT, or EINVAL while the core is held in reset. After a wait,
+ * poll() reports the same condition as POLLPRI.
+ */
+struct zpu_ready {
+	__u32 offset;
+	__u32 mask;
+	__u32 value;
+	__u32 timeout_ms;
+	__u64 ns;         /* Filled in: reset release to ready */
+};
+
+/*
+ * Load tag. A loader that has just written a sketch may leave a tag for
+ * the instance with ZPU_IOCTL_SET_LOADTAG, and the next one reads it back
+ * with ZPU_IOCTL_GET_LOADTAG to know that ZPU memory still holds what was
+ * loaded. Every host write to ZPU memory (write(), XFER, MEMSET, MEMMOVE,
+ * mmap() stores once written back) resets it to 0, on any core. Releasing
+ * reset does not: the sketch changing its own memory, mailbox and
+ * telemetry rings included, is for the loader to allow for.
+ */
+#define ZPU_IOCTL_SETRESET  _IOW('Z', 0, unsigned)
+#define ZPU_IOCTL_MBOX_SETUP _IOW('Z', 1, __u32)
+#define ZPU_IOCTL_MBOX_SEND _IOWR('Z', 2, struct zpu_mbox_xfer)
+#define ZPU_IOCTL_MBOX_RECV _IOWR('Z', 3, struct zpu_mbox_xfer)
+#define ZPU_IOCTL_SET_LOADTAG _IOW('Z', 4, __u64)
+#define ZPU_IOCTL_GET_LOADTAG _IOR('Z', 5, __u64)
+#define ZPU_IOCTL_CHECKSUM  _IOWR('Z', 6, struct zpu_checksum)
+#define ZPU_IOCTL_XFER      _IOWR('Z', 7, struct zpu_iovec_xfer)
+#define ZPU_IOCTL_MEMSET    _IOW('Z', 8, struct zpu_memop)
+#define ZPU_IOCTL_MEMMOVE   _IOW('Z', 9, struct zpu_memop)
+#define ZPU_IOCTL_MEMCMP    _IOWR('Z', 10, struct zpu_memop)
+/* Byte-swap words on read()/write()/XFER for this open file */
+#define ZPU_IOCTL_SETSWAP   _IOW('Z', 11, unsigned)
+/*
+ * Hold read()/write() data in a kernel copy of ZPU memory while all cores
+ * are in reset, writing dirty words back on reset release or FLUSH.
+ */
+#define ZPU_IOCTL_SETCACHE  _IOW('Z', 12, unsigned)
+#define ZPU_IOCTL_FLUSH     _IO('Z', 13)
+#define ZPU_IOCTL_WAIT_READY _IOWR('Z', 14, struct zpu_ready)
+#define ZPU_IOCTL_TLM_SETUP _IOW('Z', 15, __u32)
+/* On the watch device */
+#define ZPU_IOCTL_WATCH_SETUP _IOW('Z', 16, struct zpu_watch)
+#define ZPU_IOCTL_WATCH_STATS _IOR('Z', 17, struct zpu_watch_stats)
+
+#endif
@@ -0,0 +1,563 @@
+/*  zpuinodrv_test.c - KUnit suite for the ZPUino driver
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Included at the end of zpuinodrv.c, so that the file operations can be
+ * driven directly. Every test probes its own simulated ZPUino through
+ * the platform bus, opens it the way a process would and goes through
+ * zpuctl_read_iter()/zpuctl_write_iter()/zpuctl_llseek() with kernel
+ * buffers. The mailbox cases play the sketch through the simulation's
+ * echo and interrupt. Transfer paths are timed as they are checked, and
+ * the rates are printed with the results so that changes show up in
+ * every run.
+ */
+#include <kunit/test.h>
+
+#define ZPUTEST_MEMSIZE   0x100000
+#define ZPUTEST_CORES     2
+#define ZPUTEST_XFER      0x10000 /* Bytes per read()/write() when timing */
+#define ZPUTEST_BENCH     (16 << 20) /* Bytes moved per timed path */
+#define ZPUTEST_MBOX      0x8000
+#define ZPUTEST_SLOTS     8
+#define ZPUTEST_ROUNDTRIPS 10000
+
+struct zpuinodrv_test {
+	struct platform_device *pdev;
+	struct zpuinodrv_drvdata *lp;
+	struct inode *inode;
+	struct file *file;
+};
+
+static struct platform_device *zpuinodrv_test_probe_sim(struct kunit *test, uint32_t memsize,
+							 unsigned int cores)
+{
+	struct zpuinodrv_sim_config cfg = { memsize, cores };
+	struct platform_device *pdev;
+
+	pdev = platform_device_register_data(NULL, DRIVER_NAME, PLATFORM_DEVID_AUTO,
+					     &cfg, sizeof(cfg));
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pdev);
+	if (!platform_get_drvdata(pdev)) {
+		platform_device_unregister(pdev);
+		KUNIT_ASSERT_TRUE_MSG(test, false, "simulated ZPUino did not probe");
+	}
+	return pdev;
+}
+
+/* An open file on a core, as zpuctl_open() sets it up */
+static struct file *zpuinodrv_test_open(struct kunit *test, struct zpuinodrv_core *core,
+					fmode_t mode)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct file *file;
+
+	file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, file);
+	t->inode = kunit_kzalloc(test, sizeof(*t->inode), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->inode);
+
+	t->inode->i_cdev = &core->cdev;
+	file->f_mode = mode;
+	KUNIT_ASSERT_EQ(test, zpuctl_open(t->inode, file), 0);
+	return file;
+}
+
+static ssize_t zpuinodrv_test_xfer(struct file *file, void *buf, size_t len, loff_t pos,
+				   bool write)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	struct kiocb kiocb;
+
+	memset(&kiocb, 0, sizeof(kiocb));
+	kiocb.ki_filp = file;
+	kiocb.ki_pos = pos;
+	iov_iter_kvec(&iter, write ? WRITE : READ, &kv, 1, len);
+
+	return write ? zpuctl_write_iter(&kiocb, &iter) : zpuctl_read_iter(&kiocb, &iter);
+}
+
+/* What a sketch does: set INTSTAT bits and interrupt the host */
+static void zpuinodrv_test_raise(struct zpuinodrv_sim *sim, uint32_t status)
+{
+	atomic_or(status, &sim->raise);
+	irq_work_queue(&sim->irq_work);
+}
+
+/* Lays out an empty mailbox, as a sketch would, optionally answering it */
+static void zpuinodrv_test_sim_mbox(struct zpuinodrv_sim *sim, bool echo)
+{
+	struct zpu_mbox_header *h = (void*)&sim->mem[ZPUTEST_MBOX>>2];
+
+	memset(h, 0, sizeof(*h) + 2 * ZPUTEST_SLOTS * ZPU_MBOX_MSG_SIZE);
+	h->magic = ZPU_MBOX_MAGIC;
+	h->slots = ZPUTEST_SLOTS;
+	smp_wmb();
+	WRITE_ONCE(sim->echo_base, echo ? ZPUTEST_MBOX : 0);
+}
+
+static int zpuinodrv_test_mbox_xfer(struct zpuinodrv_drvdata *lp, unsigned int cmd,
+				    struct zpu_mbox_msg *msgs, unsigned count, bool nonblock)
+{
+	struct kvec kv = { .iov_base = msgs, .iov_len = count * ZPU_MBOX_MSG_SIZE };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, cmd == ZPU_IOCTL_MBOX_SEND ? WRITE : READ, &kv, 1, kv.iov_len);
+	return zpuinodrv_mbox_xfer(lp, cmd, &iter, count, nonblock);
+}
+
+static u64 zpuinodrv_test_mbps(u64 bytes, u64 ns)
+{
+	return div64_u64(bytes * 1000, ns | 1);
+}
+
+static int zpuinodrv_test_init(struct kunit *test)
+{
+	struct zpuinodrv_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	test->priv = t;
+
+	t->pdev = zpuinodrv_test_probe_sim(test, ZPUTEST_MEMSIZE, ZPUTEST_CORES);
+	t->lp = platform_get_drvdata(t->pdev);
+	t->file = zpuinodrv_test_open(test, &t->lp->cores[0], FMODE_READ | FMODE_WRITE);
+	return 0;
+}
+
+static void zpuinodrv_test_exit(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+
+	if (t->file)
+		zpuctl_release(t->inode, t->file);
+	if (t->pdev)
+		platform_device_unregister(t->pdev);
+}
+
+/* Memory sizing and core count, for memories from the smallest up */
+static void zpuinodrv_test_probe(struct kunit *test)
+{
+	static const uint32_t sizes[] = { 0x200, 0x8000, 0x40000, 0x400000 };
+	struct platform_device *pdev;
+	struct zpuinodrv_drvdata *lp;
+	unsigned int i, cores;
+	u64 t0, ns;
+
+	for (i=0; i<ARRAY_SIZE(sizes); i++) {
+		cores = 1 + i;
+		t0 = ktime_get_ns();
+		pdev = zpuinodrv_test_probe_sim(test, sizes[i], cores);
+		ns = ktime_get_ns() - t0;
+		lp = platform_get_drvdata(pdev);
+
+		KUNIT_EXPECT_EQ(test, lp->memsize, sizes[i]);
+		KUNIT_EXPECT_EQ(test, lp->ncores, cores);
+		KUNIT_EXPECT_EQ(test, zpuinodrv_readreg(lp, ZPUREG_RSTCTL),
+				(uint32_t)GENMASK(cores - 1, 0));
+		kunit_info(test, "probe of %u cores, 0x%x bytes: %llu us\n",
+			   cores, sizes[i], div_u64(ns, 1000));
+
+		platform_device_unregister(pdev);
+	}
+}
+
+/* More cores than RSTCTL has reset bits, or than there are minors */
+static void zpuinodrv_test_probe_cores(struct kunit *test)
+{
+	struct zpuinodrv_sim_config cfg = { 0x1000, ZPUCFG_MAX_CORES + 1 };
+	struct platform_device *pdev;
+
+	pdev = platform_device_register_data(NULL, DRIVER_NAME, PLATFORM_DEVID_AUTO,
+					     &cfg, sizeof(cfg));
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pdev);
+	KUNIT_EXPECT_NULL(test, platform_get_drvdata(pdev));
+	platform_device_unregister(pdev);
+}
+
+/* An open file keeps the instance, and its memory, past remove() */
+static void zpuinodrv_test_remove_open(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_drvdata *lp = t->lp;
+	struct cdev *cdev = &lp->cores[0].cdev;
+	struct zpu_mbox_msg msg = { .id = 1 };
+	u32 word = 0x12345678;
+
+	/* The reference chrdev_open() takes for the file */
+	kobject_get(&cdev->kobj);
+
+	zpuinodrv_test_sim_mbox(lp->sim, true);
+	KUNIT_ASSERT_EQ(test, zpuctl_unlocked_ioctl(t->file, ZPU_IOCTL_MBOX_SETUP, ZPUTEST_MBOX), 0L);
+
+	platform_device_unregister(t->pdev);
+	t->pdev = NULL;
+
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, &word, 4, 0x100, true), (ssize_t)4);
+	KUNIT_EXPECT_EQ(test, lp->sim->mem[0x100>>2], word);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_SEND, &msg, 1, false),
+			-ENXIO);
+
+	/* Closing it frees the instance */
+	zpuctl_release(t->inode, t->file);
+	t->file = NULL;
+	kobject_put(&cdev->kobj);
+}
+
+static void zpuinodrv_test_read_write(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_sim *sim = t->lp->sim;
+	const size_t len = 3 * ZPUCFG_BOUNCE_SIZE + 12;
+	const loff_t pos = 0x1004;
+	u32 *out, *in;
+	size_t i;
+
+	out = kunit_kmalloc(test, len, GFP_KERNEL);
+	in = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, in);
+	for (i=0; i<len>>2; i++)
+		out[i] = 0x01000193 * (i + 1);
+
+	/* Across several bounce buffers, landing in memory word by word */
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, out, len, pos, true), (ssize_t)len);
+	KUNIT_EXPECT_EQ(test, memcmp(sim->mem + (pos>>2), out, len), 0);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, in, len, pos, false), (ssize_t)len);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+
+	/* Whole words only */
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, out, 6, pos, true), (ssize_t)-EIO);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, in, 6, pos, false), (ssize_t)-EINVAL);
+
+	/* Transfers stop at the end of memory */
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, out, 16, t->lp->memsize - 8, true),
+			(ssize_t)8);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, in, 16, t->lp->memsize - 8, false),
+			(ssize_t)8);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, out, 4, t->lp->memsize, true),
+			(ssize_t)-ENOSPC);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, in, 4, t->lp->memsize, false),
+			(ssize_t)0);
+
+	/* Swapped words reach memory in ZPU byte order */
+	KUNIT_EXPECT_EQ(test, zpuctl_unlocked_ioctl(t->file, ZPU_IOCTL_SETSWAP, 1), 0L);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, out, 8, 0x100, true), (ssize_t)8);
+	KUNIT_EXPECT_EQ(test, sim->mem[0x100>>2], swab32(out[0]));
+	KUNIT_EXPECT_EQ(test, sim->mem[(0x100>>2) + 1], swab32(out[1]));
+}
+
+/* Reads leave the load tag alone, every kind of write resets it */
+static void zpuinodrv_test_loadtag(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_drvdata *lp = t->lp;
+	struct zpu_memop op = { .dst = 0x200, .src = 0x100, .len = 0x40 };
+	u32 words[4] = { 1, 2, 3, 4 };
+
+	lp->loadtag = 0x1234;
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, words, sizeof(words), 0x100, false),
+			(ssize_t)sizeof(words));
+	KUNIT_EXPECT_EQ(test, lp->loadtag, 0x1234ULL);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_xfer(t->file, words, sizeof(words), 0x100, true),
+			(ssize_t)sizeof(words));
+	KUNIT_EXPECT_EQ(test, lp->loadtag, 0ULL);
+
+	mutex_lock(&lp->lock);
+	lp->loadtag = 0x1234;
+	KUNIT_EXPECT_EQ(test, zpuinodrv_memset(lp, &op), 0);
+	KUNIT_EXPECT_EQ(test, lp->loadtag, 0ULL);
+	lp->loadtag = 0x1234;
+	KUNIT_EXPECT_EQ(test, zpuinodrv_memmove(lp, &op), 0);
+	KUNIT_EXPECT_EQ(test, lp->loadtag, 0ULL);
+	mutex_unlock(&lp->lock);
+}
+
+static void zpuinodrv_test_llseek(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	loff_t memsize = t->lp->memsize;
+
+	KUNIT_EXPECT_EQ(test, zpuctl_llseek(t->file, 0x1008, SEEK_SET), (loff_t)0x1008);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, (loff_t)0x1008);
+	KUNIT_EXPECT_EQ(test, zpuctl_llseek(t->file, 8, SEEK_CUR), (loff_t)0x1010);
+	KUNIT_EXPECT_EQ(test, zpuctl_llseek(t->file, -4, SEEK_END), memsize - 4);
+
+	/* A rejected seek leaves the offset alone */
+	KUNIT_EXPECT_EQ(test, zpuctl_llseek(t->file, -1, SEEK_SET), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, zpuctl_llseek(t->file, 0, SEEK_END), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, zpuctl_llseek(t->file, 0, 42), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, memsize - 4);
+}
+
+/* Whole-memory passes through read()/write() and seeks, timed */
+static void zpuinodrv_test_throughput(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	uint32_t memsize = t->lp->memsize;
+	u64 t0, ns, done;
+	unsigned int i, seeks = 10000;
+	void *buf;
+	loff_t pos;
+
+	buf = kunit_kzalloc(test, ZPUTEST_XFER, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	t0 = ktime_get_ns();
+	for (done = 0; done < ZPUTEST_BENCH; done += ZPUTEST_XFER) {
+		pos = done & (memsize - 1);
+		KUNIT_ASSERT_EQ(test, zpuinodrv_test_xfer(t->file, buf, ZPUTEST_XFER, pos, true),
+				(ssize_t)ZPUTEST_XFER);
+	}
+	ns = ktime_get_ns() - t0;
+	kunit_info(test, "write: %llu MB/s in %u byte writes\n",
+		   zpuinodrv_test_mbps(done, ns), ZPUTEST_XFER);
+
+	t0 = ktime_get_ns();
+	for (done = 0; done < ZPUTEST_BENCH; done += ZPUTEST_XFER) {
+		pos = done & (memsize - 1);
+		KUNIT_ASSERT_EQ(test, zpuinodrv_test_xfer(t->file, buf, ZPUTEST_XFER, pos, false),
+				(ssize_t)ZPUTEST_XFER);
+	}
+	ns = ktime_get_ns() - t0;
+	kunit_info(test, "read: %llu MB/s in %u byte reads\n",
+		   zpuinodrv_test_mbps(done, ns), ZPUTEST_XFER);
+
+	t0 = ktime_get_ns();
+	for (i=0; i<seeks; i++)
+		zpuctl_llseek(t->file, (i * 4) & (memsize - 1), SEEK_SET);
+	ns = ktime_get_ns() - t0;
+	kunit_info(test, "llseek: %llu ns\n", div_u64(ns, seeks));
+}
+
+/*
+ * The pre-streaming read()/write(): a kmalloc() per call and one
+ * MACCESS access per word. Kept here as the baseline for the bounce
+ * buffer engine.
+ */
+static ssize_t zpuinodrv_test_legacy_xfer(struct zpuinodrv_drvdata *lp, struct iov_iter *iter,
+					  loff_t offset, size_t count, bool write)
+{
+	u32 *kbuf, *kptr;
+	size_t left;
+
+	kbuf = kmalloc(count, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	zpuinodrv_writereg( lp, ZPUREG_MADDR, offset);
+	kptr = kbuf;
+	if (write) {
+		if (copy_from_iter(kbuf, count, iter) != count) {
+			kfree(kbuf);
+			return -EFAULT;
+		}
+		for (left = count; left; left -= 4)
+			zpuinodrv_writereg( lp, ZPUREG_MACCESS, *kptr++);
+	} else {
+		for (left = count; left; left -= 4)
+			*kptr++ = zpuinodrv_readreg( lp, ZPUREG_MACCESS);
+		if (copy_to_iter(kbuf, count, iter) != count) {
+			kfree(kbuf);
+			return -EFAULT;
+		}
+	}
+	kfree(kbuf);
+	return count;
+}
+
+/* Bounce buffer engine against the legacy path, same data, same sizes */
+static void zpuinodrv_test_bounce_vs_legacy(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_drvdata *lp = t->lp;
+	static const size_t sizes[] = { 64, 1024, ZPUCFG_BOUNCE_SIZE, ZPUTEST_XFER };
+	struct iov_iter iter;
+	struct kvec kv;
+	u64 t0, ns[2][2], done;
+	unsigned int i, path, dir;
+	loff_t pos;
+	ssize_t ret;
+	void *buf;
+
+	buf = kunit_kzalloc(test, ZPUTEST_XFER, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	mutex_lock(&lp->lock);
+	for (i=0; i<ARRAY_SIZE(sizes); i++) {
+		for (path=0; path<2; path++) {
+			for (dir=0; dir<2; dir++) {
+				t0 = ktime_get_ns();
+				for (done = 0; done < ZPUTEST_BENCH / 4; done += sizes[i]) {
+					kv.iov_base = buf;
+					kv.iov_len = sizes[i];
+					iov_iter_kvec(&iter, dir ? WRITE : READ, &kv, 1, sizes[i]);
+					pos = done & (lp->memsize - 1);
+					if (path)
+						ret = zpuinodrv_test_legacy_xfer(lp, &iter, pos,
+										 sizes[i], dir);
+					else if (dir)
+						ret = zpuinodrv_stream_from_iter(lp, &iter, pos,
+										 sizes[i], false);
+					else
+						ret = zpuinodrv_stream_to_iter(lp, &iter, pos,
+									       sizes[i], false);
+					if (ret != sizes[i])
+						break;
+				}
+				ns[path][dir] = ktime_get_ns() - t0;
+				KUNIT_EXPECT_EQ(test, ret, (ssize_t)sizes[i]);
+			}
+		}
+		kunit_info(test, "%zu byte transfers: read %llu/%llu MB/s, write %llu/%llu MB/s (bounce/legacy)\n",
+			   sizes[i],
+			   zpuinodrv_test_mbps(done, ns[0][0]), zpuinodrv_test_mbps(done, ns[1][0]),
+			   zpuinodrv_test_mbps(done, ns[0][1]), zpuinodrv_test_mbps(done, ns[1][1]));
+	}
+	mutex_unlock(&lp->lock);
+}
+
+/* INTSTAT is acked and waiters woken when the sketch interrupts */
+static void zpuinodrv_test_irq(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_drvdata *lp = t->lp;
+	int seen = atomic_read(&lp->mbox_events);
+
+	zpuinodrv_test_raise(lp->sim, BIT(2));
+	KUNIT_EXPECT_GT(test, wait_event_timeout(lp->mbox_wait,
+						 atomic_read(&lp->mbox_events) != seen, HZ), 0L);
+	irq_work_sync(&lp->sim->irq_work);
+	KUNIT_EXPECT_EQ(test, lp->sim->regs[ZPUREG_INTSTAT], 0U);
+
+	/* A shared line with nothing pending is not ours */
+	KUNIT_EXPECT_EQ(test, zpuinodrv_irq(0, lp), IRQ_NONE);
+}
+
+static void zpuinodrv_test_mbox(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_drvdata *lp = t->lp;
+	struct zpu_mbox_msg *out, *in;
+	struct file *other;
+	unsigned int i, n = ZPUTEST_SLOTS + 2;
+	int seen;
+
+	out = kunit_kcalloc(test, n, ZPU_MBOX_MSG_SIZE, GFP_KERNEL);
+	in = kunit_kcalloc(test, n, ZPU_MBOX_MSG_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, in);
+	for (i=0; i<n; i++) {
+		out[i].id = i + 1;
+		out[i].len = 4;
+		out[i].data[0] = 0xC0FFEE00 + i;
+	}
+
+	/* No mailbox until the sketch has laid one out */
+	KUNIT_EXPECT_EQ(test, zpuctl_poll(t->file, NULL), 0U);
+	KUNIT_EXPECT_EQ(test, zpuctl_unlocked_ioctl(t->file, ZPU_IOCTL_MBOX_SETUP, ZPUTEST_MBOX),
+			(long)-ENOENT);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_SEND, out, 1, true),
+			-ENXIO);
+
+	/* A sketch that does not answer yet: requests fill the ring */
+	zpuinodrv_test_sim_mbox(lp->sim, false);
+	KUNIT_ASSERT_EQ(test, zpuctl_unlocked_ioctl(t->file, ZPU_IOCTL_MBOX_SETUP, ZPUTEST_MBOX), 0L);
+	KUNIT_EXPECT_EQ(test, zpuctl_poll(t->file, NULL), (unsigned int)(POLLOUT | POLLWRNORM));
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_SEND, out, n, true),
+			ZPUTEST_SLOTS);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_SEND, out, 1, true),
+			-EAGAIN);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_RECV, in, 1, true),
+			-EAGAIN);
+	KUNIT_EXPECT_EQ(test, zpuctl_poll(t->file, NULL), 0U);
+
+	/* Once it answers, the interrupt brings the responses in */
+	seen = atomic_read(&lp->mbox_events);
+	WRITE_ONCE(lp->sim->echo_base, ZPUTEST_MBOX);
+	zpuinodrv_test_raise(lp->sim, 0);
+	KUNIT_ASSERT_GT(test, wait_event_timeout(lp->mbox_wait,
+						 atomic_read(&lp->mbox_events) != seen, HZ), 0L);
+	KUNIT_EXPECT_EQ(test, zpuctl_poll(t->file, NULL),
+			(unsigned int)(POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM));
+
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_RECV, in, n, true),
+			ZPUTEST_SLOTS);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, ZPUTEST_SLOTS * ZPU_MBOX_MSG_SIZE), 0);
+
+	/* Blocking both ways, through a ring smaller than the batch */
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_SEND, out, 2, false), 2);
+	KUNIT_EXPECT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_RECV, in, 2, false), 2);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, 2 * ZPU_MBOX_MSG_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, zpuctl_poll(t->file, NULL), (unsigned int)(POLLOUT | POLLWRNORM));
+
+	/* The mailbox is core 0's: resetting another core leaves it alone */
+	other = zpuinodrv_test_open(test, &lp->cores[1], FMODE_READ | FMODE_WRITE);
+	KUNIT_EXPECT_EQ(test, zpuctl_unlocked_ioctl(other, ZPU_IOCTL_SETRESET, 1), 0L);
+	KUNIT_EXPECT_EQ(test, lp->mbox_slots, (uint32_t)ZPUTEST_SLOTS);
+	zpuctl_release(t->inode, other);
+	KUNIT_EXPECT_EQ(test, zpuctl_unlocked_ioctl(t->file, ZPU_IOCTL_SETRESET, 1), 0L);
+	KUNIT_EXPECT_EQ(test, lp->mbox_slots, 0U);
+}
+
+/* One message there and back, waiting on the interrupt each way */
+static void zpuinodrv_test_mbox_latency(struct kunit *test)
+{
+	struct zpuinodrv_test *t = test->priv;
+	struct zpuinodrv_drvdata *lp = t->lp;
+	struct zpu_mbox_msg msg = { .id = 1 };
+	unsigned int i;
+	u64 t0, ns;
+
+	zpuinodrv_test_sim_mbox(lp->sim, true);
+	KUNIT_ASSERT_EQ(test, zpuctl_unlocked_ioctl(t->file, ZPU_IOCTL_MBOX_SETUP, ZPUTEST_MBOX), 0L);
+
+	t0 = ktime_get_ns();
+	for (i=0; i<ZPUTEST_ROUNDTRIPS; i++) {
+		KUNIT_ASSERT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_SEND, &msg, 1, false), 1);
+		KUNIT_ASSERT_EQ(test, zpuinodrv_test_mbox_xfer(lp, ZPU_IOCTL_MBOX_RECV, &msg, 1, false), 1);
+	}
+	ns = ktime_get_ns() - t0;
+	kunit_info(test, "mailbox round trip: %llu ns\n", div_u64(ns, ZPUTEST_ROUNDTRIPS));
+}
+
+static struct kunit_case zpuinodrv_test_cases[] = {
+	KUNIT_CASE(zpuinodrv_test_probe),
+	KUNIT_CASE(zpuinodrv_test_probe_cores),
+	KUNIT_CASE(zpuinodrv_test_read_write),
+	KUNIT_CASE(zpuinodrv_test_loadtag),
+	KUNIT_CASE(zpuinodrv_test_llseek),
+	KUNIT_CASE(zpuinodrv_test_throughput),
+	KUNIT_CASE(zpuinodrv_test_bounce_vs_legacy),
+	KUNIT_CASE(zpuinodrv_test_irq),
+	KUNIT_CASE(zpuinodrv_test_mbox),
+	KUNIT_CASE(zpuinodrv_test_mbox_latency),
+	KUNIT_CASE(zpuinodrv_test_remove_open),
+	{}
+};
+
+static struct kunit_suite zpuinodrv_test_suite = {
+	.name = "zpuinodrv",
+	.init = zpuinodrv_test_init,
+	.exit = zpuinodrv_test_exit,
+	.test_cases = zpuinodrv_test_cases,
+};
+
+kunit_test_suite(zpuinodrv_test_suite);
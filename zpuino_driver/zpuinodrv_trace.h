@@ -0,0 +1,117 @@
+/*  zpuinodrv_trace.h - ZPUino driver tracepoints
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM zpuinodrv
+
+#if !defined(__ZPUINODRV_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __ZPUINODRV_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(zpuinodrv_xfer,
+
+	TP_PROTO(unsigned int minor, loff_t offset, size_t count, ssize_t ret, u64 ns),
+
+	TP_ARGS(minor, offset, count, ret, ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, offset)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offset = offset;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+
+	TP_printk("minor=%u offset=0x%llx count=%zu ret=%zd ns=%llu",
+		  __entry->minor, (unsigned long long)__entry->offset,
+		  __entry->count, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(zpuinodrv_xfer, zpuinodrv_read,
+	TP_PROTO(unsigned int minor, loff_t offset, size_t count, ssize_t ret, u64 ns),
+	TP_ARGS(minor, offset, count, ret, ns)
+);
+
+DEFINE_EVENT(zpuinodrv_xfer, zpuinodrv_write,
+	TP_PROTO(unsigned int minor, loff_t offset, size_t count, ssize_t ret, u64 ns),
+	TP_ARGS(minor, offset, count, ret, ns)
+);
+
+TRACE_EVENT(zpuinodrv_seek,
+
+	TP_PROTO(unsigned int minor, loff_t offset, int origin, loff_t ret),
+
+	TP_ARGS(minor, offset, origin, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, offset)
+		__field(int, origin)
+		__field(loff_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offset = offset;
+		__entry->origin = origin;
+		__entry->ret = ret;
+	),
+
+	TP_printk("minor=%u offset=0x%llx origin=%d ret=%lld",
+		  __entry->minor, (unsigned long long)__entry->offset,
+		  __entry->origin, (long long)__entry->ret)
+);
+
+TRACE_EVENT(zpuinodrv_reset,
+
+	TP_PROTO(unsigned int minor, u32 prev, u32 now),
+
+	TP_ARGS(minor, prev, now),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, prev)
+		__field(u32, now)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->prev = prev;
+		__entry->now = now;
+	),
+
+	TP_printk("minor=%u rstctl=0x%08x->0x%08x",
+		  __entry->minor, __entry->prev, __entry->now)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE zpuinodrv_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,683 @@
+/*  zpuinod.c - ZPUino sketch preload daemon
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "zpuino.h"
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+#define DEFAULT_SOCKET   "/run/zpuinod.sock"
+
+#define MAX_CLIENTS      32
+#define LINE_MAX_LEN     512
+
+/*
+ * The daemon holds the device open and keeps every sketch it was given
+ * resident, already checked, byte-swapped to host order and with its CRC
+ * known. A swap then only holds reset for the write itself.
+ *
+ * Clients talk to it over a Unix stream socket, one command per line:
+ *
+ *   load PATH      read and validate a sketch, named after its file
+ *   unload NAME    drop a sketch
+ *   swap NAME      load NAME and release reset; answered once done
+ *   list           resident sketches, "*" marking the loaded one
+ *   stats          swap latency statistics
+ *
+ * Replies are one line starting with "ok" or "error", or for list and
+ * stats several lines ending with ".". Swap requests are queued, and all
+ * those that arrive while a swap is in progress are coalesced: only the
+ * last one is carried out, and the others are answered "superseded".
+ */
+
+struct image {
+        char *name;
+        char *path;
+        uint32_t *data;         /* Host order */
+        size_t size;
+        uint16_t crc;
+        /* Swaps to this image */
+        unsigned swaps;
+        double reset_ms_total;
+        double reset_ms_min;
+        double reset_ms_max;
+};
+
+struct client {
+        int fd;
+        char line[LINE_MAX_LEN];
+        size_t len;
+        int eof;
+        int pending;            /* Image waiting for, or -1 */
+        struct timespec queued;
+};
+
+struct daemon {
+        struct zpuino *zp;
+        struct image *images;
+        unsigned nimages;
+        int current;            /* Loaded image, or -1 */
+        int verify;
+        struct zpuino_ready ready;
+        struct client clients[MAX_CLIENTS];
+        /* Totals */
+        unsigned swaps;
+        unsigned failed;
+        unsigned coalesced;
+        double queue_ms_total;
+        double queue_ms_max;
+        double ready_ms_total;
+        double ready_ms_max;
+};
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+        quit = 1;
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec)*1e3 + (end->tv_nsec - start->tv_nsec)/1e6;
+}
+
+static void reply(struct client *cl, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void reply(struct client *cl, const char *fmt, ...)
+{
+        char buf[LINE_MAX_LEN];
+        va_list ap;
+        int len;
+
+        va_start(ap, fmt);
+        len = vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        if (len >= (int)sizeof(buf))
+                len = sizeof(buf) - 1;
+        /* Clients that stop reading are dropped rather than waited for */
+        if (send(cl->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT)!=len)
+                cl->eof = 1;
+}
+
+static int find_image(struct daemon *d, const char *name)
+{
+        unsigned i;
+
+        for (i=0; i<d->nimages; i++) {
+                if (strcmp(d->images[i].name, name)==0 ||
+                    strcmp(d->images[i].path, name)==0)
+                        return i;
+        }
+        return -1;
+}
+
+/*
+ * Read, check and swap a sketch once, so a swap only has to write it.
+ * Returns the image index, or -1 with a message in "error".
+ */
+static int image_load(struct daemon *d, const char *path, const char **error)
+{
+        struct image *img, *n;
+        const char *base;
+        uint8_t *file = NULL;
+        uint32_t hdr[2];
+        size_t size, aligned, i;
+        struct stat st;
+        int fd, index;
+
+        base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        if (find_image(d, base)>=0) {
+                *error = "name already loaded";
+                return -1;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd<0 || fstat(fd, &st)<0) {
+                *error = strerror(errno);
+                goto fail;
+        }
+        if (st.st_size < 8 || read(fd, hdr, sizeof(hdr))!=sizeof(hdr)) {
+                *error = "short file";
+                goto fail;
+        }
+        if (zpuino_sketch_check(hdr)<0) {
+                *error = "not a sketch for this board";
+                goto fail;
+        }
+        size = st.st_size - 8;
+        aligned = (size + 3) & ~3;
+        if (ZPUINO_SKETCH_OFFSET + aligned > zpuino_memsize(d->zp)) {
+                *error = "does not fit in memory";
+                goto fail;
+        }
+        file = calloc(1, aligned ? aligned : 4);
+        if (file==NULL || read(fd, file, size)!=(ssize_t)size) {
+                *error = file ? "short read" : "out of memory";
+                goto fail;
+        }
+        close(fd);
+        fd = -1;
+
+        n = realloc(d->images, (d->nimages + 1) * sizeof(*d->images));
+        if (n==NULL) {
+                *error = "out of memory";
+                goto fail;
+        }
+        d->images = n;
+        index = d->nimages;
+        img = &n[index];
+        memset(img, 0, sizeof(*img));
+        img->crc = zpuino_crc16(ZPUINO_CRC16_INIT, file, aligned);
+        img->data = (uint32_t*)file;
+        for (i=0; i<aligned>>2; i++)
+                img->data[i] = be32toh(img->data[i]);
+        img->size = aligned;
+        img->name = strdup(base);
+        img->path = strdup(path);
+        d->nimages++;
+        return index;
+fail:
+        if (fd>=0)
+                close(fd);
+        free(file);
+        return -1;
+}
+
+static void image_unload(struct daemon *d, int index)
+{
+        struct image *img = &d->images[index];
+        unsigned i;
+
+        for (i=0; i<MAX_CLIENTS; i++) {
+                if (d->clients[i].fd>=0 && d->clients[i].pending==index) {
+                        reply(&d->clients[i], "error %s: unloaded\n", img->name);
+                        d->clients[i].pending = -1;
+                }
+        }
+        free(img->name);
+        free(img->path);
+        free(img->data);
+        memmove(img, img + 1, (d->nimages - index - 1) * sizeof(*img));
+        d->nimages--;
+
+        if (d->current==index)
+                d->current = -1;
+        else if (d->current>index)
+                d->current--;
+        for (i=0; i<MAX_CLIENTS; i++) {
+                if (d->clients[i].pending>index)
+                        d->clients[i].pending--;
+        }
+}
+
+/*
+ * Reset is held only while the image is written (and checked, with -V).
+ * Clearing the ready word and waiting for it work as in zpuinoload -r.
+ */
+static const char *do_swap(struct daemon *d, int index, double *reset_ms, double *ready_ms)
+{
+        struct image *img = &d->images[index];
+        struct timespec start, end;
+        const char *error = NULL;
+        uint64_t ns;
+        uint16_t crc;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (zpuino_reset(d->zp, 1)<0)
+                return "cannot hold reset";
+        d->current = -1;
+
+        if (zpuino_pwrite(d->zp, img->data, img->size, ZPUINO_SKETCH_OFFSET)!=(ssize_t)img->size)
+                error = "short write";
+        else if (d->verify && zpuino_checksum(d->zp, ZPUINO_SKETCH_OFFSET, img->size, &crc)<0)
+                error = "checksum failed";
+        else if (d->verify && crc!=img->crc)
+                error = "verify failed";
+        else if (d->ready.set && zpuino_memset(d->zp, d->ready.offset, 4, 0)<0)
+                error = "cannot clear ready word";
+        else if (zpuino_reset(d->zp, 0)<0)
+                error = "cannot release reset";
+        if (error)
+                return error;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        *reset_ms = elapsed_ms(&start, &end);
+        d->current = index;
+
+        *ready_ms = 0;
+        if (d->ready.set) {
+                if (zpuino_wait_ready(d->zp, d->ready.offset, d->ready.mask, d->ready.value,
+                                      d->ready.timeout_ms, &ns)<0)
+                        return errno==ETIMEDOUT ? "not ready" : "ready wait failed";
+                *ready_ms = ns / 1e6;
+        }
+        return NULL;
+}
+
+/* Carry out the newest queued swap, and answer everyone waiting */
+static void run_swaps(struct daemon *d)
+{
+        struct client *cl, *last = NULL;
+        struct image *img;
+        struct timespec now;
+        const char *error;
+        double reset_ms = 0, ready_ms = 0, queue_ms;
+        unsigned i;
+        int target;
+
+        for (i=0; i<MAX_CLIENTS; i++) {
+                cl = &d->clients[i];
+                if (cl->fd>=0 && cl->pending>=0 &&
+                    (last==NULL || elapsed_ms(&last->queued, &cl->queued)>=0))
+                        last = cl;
+        }
+        if (last==NULL)
+                return;
+        target = last->pending;
+        img = &d->images[target];
+
+        error = do_swap(d, target, &reset_ms, &ready_ms);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (error) {
+                d->failed++;
+        } else {
+                d->swaps++;
+                img->swaps++;
+                img->reset_ms_total += reset_ms;
+                if (img->swaps==1 || reset_ms < img->reset_ms_min)
+                        img->reset_ms_min = reset_ms;
+                if (reset_ms > img->reset_ms_max)
+                        img->reset_ms_max = reset_ms;
+                d->ready_ms_total += ready_ms;
+                if (ready_ms > d->ready_ms_max)
+                        d->ready_ms_max = ready_ms;
+        }
+
+        for (i=0; i<MAX_CLIENTS; i++) {
+                cl = &d->clients[i];
+                if (cl->fd<0 || cl->pending<0)
+                        continue;
+                queue_ms = elapsed_ms(&cl->queued, &now);
+                if (cl->pending!=target) {
+                        d->coalesced++;
+                        reply(cl, "superseded by %s\n", img->name);
+                } else if (error) {
+                        reply(cl, "error %s: %s\n", img->name, error);
+                } else {
+                        d->queue_ms_total += queue_ms;
+                        if (queue_ms > d->queue_ms_max)
+                                d->queue_ms_max = queue_ms;
+                        if (d->ready.set)
+                                reply(cl, "ok %s reset %.3f ms ready %.3f ms total %.3f ms\n",
+                                      img->name, reset_ms, ready_ms, queue_ms);
+                        else
+                                reply(cl, "ok %s reset %.3f ms total %.3f ms\n",
+                                      img->name, reset_ms, queue_ms);
+                }
+                cl->pending = -1;
+        }
+}
+
+static void send_stats(struct daemon *d, struct client *cl)
+{
+        const struct image *img;
+        unsigned i;
+
+        reply(cl, "swaps %u failed %u coalesced %u\n", d->swaps, d->failed, d->coalesced);
+        if (d->swaps) {
+                reply(cl, "request-to-done %.3f ms avg %.3f ms max\n",
+                      d->queue_ms_total / d->swaps, d->queue_ms_max);
+                if (d->ready.set)
+                        reply(cl, "reset-to-ready %.3f ms avg %.3f ms max\n",
+                              d->ready_ms_total / d->swaps, d->ready_ms_max);
+        }
+        for (i=0; i<d->nimages; i++) {
+                img = &d->images[i];
+                if (img->swaps==0)
+                        continue;
+                reply(cl, "%s swaps %u reset %.3f/%.3f/%.3f ms min/avg/max\n",
+                      img->name, img->swaps, img->reset_ms_min,
+                      img->reset_ms_total / img->swaps, img->reset_ms_max);
+        }
+        reply(cl, ".\n");
+}
+
+static void command(struct daemon *d, struct client *cl, char *line)
+{
+        char *arg = strchr(line, ' ');
+        const char *error;
+        unsigned i;
+        int index;
+
+        if (arg) {
+                *arg++ = '\0';
+                while (*arg==' ')
+                        arg++;
+        }
+
+        if (strcmp(line, "swap")==0 && arg && *arg) {
+                index = find_image(d, arg);
+                if (index<0) {
+                        reply(cl, "error %s: no such sketch\n", arg);
+                        return;
+                }
+                if (cl->pending>=0)
+                        d->coalesced++;
+                cl->pending = index;
+                clock_gettime(CLOCK_MONOTONIC, &cl->queued);
+        } else if (strcmp(line, "load")==0 && arg && *arg) {
+                index = image_load(d, arg, &error);
+                if (index<0)
+                        reply(cl, "error %s: %s\n", arg, error);
+                else
+                        reply(cl, "ok %s %zu bytes crc %04x\n", d->images[index].name,
+                              d->images[index].size, d->images[index].crc);
+        } else if (strcmp(line, "unload")==0 && arg && *arg) {
+                index = find_image(d, arg);
+                if (index<0) {
+                        reply(cl, "error %s: no such sketch\n", arg);
+                        return;
+                }
+                image_unload(d, index);
+                reply(cl, "ok\n");
+        } else if (strcmp(line, "list")==0) {
+                for (i=0; i<d->nimages; i++)
+                        reply(cl, "%c %s %zu %04x %s\n", (int)i==d->current ? '*' : ' ',
+                              d->images[i].name, d->images[i].size, d->images[i].crc,
+                              d->images[i].path);
+                reply(cl, ".\n");
+        } else if (strcmp(line, "stats")==0) {
+                send_stats(d, cl);
+        } else {
+                reply(cl, "error unknown command\n");
+        }
+}
+
+static void client_input(struct daemon *d, struct client *cl)
+{
+        ssize_t r;
+        char *nl;
+
+        r = read(cl->fd, cl->line + cl->len, sizeof(cl->line) - cl->len - 1);
+        if (r<=0) {
+                if (r==0 || (errno!=EINTR && errno!=EAGAIN))
+                        cl->eof = 1;
+                return;
+        }
+        cl->len += r;
+        cl->line[cl->len] = '\0';
+
+        while ((nl = strchr(cl->line, '\n'))) {
+                *nl = '\0';
+                if (nl > cl->line && nl[-1]=='\r')
+                        nl[-1] = '\0';
+                if (cl->line[0])
+                        command(d, cl, cl->line);
+                cl->len -= nl + 1 - cl->line;
+                memmove(cl->line, nl + 1, cl->len + 1);
+        }
+        if (cl->len==sizeof(cl->line) - 1) {
+                reply(cl, "error line too long\n");
+                cl->eof = 1;
+        }
+}
+
+static int serve(struct daemon *d, const char *sockpath)
+{
+        struct sockaddr_un addr;
+        struct pollfd pfd[MAX_CLIENTS + 1];
+        struct client *slot[MAX_CLIENTS + 1];
+        struct client *cl;
+        unsigned i, n;
+        int lfd, fd, r;
+        mode_t mask;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+                fprintf(stderr,"Socket path too long\n");
+                return -1;
+        }
+        strcpy(addr.sun_path, sockpath);
+
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (lfd<0) {
+                perror("socket");
+                return -1;
+        }
+        /* Whoever can connect can load code onto the ZPU: owner and group only */
+        unlink(sockpath);
+        mask = umask(0117);
+        r = bind(lfd, (struct sockaddr*)&addr, sizeof(addr));
+        umask(mask);
+        if (r<0 || listen(lfd, 8)<0) {
+                perror(sockpath);
+                close(lfd);
+                return -1;
+        }
+
+        for (i=0; i<MAX_CLIENTS; i++)
+                d->clients[i].fd = -1;
+
+        while (!quit) {
+                n = 0;
+                pfd[n].fd = lfd;
+                pfd[n].events = POLLIN;
+                slot[n++] = NULL;
+                for (i=0; i<MAX_CLIENTS; i++) {
+                        if (d->clients[i].fd<0)
+                                continue;
+                        pfd[n].fd = d->clients[i].fd;
+                        pfd[n].events = POLLIN;
+                        slot[n++] = &d->clients[i];
+                }
+
+                if (poll(pfd, n, -1)<0) {
+                        if (errno==EINTR)
+                                continue;
+                        perror("poll");
+                        break;
+                }
+
+                /* Take in everything that arrived, then swap once */
+                for (i=1; i<n; i++) {
+                        if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                                client_input(d, slot[i]);
+                }
+                run_swaps(d);
+
+                for (i=0; i<MAX_CLIENTS; i++) {
+                        cl = &d->clients[i];
+                        if (cl->fd>=0 && cl->eof && cl->pending<0) {
+                                close(cl->fd);
+                                cl->fd = -1;
+                        }
+                }
+
+                if (pfd[0].revents & POLLIN) {
+                        fd = accept(lfd, NULL, NULL);
+                        if (fd<0)
+                                continue;
+                        for (i=0; i<MAX_CLIENTS && d->clients[i].fd>=0; i++)
+                                ;
+                        if (i==MAX_CLIENTS) {
+                                close(fd);
+                                continue;
+                        }
+                        cl = &d->clients[i];
+                        memset(cl, 0, sizeof(*cl));
+                        cl->fd = fd;
+                        cl->pending = -1;
+                }
+        }
+
+        for (i=0; i<MAX_CLIENTS; i++) {
+                if (d->clients[i].fd>=0)
+                        close(d->clients[i].fd);
+        }
+        close(lfd);
+        unlink(sockpath);
+        return 0;
+}
+
+/* Send one command and copy the reply to stdout */
+static int client(const char *sockpath, const char *cmd)
+{
+        struct sockaddr_un addr;
+        char buf[LINE_MAX_LEN];
+        ssize_t r;
+        int fd, error = 0;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd<0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))<0) {
+                perror(sockpath);
+                if (fd>=0)
+                        close(fd);
+                return -1;
+        }
+        snprintf(buf, sizeof(buf), "%s\n", cmd);
+        if (write(fd, buf, strlen(buf))<0) {
+                perror("write");
+                close(fd);
+                return -1;
+        }
+        shutdown(fd, SHUT_WR);
+
+        while ((r = read(fd, buf, sizeof(buf)))>0) {
+                if (strncmp(buf, "error", 5)==0 || strncmp(buf, "superseded", 10)==0)
+                        error = 1;
+                fwrite(buf, 1, r, stdout);
+        }
+        close(fd);
+        return error ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] [-s socket] [-V] [-r ready [-t ms]] [sketch.bin...]\n", name);
+        fprintf(stderr,"       %s [-s socket] -c command\n", name);
+        fprintf(stderr,"  -d device   ZPUino device, uio:/dev/uioN[:size] or mock[:size] (default %s)\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -s socket   Control socket (default %s)\n", DEFAULT_SOCKET);
+        fprintf(stderr,"  -V          Verify every swap by CRC before removing reset\n");
+        fprintf(stderr,"  -r ready    Wait for the sketch to store a value in a word after each swap,\n");
+        fprintf(stderr,"              as offset[,value[,mask]] (default value 1, all bits)\n");
+        fprintf(stderr,"  -t ms       Timeout for -r (default %u)\n", ZPUINO_READY_DEFAULT_TIMEOUT);
+        fprintf(stderr,"  -c command  Send a command to a running daemon: load PATH, unload NAME,\n");
+        fprintf(stderr,"              swap NAME, list or stats\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE;
+        const char *sockpath = DEFAULT_SOCKET;
+        const char *cmd = NULL;
+        const char *error;
+        struct daemon d;
+        struct sigaction sa;
+        unsigned i;
+        int c, r;
+
+        memset(&d, 0, sizeof(d));
+        d.current = -1;
+        d.ready.timeout_ms = ZPUINO_READY_DEFAULT_TIMEOUT;
+
+        while ((c=getopt(argc, argv, "d:s:Vr:t:c:"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 's':
+                        sockpath = optarg;
+                        break;
+                case 'V':
+                        d.verify = 1;
+                        break;
+                case 'r':
+                        if (zpuino_ready_parse(optarg, &d.ready)<0) {
+                                fprintf(stderr,"Bad ready word \"%s\", expected offset[,value[,mask]]\n", optarg);
+                                return -1;
+                        }
+                        break;
+                case 't':
+                        d.ready.timeout_ms = strtoul(optarg, NULL, 0);
+                        break;
+                case 'c':
+                        cmd = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+
+        if (cmd)
+                return client(sockpath, cmd)<0 ? -1 : 0;
+
+        d.zp = zpuino_open(devname);
+        if (d.zp==NULL) {
+                fprintf(stderr,"cannot open %s: %s\n", devname, strerror(errno));
+                return -1;
+        }
+        /* Images are kept in host order */
+        zpuino_setswap(d.zp, 0);
+
+        for (; optind<argc; optind++) {
+                if (image_load(&d, argv[optind], &error)<0) {
+                        fprintf(stderr,"%s: %s\n", argv[optind], error);
+                        zpuino_close(d.zp);
+                        return -1;
+                }
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        r = serve(&d, sockpath);
+
+        for (i=0; i<d.nimages; i++) {
+                free(d.images[i].name);
+                free(d.images[i].path);
+                free(d.images[i].data);
+        }
+        free(d.images);
+        zpuino_close(d.zp);
+        return r;
+}
@@ -19,54 +19,179 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
-#include <linux/ioctl.h>
 #include <string.h>
 #include <endian.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 
-#define ZPU_IOCTL_SETRESET _IOW('Z', 0, unsigned)
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SWAP_NEON
+#elif defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define SWAP_SSSE3
+#endif
 
-#define SKETCH_SIGNATURE 0x310AFADE
-#define SKETCH_BOARD     0xBC010000
-#define SKETCH_OFFSET    0x1008
+#include "zpuino.h"
 
-int main(int argc, char **argv)
+#define SKETCH_OFFSET    ZPUINO_SKETCH_OFFSET
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+
+/* Pipelined loader ring */
+#define RING_CHUNKS      4
+#define RING_CHUNK_SIZE  16384
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
 {
-        uint32_t v;
-        int r, sketchfd, drvfd;
-        unsigned aligned_sketch_size;
+        return (end->tv_sec - start->tv_sec)*1e3 + (end->tv_nsec - start->tv_nsec)/1e6;
+}
 
-        if (argc<2)
+static int check_header(const uint32_t *hdr)
+{
+        if (zpuino_sketch_check(hdr)<0) {
+                fprintf(stderr,"Invalid sketch header %08x %08x\n", be32toh(hdr[0]), be32toh(hdr[1]));
                 return -1;
+        }
+        return 0;
+}
 
-        sketchfd = open(argv[1], O_RDONLY);
-        if (sketchfd<0) {
-                perror("cannot open");
-                return -1;
+/* CRC of host-order words as they are laid out in ZPU memory */
+static uint16_t crc16_words(uint16_t crc, const uint32_t *words, unsigned count)
+{
+        uint32_t be;
+
+        while (count--) {
+                be = htobe32(*words++);
+                crc = zpuino_crc16(crc, &be, sizeof(be));
         }
-        if (read(sketchfd,&v,sizeof(v))!=sizeof(v)) {
-                perror("read");
-                close(sketchfd);
-                return -1;
+        return crc;
+}
+
+/* What was written, for verification */
+struct load_info {
+        unsigned size;
+        uint16_t crc;
+        uint64_t tag;           /* Load tag to leave in the driver, 0 for none */
+};
+
+/*
+ * Byte-swap "words" 32-bit words from src into dst (which may be the
+ * same buffer), 16 bytes at a time where the CPU has a byte shuffle.
+ * src does not need to be aligned. NEON is taken for granted where the
+ * compiler targets it (the Makefile asks for it on 32-bit ARM, as every
+ * Zynq has it); SSSE3 is built in on x86 and used if the CPU has it.
+ * The shuffles return how many words they did, a multiple of 4.
+ */
+#if defined(SWAP_NEON)
+static unsigned swap16(uint8_t *d, const uint8_t *s, unsigned words)
+{
+        unsigned n;
+
+        for (n=0; n+4<=words; n+=4, s+=16, d+=16)
+                vst1q_u8(d, vrev32q_u8(vld1q_u8(s)));
+        return n;
+}
+#elif defined(SWAP_SSSE3)
+__attribute__((target("ssse3")))
+static unsigned swap16_ssse3(uint8_t *d, const uint8_t *s, unsigned words)
+{
+        const __m128i mask = _mm_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+        unsigned n;
+
+        for (n=0; n+4<=words; n+=4, s+=16, d+=16) {
+                __m128i x = _mm_loadu_si128((const __m128i*)s);
+                _mm_storeu_si128((__m128i*)d, _mm_shuffle_epi8(x, mask));
         }
-        if ( htobe32(v) != SKETCH_SIGNATURE)  {
-                fprintf(stderr,"Invalid signature %08x\n", htobe32(v));
-                close(sketchfd);
-                return -1;
+        return n;
+}
+
+static unsigned swap16(uint8_t *d, const uint8_t *s, unsigned words)
+{
+        return __builtin_cpu_supports("ssse3") ? swap16_ssse3(d, s, words) : 0;
+}
+#else
+static unsigned swap16(uint8_t *d, const uint8_t *s, unsigned words)
+{
+        return 0;
+}
+#endif
+
+static void swap_words(uint32_t *dst, const void *src, unsigned words)
+{
+        const uint8_t *s = (const uint8_t*)src;
+        uint8_t *d = (uint8_t*)dst;
+        unsigned done;
+        uint32_t v;
+
+        done = swap16(d, s, words);
+        s += done*4; d += done*4; words -= done;
+
+        while (words--) {
+                memcpy(&v, s, sizeof(v));
+                v = __bswap_32(v);
+                memcpy(d, &v, sizeof(v));
+                s+=4; d+=4;
+        }
+}
+
+static struct zpuino *open_device(const char *devname)
+{
+        struct zpuino *zp = zpuino_open(devname);
+
+        if (zp==NULL) {
+                fprintf(stderr,"cannot open %s: %s\n", devname, strerror(errno));
+                return NULL;
+        }
+
+        if (zpuino_reset(zp, 1)<0) {
+                perror("reset");
+                zpuino_close(zp);
+                return NULL;
+        }
+
+        if (zpuino_seek(zp, SKETCH_OFFSET)<0) {
+                fprintf(stderr,"Cannot seek: %s\n", strerror(errno));
+                zpuino_close(zp);
+                return NULL;
         }
+        return zp;
+}
+
+struct sketch {
+        uint32_t *data;     /* As in the file, unless swapped */
+        unsigned size;      /* Aligned size in bytes */
+        int swapped;        /* Words swapped to host order */
+};
 
-        if (read(sketchfd,&v,sizeof(v))!=sizeof(v)) {
+/*
+ * Read the whole sketch. It is left in file (ZPU) byte order.
+ */
+static int sketch_read(const char *sketchname, struct sketch *sketch)
+{
+        uint32_t v[2];
+        int r, sketchfd;
+        unsigned aligned_sketch_size;
+
+        sketchfd = open(sketchname, O_RDONLY);
+        if (sketchfd<0) {
+                perror("cannot open");
+                return -1;
+        }
+        if (read(sketchfd,v,sizeof(v))!=sizeof(v)) {
                 perror("read");
                 close(sketchfd);
                 return -1;
         }
-        if ( htobe32(v) != SKETCH_BOARD)  {
-                fprintf(stderr,"Invalid board %08x\n", htobe32(v));
+        if (check_header(v)<0) {
                 close(sketchfd);
                 return -1;
         }
@@ -87,7 +212,7 @@ int main(int argc, char **argv)
         // Align sketch size
         aligned_sketch_size = (sketch_size + 3) & ~3;
         // Alloc and load
-        uint32_t *sketchdata = (uint32_t*)malloc(aligned_sketch_size);
+        uint32_t *sketchdata = (uint32_t*)calloc(1, aligned_sketch_size);
         if (sketchdata==NULL) {
                 fprintf(stderr,"Cannot allocate memory: %s\n", strerror(errno));
                 close(sketchfd);
@@ -97,57 +222,1270 @@ int main(int argc, char **argv)
         r = read(sketchfd, sketchdata, sketch_size);
 
         if (r!=sketch_size) {
-                fprintf(stderr,"Short read, want %d (aligned %d) got %d: %s\n",
-                        sketch_size,
+                fprintf(stderr,"Short read, want %ld (aligned %u) got %d: %s\n",
+                        (long)sketch_size,
                         aligned_sketch_size,
                         r,
                         strerror(errno));
                 close(sketchfd);
+                free(sketchdata);
                 return -1;
         }
         close(sketchfd);
-        // Swap endianess
+
+        sketch->data = sketchdata;
+        sketch->size = aligned_sketch_size;
+        sketch->swapped = 0;
+        return 0;
+}
+
+static int write_full(struct zpuino *zp, const struct sketch *sketch)
+{
+        if (zpuino_write(zp, sketch->data, sketch->size)!=sketch->size) {
+                fprintf(stderr,"Short write: %s\n", strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Incremental load. A sidecar file per device keeps a hash of every
+ * BLOCK_SIZE block written by the previous load, and only blocks that
+ * changed are written, coalesced into runs. The cache only says which
+ * blocks may be skipped: ZPU memory can differ from what was loaded, as
+ * a running sketch changes its own .data and other tools (zpuinod,
+ * zpuinosnap, a full load) write without updating the cache. So blocks
+ * the cache calls unchanged are read back, and written as well unless
+ * ZPU memory holds exactly the new data.
+ *
+ * Reading back is what makes a small change slow, and most of it can be
+ * skipped. Each load leaves a tag derived from the cached hashes in the
+ * driver, which forgets it as soon as anything else writes ZPU memory.
+ * If the tag is still there, only the sketch itself can have changed
+ * memory since, and with -w telling where its writable data starts only
+ * blocks from there on are read back.
+ */
+#define BLOCK_SIZE       256
+#define BLOCKCACHE_MAGIC 0x5A424C4B /* "ZBLK" */
+#define BLOCKCACHE_DIR   "/run/zpuinoload"
+
+struct blockcache_header {
+        uint32_t magic;
+        uint32_t block_size;
+        uint32_t offset;
+        uint32_t size;
+};
+
+static uint64_t block_hash(const void *data, size_t len)
+{
+        const uint8_t *p = (const uint8_t*)data;
+        uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+        while (len--) {
+                h ^= *p++;
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+static void blockcache_path(char *dest, size_t len, const char *devname)
+{
+        const char *base = strrchr(devname, '/');
+
+        snprintf(dest, len, BLOCKCACHE_DIR "/%s.blocks", base ? base+1 : devname);
+}
+
+/*
+ * Returns the number of cached hashes, 0 if there is no usable cache.
+ * A cache for a sketch of another size is not used.
+ */
+static unsigned blockcache_load(const char *path, unsigned size, uint64_t **hashes)
+{
+        struct blockcache_header hdr;
+        unsigned nblocks;
+        FILE *f = fopen(path, "rb");
+
+        *hashes = NULL;
+        if (f==NULL)
+                return 0;
+
+        if (fread(&hdr, sizeof(hdr), 1, f)!=1 ||
+            hdr.magic!=BLOCKCACHE_MAGIC ||
+            hdr.block_size!=BLOCK_SIZE ||
+            hdr.offset!=SKETCH_OFFSET ||
+            hdr.size!=size) {
+                fclose(f);
+                return 0;
+        }
+        nblocks = (hdr.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        *hashes = malloc(nblocks * sizeof(uint64_t));
+        if (*hashes==NULL || fread(*hashes, sizeof(uint64_t), nblocks, f)!=nblocks) {
+                free(*hashes);
+                *hashes = NULL;
+                nblocks = 0;
+        }
+        fclose(f);
+        return nblocks;
+}
+
+static int blockcache_save(const char *path, unsigned size, const uint64_t *hashes, unsigned nblocks)
+{
+        struct blockcache_header hdr;
+        char tmp[512];
+        FILE *f;
+
+        hdr.magic = BLOCKCACHE_MAGIC;
+        hdr.block_size = BLOCK_SIZE;
+        hdr.offset = SKETCH_OFFSET;
+        hdr.size = size;
+
+        mkdir(BLOCKCACHE_DIR, 0755);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+        f = fopen(tmp, "wb");
+        if (f==NULL)
+                return -1;
+        if (fwrite(&hdr, sizeof(hdr), 1, f)!=1 ||
+            fwrite(hashes, sizeof(uint64_t), nblocks, f)!=nblocks) {
+                fclose(f);
+                unlink(tmp);
+                return -1;
+        }
+        if (fclose(f)!=0 || rename(tmp, path)<0) {
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+static uint64_t blockcache_tag(const uint64_t *hashes, unsigned nblocks)
+{
+        uint64_t tag = block_hash(hashes, nblocks * sizeof(uint64_t));
+
+        return tag ? tag : 1;
+}
+
+static size_t block_len(const struct sketch *sketch, unsigned block)
+{
+        size_t offset = (size_t)block * BLOCK_SIZE;
+
+        return sketch->size - offset > BLOCK_SIZE ? BLOCK_SIZE : sketch->size - offset;
+}
+
+/*
+ * Reads back the run of blocks [first, end) and marks those that ZPU
+ * memory does not hold as dirty. Returns how many were.
+ */
+static int confirm_blocks(struct zpuino *zp, const struct sketch *sketch, uint8_t *readback,
+                          unsigned first, unsigned end, char *dirty, size_t *readlen)
+{
+        const uint8_t *data = (const uint8_t*)sketch->data;
+        size_t offset = (size_t)first * BLOCK_SIZE;
+        size_t len = (size_t)(end - 1) * BLOCK_SIZE + block_len(sketch, end - 1) - offset;
+        unsigned i;
+        int stale = 0;
+
+        if (zpuino_pread(zp, readback + offset, len, SKETCH_OFFSET + offset)!=(ssize_t)len) {
+                fprintf(stderr,"Short read: %s\n", strerror(errno));
+                return -1;
+        }
+        *readlen += len;
+        for (i=first; i<end; i++) {
+                offset = (size_t)i * BLOCK_SIZE;
+                if (memcmp(readback + offset, data + offset, block_len(sketch, i))!=0) {
+                        dirty[i] = 1;
+                        stale++;
+                }
+        }
+        return stale;
+}
+
+/*
+ * Blocks entirely below "writable" (a ZPU address, 0 if unknown) are
+ * trusted without reading them back when the driver still holds the
+ * tag of the cached load. The tag of this load is left in *tag, and
+ * bytes written and read back are added to *written and *readlen.
+ */
+static int write_incremental(struct zpuino *zp, const struct sketch *sketch, const char *cachepath,
+                             uint32_t writable, uint64_t *tag, size_t *written, size_t *readlen)
+{
+        const uint8_t *data = (const uint8_t*)sketch->data;
+        unsigned nblocks = (sketch->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        unsigned ncached, i, run, changed = 0, trusted = 0, confirm_from = 0;
+        uint64_t *cached, *hashes, loaded;
+        uint8_t *readback;
+        char *dirty;
+        size_t offset, len;
+        int r = -1, stale = 0, n;
+
+        hashes = malloc(nblocks * sizeof(uint64_t));
+        dirty = malloc(nblocks);
+        readback = malloc(sketch->size);
+        if (hashes==NULL || dirty==NULL || readback==NULL) {
+                fprintf(stderr,"Cannot allocate memory: %s\n", strerror(errno));
+                free(hashes);
+                free(dirty);
+                free(readback);
+                return -1;
+        }
+        for (i=0; i<nblocks; i++)
+                hashes[i] = block_hash(data + (size_t)i * BLOCK_SIZE, block_len(sketch, i));
+
+        /* Remove the cache first, so that a failed load is never trusted */
+        ncached = blockcache_load(cachepath, sketch->size, &cached);
+        unlink(cachepath);
+
+        for (i=0; i<nblocks; i++) {
+                dirty[i] = !(i<ncached && hashes[i]==cached[i]);
+                changed += dirty[i];
+        }
+
+        /* Nothing but the sketch wrote ZPU memory since the cached load */
+        if (ncached && writable > SKETCH_OFFSET &&
+            zpuino_loadtag_get(zp, &loaded)==0 &&
+            loaded==blockcache_tag(cached, ncached)) {
+                confirm_from = (writable - SKETCH_OFFSET) / BLOCK_SIZE;
+                if (confirm_from > nblocks)
+                        confirm_from = nblocks;
+                for (i=0; i<confirm_from; i++)
+                        trusted += !dirty[i];
+        }
+
+        /* Confirm what the cache would skip, a run of clean blocks at a time */
+        for (i=confirm_from; i<nblocks; i=run) {
+                for (run=i; run<nblocks && !dirty[run]; run++)
+                        ;
+                if (run>i) {
+                        n = confirm_blocks(zp, sketch, readback, i, run, dirty, readlen);
+                        if (n<0)
+                                goto out;
+                        stale += n;
+                } else {
+                        run++;
+                }
+        }
+
+        for (i=0; i<nblocks; i=run) {
+                if (!dirty[i]) {
+                        run = i+1;
+                        continue;
+                }
+                for (run=i+1; run<nblocks && dirty[run]; run++)
+                        ;
+                offset = (size_t)i * BLOCK_SIZE;
+                len = (size_t)(run - 1) * BLOCK_SIZE + block_len(sketch, run - 1) - offset;
+
+                if (zpuino_pwrite(zp, data + offset, len, SKETCH_OFFSET + offset)!=(ssize_t)len) {
+                        fprintf(stderr,"Short write: %s\n", strerror(errno));
+                        goto out;
+                }
+                *written += len;
+        }
+
+        printf("Incremental load: %u of %u blocks changed, %d more differed in ZPU memory, "
+               "%u trusted from the load tag\n",
+               changed, nblocks, stale, trusted);
+        *tag = blockcache_tag(hashes, nblocks);
+
+        if (blockcache_save(cachepath, sketch->size, hashes, nblocks)<0)
+                fprintf(stderr,"Cannot save block cache %s: %s\n", cachepath, strerror(errno));
+        r = 0;
+out:
+        free(cached);
+        free(hashes);
+        free(dirty);
+        free(readback);
+        return r;
+}
+
+/*
+ * Buffered load: read the whole sketch and write it either in a single
+ * call or, with a block cache, only where it changed. The driver swaps
+ * the words on their way when it can, otherwise they are swapped here.
+ * An incremental load leaves the load tag to set in info->tag.
+ */
+static struct zpuino *load_buffered(const char *sketchname, const char *devname,
+                                    const char *cachepath, uint32_t writable,
+                                    struct load_info *info)
+{
+        struct sketch sketch;
+        struct timespec start, end;
+        struct zpuino *zp;
+        size_t written = 0, readlen = 0;
+        int r;
+
+        if (sketch_read(sketchname, &sketch)<0)
+                return NULL;
+
+        zp = open_device(devname);
+        if (zp==NULL) {
+                free(sketch.data);
+                return NULL;
+        }
+
+        if (zpuino_setswap(zp, 1)<0) {
+                swap_words(sketch.data, sketch.data, sketch.size>>2);
+                sketch.swapped = 1;
+        }
+
+        // Write sketch
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (cachepath) {
+                r = write_incremental(zp, &sketch, cachepath, writable, &info->tag, &written, &readlen);
+        } else {
+                r = write_full(zp, &sketch);
+                written = sketch.size;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        info->size = sketch.size;
+        if (sketch.swapped)
+                info->crc = crc16_words(ZPUINO_CRC16_INIT, sketch.data, sketch.size>>2);
+        else
+                info->crc = zpuino_crc16(ZPUINO_CRC16_INIT, sketch.data, sketch.size);
+        free(sketch.data);
+
+        /* Later readbacks expect host order again */
+        if (!sketch.swapped)
+                zpuino_setswap(zp, 0);
+
+        if (r<0) {
+                zpuino_close(zp);
+                return NULL;
+        }
         {
-                unsigned words = aligned_sketch_size>>2;
-                uint32_t *ptr = sketchdata;
-                while (words--) {
-                        *ptr = __bswap_32(*ptr);
-                        ptr++;
+                double ms = elapsed_ms(&start, &end);
+                if (cachepath)
+                        printf("Wrote %zu bytes and read back %zu of %u in %.3f ms\n",
+                               written, readlen, sketch.size, ms);
+                else
+                        printf("Wrote %zu bytes in %.3f ms (%.2f MB/s)\n",
+                               written,
+                               ms,
+                               ms>0 ? (written/1e3)/ms : 0.0);
+        }
+        return zp;
+}
+
+/*
+ * Compressed sketches: the usual 8-byte sketch header followed by an LZ4
+ * frame holding the rest of the image, e.g.
+ *
+ *   (head -c 8 sketch.bin; tail -c +9 sketch.bin | lz4 -B4) > sketch.zlz
+ *
+ * The frame is decoded one block at a time, keeping only the 64 KB
+ * window linked blocks may refer to, and each block is swapped and
+ * written to the device as soon as it is decoded. Frame and block
+ * checksums are skipped; use -V to check what was loaded.
+ */
+#define LZ4_FRAME_MAGIC  0x184D2204
+#define LZ4_WINDOW       65536
+
+static int is_compressed(const char *sketchname)
+{
+        uint32_t v[3];
+        int r, fd = open(sketchname, O_RDONLY);
+
+        if (fd<0)
+                return 0;
+        r = read(fd, v, sizeof(v));
+        close(fd);
+
+        return r==sizeof(v) && le32toh(v[2])==LZ4_FRAME_MAGIC;
+}
+
+/*
+ * Swap and write "len" decoded bytes. Up to three trailing bytes are
+ * kept in "carry" until the next call, or padded when "last" is set.
+ */
+static int write_decoded(struct zpuino *zp, const uint8_t *data, size_t len,
+                         uint8_t *carry, unsigned *ncarry, uint32_t *out,
+                         int last, struct load_info *info)
+{
+        size_t words, n = 0;
+
+        if (*ncarry) {
+                while (*ncarry<4 && n<len)
+                        carry[(*ncarry)++] = data[n++];
+                if (*ncarry<4 && !last)
+                        return 0;
+                memset(carry + *ncarry, 0, 4 - *ncarry);
+                swap_words(out, carry, 1);
+                if (zpuino_write(zp, out, 4)!=4)
+                        return -1;
+                info->crc = crc16_words(info->crc, out, 1);
+                info->size += 4;
+                *ncarry = 0;
+        }
+
+        words = (len - n) >> 2;
+        if (words) {
+                swap_words(out, data + n, words);
+                if (zpuino_write(zp, out, words<<2)!=(ssize_t)(words<<2))
+                        return -1;
+                info->crc = crc16_words(info->crc, out, words);
+                info->size += words<<2;
+                n += words<<2;
+        }
+
+        while (n<len)
+                carry[(*ncarry)++] = data[n++];
+
+        if (last && *ncarry)
+                return write_decoded(zp, NULL, 0, carry, ncarry, out, 1, info);
+        return 0;
+}
+
+static struct zpuino *load_compressed(const char *sketchname, const char *devname,
+                                      struct load_info *info)
+{
+        static const uint32_t block_max[] = { 65536, 262144, 1048576, 4194304 };
+        uint8_t hdr[8 + 4 + 2 + 8 + 4 + 1];
+        uint8_t *in = NULL, *win = NULL, carry[4];
+        uint32_t *out = NULL, bsize, bmax;
+        unsigned ncarry = 0;
+        size_t hist = 0, total;
+        long n;
+        struct zpuino *zp = NULL;
+        int linked, bchecksum, r = -1;
+        uint8_t flg, bd;
+        FILE *f;
+
+        f = fopen(sketchname, "rb");
+        if (f==NULL) {
+                perror("cannot open");
+                return NULL;
+        }
+        /* Sketch header, frame magic, FLG and BD */
+        if (fread(hdr, 1, 14, f)!=14) {
+                fprintf(stderr,"Short read on frame header\n");
+                goto out;
+        }
+        if (check_header((const uint32_t*)hdr)<0)
+                goto out;
+
+        flg = hdr[12];
+        bd = hdr[13];
+        if ((flg>>6)!=1 || (flg&1) || ((bd>>4)&7)<4) {
+                fprintf(stderr,"Unsupported LZ4 frame (FLG %02x BD %02x)\n", flg, bd);
+                goto out;
+        }
+        linked = !(flg & 0x20);
+        bchecksum = flg & 0x10;
+        bmax = block_max[((bd>>4)&7) - 4];
+
+        /* Optional content size, then header checksum */
+        if (fread(hdr, 1, (flg & 0x08 ? 8 : 0) + 1, f)!=(size_t)((flg & 0x08 ? 8 : 0) + 1)) {
+                fprintf(stderr,"Short read on frame header\n");
+                goto out;
+        }
+
+        in = malloc(bmax);
+        win = malloc(LZ4_WINDOW + bmax);
+        out = malloc(bmax);
+        if (in==NULL || win==NULL || out==NULL) {
+                fprintf(stderr,"Cannot allocate memory: %s\n", strerror(errno));
+                goto out;
+        }
+
+        zp = open_device(devname);
+        if (zp==NULL)
+                goto out;
+
+        info->size = 0;
+        info->crc = ZPUINO_CRC16_INIT;
+
+        for (;;) {
+                if (fread(&bsize, 4, 1, f)!=1) {
+                        fprintf(stderr,"Truncated LZ4 frame\n");
+                        goto out_dev;
+                }
+                bsize = le32toh(bsize);
+                if (bsize==0)
+                        break; /* End mark */
+
+                if ((bsize & 0x7FFFFFFF) > bmax ||
+                    fread(in, 1, bsize & 0x7FFFFFFF, f)!=(bsize & 0x7FFFFFFF)) {
+                        fprintf(stderr,"Truncated LZ4 block\n");
+                        goto out_dev;
                 }
+                if (bchecksum && fseek(f, 4, SEEK_CUR)<0)
+                        goto out_dev;
+
+                if (!linked)
+                        hist = 0;
+
+                if (bsize & 0x80000000) {
+                        n = bsize & 0x7FFFFFFF;
+                        memcpy(win + hist, in, n);
+                } else {
+                        n = zpuino_lz4_decode(in, bsize, win + hist, bmax, hist);
+                        if (n<0) {
+                                fprintf(stderr,"Corrupt LZ4 block\n");
+                                goto out_dev;
+                        }
+                }
+
+                if (write_decoded(zp, win + hist, n, carry, &ncarry, out, 0, info)<0) {
+                        fprintf(stderr,"Short write: %s\n", strerror(errno));
+                        goto out_dev;
+                }
+
+                /* Keep the last 64 KB as history for linked blocks */
+                total = hist + n;
+                if (linked && total > LZ4_WINDOW) {
+                        memmove(win, win + total - LZ4_WINDOW, LZ4_WINDOW);
+                        hist = LZ4_WINDOW;
+                } else {
+                        hist = total;
+                }
+        }
+        if (write_decoded(zp, NULL, 0, carry, &ncarry, out, 1, info)<0) {
+                fprintf(stderr,"Short write: %s\n", strerror(errno));
+                goto out_dev;
+        }
+        printf("Wrote %u bytes from %ld compressed\n", info->size, ftell(f));
+        r = 0;
+
+out_dev:
+        if (r<0) {
+                zpuino_close(zp);
+                zp = NULL;
+        }
+out:
+        fclose(f);
+        free(in);
+        free(win);
+        free(out);
+        return zp;
+}
+
+/*
+ * Chunk ring shared by a producer thread and the main thread. The
+ * producer fills chunks through ring->fill, at most RING_CHUNKS ahead
+ * of the consumer.
+ */
+struct ring {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        unsigned produced;  /* Chunks filled so far */
+        unsigned consumed;  /* Chunks released by the consumer */
+        unsigned nchunks;   /* Total chunks */
+        int abort;          /* Set by the consumer to stop the producer */
+        int error;          /* Set by the producer when a fill fails */
+        int (*fill)(struct ring *ring, unsigned index, uint32_t *buf, size_t *len);
+        const uint8_t *src; /* Swapper source */
+        size_t size;        /* Total payload size, unaligned */
+        uint32_t *buf[RING_CHUNKS];
+        size_t len[RING_CHUNKS];
+};
+
+static int ring_init(struct ring *ring, size_t size)
+{
+        unsigned i;
+
+        memset(ring, 0, sizeof(*ring));
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->cond, NULL);
+        ring->size = size;
+        ring->nchunks = (size + RING_CHUNK_SIZE - 1) / RING_CHUNK_SIZE;
+
+        for (i=0; i<RING_CHUNKS; i++) {
+                ring->buf[i] = malloc(RING_CHUNK_SIZE);
+                if (ring->buf[i]==NULL) {
+                        fprintf(stderr,"Cannot allocate memory: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static void ring_destroy(struct ring *ring)
+{
+        unsigned i;
+
+        for (i=0; i<RING_CHUNKS; i++)
+                free(ring->buf[i]);
+        pthread_cond_destroy(&ring->cond);
+        pthread_mutex_destroy(&ring->lock);
+}
+
+static void *ring_producer(void *arg)
+{
+        struct ring *ring = arg;
+        unsigned i, slot;
+        int r;
+
+        for (i=0; i<ring->nchunks; i++) {
+                pthread_mutex_lock(&ring->lock);
+                while (i - ring->consumed >= RING_CHUNKS && !ring->abort)
+                        pthread_cond_wait(&ring->cond, &ring->lock);
+                pthread_mutex_unlock(&ring->lock);
+                if (ring->abort)
+                        break;
+
+                slot = i % RING_CHUNKS;
+                r = ring->fill(ring, i, ring->buf[slot], &ring->len[slot]);
+
+                pthread_mutex_lock(&ring->lock);
+                if (r<0)
+                        ring->error = 1;
+                else
+                        ring->produced++;
+                pthread_cond_broadcast(&ring->cond);
+                pthread_mutex_unlock(&ring->lock);
+                if (r<0)
+                        break;
+        }
+        return NULL;
+}
+
+/* Wait for chunk "index" and return its slot, or -1 if the producer failed */
+static int ring_get(struct ring *ring, unsigned index)
+{
+        int slot = index % RING_CHUNKS;
+
+        pthread_mutex_lock(&ring->lock);
+        while (ring->produced <= index && !ring->error)
+                pthread_cond_wait(&ring->cond, &ring->lock);
+        if (ring->produced <= index)
+                slot = -1;
+        pthread_mutex_unlock(&ring->lock);
+        return slot;
+}
+
+static void ring_put(struct ring *ring)
+{
+        pthread_mutex_lock(&ring->lock);
+        ring->consumed++;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+}
+
+static void ring_abort(struct ring *ring)
+{
+        pthread_mutex_lock(&ring->lock);
+        ring->abort = 1;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+}
+
+static size_t ring_chunk_len(struct ring *ring, unsigned index)
+{
+        size_t len = ring->size - (size_t)index * RING_CHUNK_SIZE;
+
+        return len > RING_CHUNK_SIZE ? RING_CHUNK_SIZE : len;
+}
+
+static int ring_swap_fill(struct ring *ring, unsigned index, uint32_t *buf, size_t *plen)
+{
+        const uint8_t *src = ring->src + (size_t)index * RING_CHUNK_SIZE;
+        size_t len = ring_chunk_len(ring, index);
+
+        swap_words(buf, src, len>>2);
+        if (len&3) {
+                /* Trailing partial word, zero padded */
+                uint32_t tail = 0;
+                memcpy(&tail, src + (len&~3), len&3);
+                buf[len>>2] = __bswap_32(tail);
+                len = (len + 3) & ~3;
+        }
+        *plen = len;
+        return 0;
+}
+
+/*
+ * Pipelined load: the sketch is mmap()ed and a swapper thread converts
+ * it into a small ring of chunks while the main thread writes the
+ * already converted chunks to the device.
+ */
+static struct zpuino *load_pipelined(const char *sketchname, const char *devname,
+                                     struct load_info *info)
+{
+        struct ring ring;
+        struct stat st;
+        struct timespec start, end;
+        struct zpuino *zp = NULL;
+        pthread_t swapper;
+        void *map;
+        int sketchfd, slot;
+        unsigned i;
+        size_t written = 0;
+        uint16_t crc = ZPUINO_CRC16_INIT;
+
+        sketchfd = open(sketchname, O_RDONLY);
+        if (sketchfd<0) {
+                perror("cannot open");
+                return NULL;
+        }
+        if (fstat(sketchfd, &st)<0) {
+                perror("fstat");
+                close(sketchfd);
+                return NULL;
+        }
+        if (st.st_size < 8) {
+                fprintf(stderr,"Sketch too small\n");
+                close(sketchfd);
+                return NULL;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sketchfd, 0);
+        close(sketchfd);
+        if (map==MAP_FAILED) {
+                perror("mmap");
+                return NULL;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        if (check_header((const uint32_t*)map)<0)
+                goto out;
+
+        if (ring_init(&ring, st.st_size - 8)<0)
+                goto out_ring;
+        ring.src = (const uint8_t*)map + 8;
+        ring.fill = ring_swap_fill;
+
+        zp = open_device(devname);
+        if (zp==NULL)
+                goto out_ring;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (pthread_create(&swapper, NULL, ring_producer, &ring)!=0) {
+                fprintf(stderr,"Cannot create swapper thread\n");
+                zpuino_close(zp);
+                zp = NULL;
+                goto out_ring;
+        }
+
+        for (i=0; i<ring.nchunks; i++) {
+                slot = ring_get(&ring, i);
+                if (zpuino_write(zp, ring.buf[slot], ring.len[slot])!=(ssize_t)ring.len[slot]) {
+                        fprintf(stderr,"Short write: %s\n", strerror(errno));
+                        ring_abort(&ring);
+                        zpuino_close(zp);
+                        zp = NULL;
+                        break;
+                }
+                crc = crc16_words(crc, ring.buf[slot], ring.len[slot]>>2);
+                written += ring.len[slot];
+                ring_put(&ring);
+        }
+
+        pthread_join(swapper, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (zp) {
+                double ms = elapsed_ms(&start, &end);
+                printf("Wrote %zu bytes in %.3f ms (%.2f MB/s)\n",
+                       written,
+                       ms,
+                       ms>0 ? (written/1e3)/ms : 0.0);
+                info->size = written;
+                info->crc = crc;
+        }
+
+out_ring:
+        ring_destroy(&ring);
+out:
+        munmap(map, st.st_size);
+        return zp;
+}
+
+/*
+ * ELF executables and Intel HEX files: only the loaded segments are
+ * written, so gaps and padding between them cost nothing, and BSS and
+ * long zero runs are filled inside the device. Segments are checked one
+ * by one with -V.
+ */
+static struct zpuino *load_image(const char *path, const char *devname, int verify)
+{
+        struct zpuino_image img;
+        struct zpuino_image_stats st;
+        struct timespec start, end;
+        struct zpuino *zp;
+        double ms;
+
+        if (zpuino_image_read(path, &img)<0) {
+                fprintf(stderr,"%s: %s\n", path, errno==ENOEXEC ?
+                        "not a ZPU ELF executable or Intel HEX file" : strerror(errno));
+                return NULL;
+        }
+
+        zp = open_device(devname);
+        if (zp==NULL) {
+                zpuino_image_free(&img);
+                return NULL;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (zpuino_image_write(zp, &img, &st)<0) {
+                fprintf(stderr,"Cannot load %s: %s\n", path, errno==ERANGE ?
+                        "segment outside sketch memory" : strerror(errno));
+                goto fail;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        ms = elapsed_ms(&start, &end);
+        printf("Wrote %zu bytes, zeroed %zu, of %zu spanned by %u segments in %.3f ms\n",
+               st.written, st.filled, st.span, img.nsegs, ms);
+
+        if (verify) {
+                if (zpuino_image_verify(zp, &img)<0) {
+                        fprintf(stderr,"Verify failed: %s\n", strerror(errno));
+                        goto fail;
+                }
+                printf("Verified %u segments (%s)\n", img.nsegs, zpuino_backend(zp));
+        }
+        zpuino_image_free(&img);
+        return zp;
+fail:
+        zpuino_image_free(&img);
+        zpuino_close(zp);
+        return NULL;
+}
+
+/*
+ * Verification. The driver computes the CRC16 of the loaded range in a
+ * single ioctl; other backends, and older drivers, read it back.
+ */
+static int verify_load(struct zpuino *zp, const struct load_info *info)
+{
+        uint16_t crc;
+
+        if (zpuino_checksum(zp, SKETCH_OFFSET, info->size, &crc)<0) {
+                perror("checksum");
+                return -1;
+        }
+
+        if (crc!=info->crc) {
+                fprintf(stderr,"Verify failed: expected CRC %04x, got %04x\n",
+                        info->crc, crc);
+                return -1;
         }
+        printf("Verified %u bytes (%s), CRC %04x\n", info->size, zpuino_backend(zp), crc);
+        return 0;
+}
+
+/*
+ * Ready handshake. Instead of sleeping after reset, wait for the sketch
+ * to store a known value in a known word once it is up. The word is
+ * cleared while the core is still held in reset, so a value left over
+ * from the previous sketch does not count.
+ */
+static int ready_clear(struct zpuino *zp, const struct zpuino_ready *ready)
+{
+        if (!ready->set)
+                return 0;
+        return zpuino_memset(zp, ready->offset, 4, 0);
+}
+
+static int ready_wait(struct zpuino *zp, const struct zpuino_ready *ready, double *ms)
+{
+        uint64_t ns;
 
-        drvfd = open("/dev/zpuinodrv", O_RDWR);
+        if (!ready->set)
+                return 0;
+        if (zpuino_wait_ready(zp, ready->offset, ready->mask, ready->value,
+                              ready->timeout_ms, &ns)<0)
+                return -1;
+        *ms = ns / 1e6;
+        return 0;
+}
+
+/*
+ * Batch mode. A manifest lists one "device sketch" pair per line, with
+ * '#' starting a comment. Every distinct sketch is read and swapped once
+ * up front, then a pool of threads loads the devices concurrently, each
+ * thread taking the next device from the list.
+ */
+#define BATCH_MAX_THREADS 64
+
+struct batch_image {
+        char *path;
+        struct sketch sketch;
+        uint16_t crc;
+};
+
+struct batch_job {
+        char *devname;
+        unsigned image;
+        double ms;
+        double ready_ms;
+        const char *error;
+};
 
-        if (drvfd<0) {
-                perror("cannot open zpuinodrv");
+struct batch {
+        pthread_mutex_t lock;
+        struct batch_image *images;
+        unsigned nimages;
+        struct batch_job *jobs;
+        unsigned njobs;
+        unsigned next;
+        int verify;
+        struct zpuino_ready ready;
+};
+
+/* Index of the image for "path", read on first use */
+static int batch_image(struct batch *b, const char *path)
+{
+        struct batch_image *img, *n;
+        unsigned i;
+
+        for (i=0; i<b->nimages; i++) {
+                if (strcmp(b->images[i].path, path)==0)
+                        return i;
+        }
+        if (is_compressed(path) || zpuino_image_detect(path)) {
+                fprintf(stderr,"%s: only flat sketches are supported in batch mode\n", path);
                 return -1;
         }
+        n = realloc(b->images, (b->nimages + 1) * sizeof(*b->images));
+        if (n==NULL)
+                return -1;
+        b->images = n;
+        img = &n[b->nimages];
+        if (sketch_read(path, &img->sketch)<0)
+                return -1;
+        swap_words(img->sketch.data, img->sketch.data, img->sketch.size>>2);
+        img->sketch.swapped = 1;
+        img->crc = crc16_words(ZPUINO_CRC16_INIT, img->sketch.data, img->sketch.size>>2);
+        img->path = strdup(path);
+        return b->nimages++;
+}
+
+static int batch_parse(const char *manifest, struct batch *b)
+{
+        char line[1024], dev[512], path[512];
+        struct batch_job *n;
+        unsigned lineno = 0;
+        int img;
+        FILE *f = fopen(manifest, "r");
 
-        if (ioctl(drvfd, ZPU_IOCTL_SETRESET, 1)<0) {
-                perror("ioctl");
-                close(drvfd);
+        if (f==NULL) {
+                perror(manifest);
                 return -1;
         }
+        while (fgets(line, sizeof(line), f)) {
+                char *hash = strchr(line, '#');
 
+                lineno++;
+                if (hash)
+                        *hash = '\0';
+                if (sscanf(line, "%511s", dev)!=1)
+                        continue;
+                if (sscanf(line, "%511s %511s", dev, path)!=2) {
+                        fprintf(stderr,"%s:%u: expected \"device sketch\"\n", manifest, lineno);
+                        fclose(f);
+                        return -1;
+                }
+                img = batch_image(b, path);
+                if (img<0) {
+                        fclose(f);
+                        return -1;
+                }
+                n = realloc(b->jobs, (b->njobs + 1) * sizeof(*b->jobs));
+                if (n==NULL) {
+                        fclose(f);
+                        return -1;
+                }
+                b->jobs = n;
+                memset(&n[b->njobs], 0, sizeof(*n));
+                n[b->njobs].devname = strdup(dev);
+                n[b->njobs].image = img;
+                b->njobs++;
+        }
+        fclose(f);
+        return 0;
+}
 
-        // Write sketch
-        if (lseek(drvfd, SKETCH_OFFSET, SEEK_SET)!=SKETCH_OFFSET) {
-                fprintf(stderr,"Cannot seek: %s\n", strerror(errno));
-                close(drvfd);
+static const char *batch_load_one(struct batch *b, struct batch_job *job)
+{
+        const struct batch_image *image = &b->images[job->image];
+        const struct sketch *sketch = &image->sketch;
+        struct zpuino *zp;
+        uint16_t crc;
+        const char *error = NULL;
+
+        zp = open_device(job->devname);
+        if (zp==NULL)
+                return "cannot open";
+
+        if (zpuino_write(zp, sketch->data, sketch->size)!=(ssize_t)sketch->size)
+                error = "short write";
+        else if (b->verify && zpuino_checksum(zp, SKETCH_OFFSET, sketch->size, &crc)<0)
+                error = "checksum failed";
+        else if (b->verify && crc!=image->crc)
+                error = "verify failed";
+        else if (ready_clear(zp, &b->ready)<0)
+                error = "cannot clear ready word";
+        else if (zpuino_reset(zp, 0)<0)
+                error = "cannot release reset";
+        else if (ready_wait(zp, &b->ready, &job->ready_ms)<0)
+                error = errno==ETIMEDOUT ? "not ready" : "ready wait failed";
+
+        zpuino_close(zp);
+        return error;
+}
+
+static void *batch_worker(void *arg)
+{
+        struct batch *b = arg;
+        struct batch_job *job;
+        struct timespec start, end;
+
+        for (;;) {
+                pthread_mutex_lock(&b->lock);
+                job = b->next < b->njobs ? &b->jobs[b->next++] : NULL;
+                pthread_mutex_unlock(&b->lock);
+                if (job==NULL)
+                        break;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                job->error = batch_load_one(b, job);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                job->ms = elapsed_ms(&start, &end);
+        }
+        return NULL;
+}
+
+static int load_batch(const char *manifest, unsigned nthreads, int verify,
+                      const struct zpuino_ready *ready)
+{
+        struct batch b;
+        unsigned i, failed = 0;
+        pthread_t threads[BATCH_MAX_THREADS];
+        struct timespec start, end;
+        int r = -1;
+
+        memset(&b, 0, sizeof(b));
+        pthread_mutex_init(&b.lock, NULL);
+        b.verify = verify;
+        b.ready = *ready;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (batch_parse(manifest, &b)<0)
+                goto out;
+
+        if (nthreads==0 || nthreads > b.njobs)
+                nthreads = b.njobs;
+        if (nthreads > BATCH_MAX_THREADS)
+                nthreads = BATCH_MAX_THREADS;
+
+        for (i=0; i<nthreads; i++) {
+                if (pthread_create(&threads[i], NULL, batch_worker, &b)!=0) {
+                        fprintf(stderr,"Cannot create loader thread\n");
+                        break;
+                }
+        }
+        /* With no thread at all, load from here */
+        if (i==0)
+                batch_worker(&b);
+        nthreads = i;
+        for (i=0; i<nthreads; i++)
+                pthread_join(threads[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (i=0; i<b.njobs; i++) {
+                struct batch_job *job = &b.jobs[i];
+                struct batch_image *image = &b.images[job->image];
+
+                printf("%-24s %-32s %8u bytes %9.3f ms  %s",
+                       job->devname, image->path, image->sketch.size,
+                       job->ms, job->error ? job->error : "ok");
+                if (b.ready.set && !job->error)
+                        printf(", ready after %.3f ms", job->ready_ms);
+                printf("\n");
+                if (job->error)
+                        failed++;
+        }
+        printf("Loaded %u of %u devices (%u sketches, %u threads) in %.3f ms\n",
+               b.njobs - failed, b.njobs, b.nimages, nthreads, elapsed_ms(&start, &end));
+        r = failed ? -1 : 0;
+out:
+        for (i=0; i<b.njobs; i++)
+                free(b.jobs[i].devname);
+        free(b.jobs);
+        for (i=0; i<b.nimages; i++) {
+                free(b.images[i].path);
+                free(b.images[i].sketch.data);
+        }
+        free(b.images);
+        pthread_mutex_destroy(&b.lock);
+        return r;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] [-p | -i] [-c cache] [-w offset] [-V] [-C] [-r ready [-t ms]] sketch.{bin,elf,hex}\n", name);
+        fprintf(stderr,"       %s -m manifest [-j threads] [-V] [-r ready [-t ms]]\n", name);
+        fprintf(stderr,"  -d device   ZPUino device, uio:/dev/uioN[:size] or mock[:size] (default %s)\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -p          Pipelined load (mmap, chunked swap and write)\n");
+        fprintf(stderr,"  -i          Incremental load, write only blocks changed since last load\n");
+        fprintf(stderr,"              or found different in ZPU memory\n");
+        fprintf(stderr,"  -c cache    Block cache for -i (default %s/<device>.blocks)\n", BLOCKCACHE_DIR);
+        fprintf(stderr,"  -w offset   For -i, the sketch writes ZPU memory only from offset on (its .data);\n");
+        fprintf(stderr,"              below it, unchanged blocks are not read back if nothing else wrote\n");
+        fprintf(stderr,"  -V          Verify the load by CRC before removing reset\n");
+        fprintf(stderr,"  -C          Drop the sketch from the page cache first (cold load)\n");
+        fprintf(stderr,"  -m manifest Load every \"device sketch\" pair listed, concurrently\n");
+        fprintf(stderr,"  -j threads  Loader threads for -m (default one per device)\n");
+        fprintf(stderr,"  -r ready    Wait for the sketch to store a value in a word once reset is removed,\n");
+        fprintf(stderr,"              as offset[,value[,mask]] (default value 1, all bits)\n");
+        fprintf(stderr,"  -t ms       Timeout for -r (default %u)\n", ZPUINO_READY_DEFAULT_TIMEOUT);
+        fprintf(stderr,"Sketches holding an LZ4 frame after the header are decompressed while loading.\n");
+        fprintf(stderr,"ZPU ELF executables and Intel HEX files are loaded segment by segment.\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE;
+        const char *cachepath = NULL;
+        const char *manifest = NULL;
+        unsigned nthreads = 0;
+        uint32_t writable = 0;
+        char defcache[256];
+        int pipelined = 0, incremental = 0, verify = 0, cold = 0;
+        struct load_info info = { 0 };
+        struct zpuino_ready ready = { .timeout_ms = ZPUINO_READY_DEFAULT_TIMEOUT };
+        struct zpuino *zp;
+        double ready_ms;
+        int c;
+        struct timespec start, end;
+        struct rusage ru;
+
+        while ((c=getopt(argc, argv, "d:pic:w:VCm:j:r:t:"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 'p':
+                        pipelined = 1;
+                        break;
+                case 'i':
+                        incremental = 1;
+                        break;
+                case 'c':
+                        cachepath = optarg;
+                        break;
+                case 'w':
+                        writable = strtoul(optarg, NULL, 0);
+                        break;
+                case 'V':
+                        verify = 1;
+                        break;
+                case 'C':
+                        cold = 1;
+                        break;
+                case 'm':
+                        manifest = optarg;
+                        break;
+                case 'j':
+                        nthreads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        if (zpuino_ready_parse(optarg, &ready)<0) {
+                                fprintf(stderr,"Bad ready word \"%s\", expected offset[,value[,mask]]\n", optarg);
+                                return -1;
+                        }
+                        break;
+                case 't':
+                        ready.timeout_ms = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+
+        if (manifest) {
+                if (optind<argc || pipelined || incremental) {
+                        usage(argv[0]);
+                        return -1;
+                }
+                return load_batch(manifest, nthreads, verify, &ready)<0 ? -1 : 0;
+        }
+
+        if (optind>=argc || (pipelined && incremental)) {
+                usage(argv[0]);
                 return -1;
         }
-        if (write(drvfd, sketchdata, aligned_sketch_size)!=aligned_sketch_size) {
-                fprintf(stderr,"Short write: %s\n", strerror(errno));
-                close(drvfd);
+
+        if (incremental && cachepath==NULL) {
+                blockcache_path(defcache, sizeof(defcache), devname);
+                cachepath = defcache;
+        } else if (!incremental) {
+                cachepath = NULL;
+        }
+
+        if (cold) {
+                int fd = open(argv[optind], O_RDONLY);
+                if (fd>=0) {
+                        fdatasync(fd);
+                        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                        close(fd);
+                }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (zpuino_image_detect(argv[optind])) {
+                if (incremental || pipelined) {
+                        fprintf(stderr,"Incremental and pipelined loads are for flat sketches only\n");
+                        return -1;
+                }
+                zp = load_image(argv[optind], devname, verify);
+                /* Already checked segment by segment */
+                verify = 0;
+        } else if (is_compressed(argv[optind])) {
+                if (incremental) {
+                        fprintf(stderr,"Incremental load is not supported for compressed sketches\n");
+                        return -1;
+                }
+                zp = load_compressed(argv[optind], devname, &info);
+        } else if (pipelined)
+                zp = load_pipelined(argv[optind], devname, &info);
+        else
+                zp = load_buffered(argv[optind], devname, cachepath, writable, &info);
+
+        if (zp==NULL)
+                return -1;
+
+        if (verify && verify_load(zp, &info)<0) {
+                zpuino_close(zp);
+                return -1;
+        }
+
+        if (ready_clear(zp, &ready)<0) {
+                perror("ready word");
+                zpuino_close(zp);
                 return -1;
         }
+
+        /* Last write before the sketch runs; a driver without tags just skips it */
+        if (info.tag && zpuino_loadtag_set(zp, info.tag)<0 && errno!=ENOTTY)
+                perror("load tag");
+
         printf("Removing reset.\n");
-        if (ioctl(drvfd, ZPU_IOCTL_SETRESET, 0)<0) {
-                perror("ioctl");
-                close(drvfd);
+        if (zpuino_reset(zp, 0)<0) {
+                perror("reset");
+                zpuino_close(zp);
                 return -1;
         }
 
-        close(drvfd);
+        if (ready_wait(zp, &ready, &ready_ms)<0) {
+                fprintf(stderr,"Sketch not ready: %s\n", strerror(errno));
+                zpuino_close(zp);
+                return -1;
+        }
+        if (ready.set)
+                printf("Sketch ready after %.3f ms\n", ready_ms);
+
+        zpuino_close(zp);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &ru);
+        printf("Load latency %.3f ms, peak RSS %ld kB\n",
+               elapsed_ms(&start, &end),
+               ru.ru_maxrss);
         return 0;
 }
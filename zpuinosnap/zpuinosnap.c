@@ -0,0 +1,543 @@
+/*  zpuinosnap.c - ZPUino memory checkpoint and restore
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "zpuino.h"
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+
+/*
+ * Snapshot file: a header, then one record per stored page in address
+ * order, then an end record. Pages without a record hold their default
+ * contents: zeroes, or for a delta snapshot whatever the base had. A
+ * record is raw when its length is a whole page, zeroes when it is 0,
+ * and an LZ4 block otherwise. Page data is in ZPU byte order, and all
+ * header fields are little-endian.
+ *
+ * Only memory is captured. A restored image starts from the reset
+ * vector when reset is released, like a freshly loaded sketch.
+ */
+#define SNAP_MAGIC       0x504E535A /* "ZSNP" */
+#define SNAP_VERSION     1
+#define SNAP_PAGE        1024
+#define SNAP_CHUNK       16384      /* Bytes moved per device call */
+#define SNAP_END         0xFFFFFFFF
+
+#define SNAP_F_DELTA     (1<<0)
+
+struct snap_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t memsize;
+        uint32_t page_size;
+        uint32_t flags;
+        uint32_t base_crc;      /* Whole memory CRC16 of the base */
+        uint32_t crc;           /* Whole memory CRC16 of this image */
+        uint32_t stored;        /* Page records */
+};
+
+struct snap_record {
+        uint32_t page;
+        uint32_t len;
+};
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec)*1e3 + (end->tv_nsec - start->tv_nsec)/1e6;
+}
+
+static int is_zero(const uint8_t *p, size_t len)
+{
+        return p[0]==0 && memcmp(p, p+1, len-1)==0;
+}
+
+static void header_swap(struct snap_header *h)
+{
+        h->magic = le32toh(h->magic);
+        h->version = le32toh(h->version);
+        h->memsize = le32toh(h->memsize);
+        h->page_size = le32toh(h->page_size);
+        h->flags = le32toh(h->flags);
+        h->base_crc = le32toh(h->base_crc);
+        h->crc = le32toh(h->crc);
+        h->stored = le32toh(h->stored);
+}
+
+static int read_header(FILE *f, const char *name, struct snap_header *h)
+{
+        if (fread(h, sizeof(*h), 1, f)!=1) {
+                fprintf(stderr,"%s: short header\n", name);
+                return -1;
+        }
+        header_swap(h);
+        if (h->magic!=SNAP_MAGIC || h->version!=SNAP_VERSION || h->page_size!=SNAP_PAGE ||
+            h->memsize==0 || h->memsize%SNAP_PAGE) {
+                fprintf(stderr,"%s: not a snapshot\n", name);
+                return -1;
+        }
+        return 0;
+}
+
+/* Next record; *page is SNAP_END at the end */
+static int read_record(FILE *f, const char *name, uint32_t memsize,
+                       uint32_t *page, uint8_t *data, uint8_t *tmp)
+{
+        struct snap_record rec;
+        long n;
+
+        if (fread(&rec, sizeof(rec), 1, f)!=1) {
+                fprintf(stderr,"%s: truncated\n", name);
+                return -1;
+        }
+        *page = le32toh(rec.page);
+        rec.len = le32toh(rec.len);
+        if (*page==SNAP_END)
+                return 0;
+        if ((uint64_t)(*page + 1) * SNAP_PAGE > memsize || rec.len > SNAP_PAGE) {
+                fprintf(stderr,"%s: bad record\n", name);
+                return -1;
+        }
+
+        if (rec.len==0) {
+                memset(data, 0, SNAP_PAGE);
+        } else if (rec.len==SNAP_PAGE) {
+                if (fread(data, SNAP_PAGE, 1, f)!=1) {
+                        fprintf(stderr,"%s: truncated\n", name);
+                        return -1;
+                }
+        } else {
+                if (fread(tmp, rec.len, 1, f)!=1) {
+                        fprintf(stderr,"%s: truncated\n", name);
+                        return -1;
+                }
+                n = zpuino_lz4_decode(tmp, rec.len, data, SNAP_PAGE, 0);
+                if (n!=SNAP_PAGE) {
+                        fprintf(stderr,"%s: corrupt page %u\n", name, *page);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/* Decode a full snapshot into memory, as the base of a delta */
+static uint8_t *load_base(const char *name, struct snap_header *h)
+{
+        uint8_t tmp[SNAP_PAGE], data[SNAP_PAGE];
+        uint8_t *image = NULL;
+        uint32_t page;
+        FILE *f = fopen(name, "rb");
+
+        if (f==NULL) {
+                perror(name);
+                return NULL;
+        }
+        if (read_header(f, name, h)<0)
+                goto fail;
+        if (h->flags & SNAP_F_DELTA) {
+                fprintf(stderr,"%s: base must be a full snapshot\n", name);
+                goto fail;
+        }
+        image = calloc(1, h->memsize);
+        if (image==NULL) {
+                perror("calloc");
+                goto fail;
+        }
+        for (;;) {
+                if (read_record(f, name, h->memsize, &page, data, tmp)<0)
+                        goto fail;
+                if (page==SNAP_END)
+                        break;
+                memcpy(image + (size_t)page * SNAP_PAGE, data, SNAP_PAGE);
+        }
+        fclose(f);
+        return image;
+fail:
+        free(image);
+        fclose(f);
+        return NULL;
+}
+
+/*
+ * Save: memory is read SNAP_CHUNK bytes at a time, already swapped to
+ * ZPU order by the backend, and each page is dropped, marked zero or
+ * compressed as it comes in.
+ */
+static int snap_save(struct zpuino *zp, const char *name, const char *basename)
+{
+        static uint8_t buf[SNAP_CHUNK];
+        uint8_t out[SNAP_PAGE];
+        struct snap_header h, base_h;
+        struct snap_record rec;
+        struct timespec start, end;
+        uint8_t *base = NULL, *page;
+        uint16_t crc = ZPUINO_CRC16_INIT;
+        uint32_t memsize = zpuino_memsize(zp), offset, pg;
+        unsigned zero = 0, same = 0;
+        long n;
+        FILE *f;
+        int r = -1;
+
+        memset(&h, 0, sizeof(h));
+        if (basename) {
+                base = load_base(basename, &base_h);
+                if (base==NULL)
+                        return -1;
+                if (base_h.memsize!=memsize) {
+                        fprintf(stderr,"%s: taken from a %u byte device, this one has %u\n",
+                                basename, base_h.memsize, memsize);
+                        free(base);
+                        return -1;
+                }
+                h.flags |= SNAP_F_DELTA;
+                h.base_crc = base_h.crc;
+        }
+
+        f = fopen(name, "wb");
+        if (f==NULL) {
+                perror(name);
+                free(base);
+                return -1;
+        }
+        /* Placeholder, rewritten at the end */
+        if (fwrite(&h, sizeof(h), 1, f)!=1)
+                goto out;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (offset=0; offset<memsize; offset+=SNAP_CHUNK) {
+                size_t len = memsize - offset < SNAP_CHUNK ? memsize - offset : SNAP_CHUNK;
+
+                if (zpuino_pread(zp, buf, len, offset)!=(ssize_t)len) {
+                        fprintf(stderr,"Short read: %s\n", strerror(errno));
+                        goto out;
+                }
+                crc = zpuino_crc16(crc, buf, len);
+
+                for (page=buf; page<buf+len; page+=SNAP_PAGE) {
+                        pg = (offset + (page - buf)) / SNAP_PAGE;
+
+                        if (base && memcmp(page, base + (size_t)pg * SNAP_PAGE, SNAP_PAGE)==0) {
+                                same++;
+                                continue;
+                        }
+                        rec.page = htole32(pg);
+                        if (is_zero(page, SNAP_PAGE)) {
+                                zero++;
+                                if (!base)
+                                        continue;
+                                n = 0;
+                        } else {
+                                n = zpuino_lz4_encode(page, SNAP_PAGE, out, SNAP_PAGE - 1);
+                        }
+                        rec.len = htole32(n<0 ? SNAP_PAGE : n);
+                        if (fwrite(&rec, sizeof(rec), 1, f)!=1 ||
+                            (n<0 && fwrite(page, SNAP_PAGE, 1, f)!=1) ||
+                            (n>0 && fwrite(out, n, 1, f)!=1))
+                                goto out_write;
+                        h.stored++;
+                }
+        }
+
+        rec.page = htole32(SNAP_END);
+        rec.len = 0;
+        if (fwrite(&rec, sizeof(rec), 1, f)!=1)
+                goto out_write;
+
+        h.magic = SNAP_MAGIC;
+        h.version = SNAP_VERSION;
+        h.memsize = memsize;
+        h.page_size = SNAP_PAGE;
+        h.crc = crc;
+        n = h.stored;
+        header_swap(&h); /* Same swap both ways */
+        if (fseek(f, 0, SEEK_SET)<0 || fwrite(&h, sizeof(h), 1, f)!=1)
+                goto out_write;
+        if (fclose(f)!=0) {
+                f = NULL;
+                goto out_write;
+        }
+        f = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        {
+                double ms = elapsed_ms(&start, &end);
+                printf("Saved %u bytes in %.3f ms (%.2f MB/s): %ld pages stored, %u zero, %u unchanged, CRC %04x\n",
+                       memsize, ms, ms>0 ? (memsize/1e3)/ms : 0.0,
+                       n, zero, same, crc);
+        }
+        r = 0;
+        goto out;
+
+out_write:
+        fprintf(stderr,"%s: write failed: %s\n", name, strerror(errno));
+out:
+        if (f)
+                fclose(f);
+        if (r<0)
+                unlink(name);
+        free(base);
+        return r;
+}
+
+/*
+ * Restore: consecutive stored pages are gathered and written in runs of
+ * up to SNAP_CHUNK bytes. In a full snapshot, pages between records are
+ * zeroed with a single memset per gap; in a delta they are left alone,
+ * so the device must hold the base already.
+ */
+struct run {
+        struct zpuino *zp;
+        uint8_t buf[SNAP_CHUNK];
+        uint32_t start;         /* First page */
+        unsigned pages;
+        size_t written;
+};
+
+static int run_flush(struct run *run)
+{
+        size_t len = run->pages * SNAP_PAGE;
+
+        if (!run->pages)
+                return 0;
+        if (zpuino_pwrite(run->zp, run->buf, len, run->start * SNAP_PAGE)!=(ssize_t)len) {
+                fprintf(stderr,"Short write: %s\n", strerror(errno));
+                return -1;
+        }
+        run->written += len;
+        run->pages = 0;
+        return 0;
+}
+
+static int zero_pages(struct zpuino *zp, uint32_t from, uint32_t to)
+{
+        if (from>=to)
+                return 0;
+        if (zpuino_memset(zp, from * SNAP_PAGE, (to - from) * SNAP_PAGE, 0)<0) {
+                fprintf(stderr,"Cannot clear memory: %s\n", strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+static int snap_restore(struct zpuino *zp, const char *name, int verify)
+{
+        static struct run run;
+        uint8_t tmp[SNAP_PAGE], data[SNAP_PAGE];
+        struct snap_header h;
+        struct timespec start, end;
+        uint32_t page, next = 0, npages;
+        uint16_t crc;
+        int delta, r = -1;
+        FILE *f = fopen(name, "rb");
+
+        if (f==NULL) {
+                perror(name);
+                return -1;
+        }
+        if (read_header(f, name, &h)<0)
+                goto out;
+        if (h.memsize!=zpuino_memsize(zp)) {
+                fprintf(stderr,"%s: taken from a %u byte device, this one has %zu\n",
+                        name, h.memsize, zpuino_memsize(zp));
+                goto out;
+        }
+        delta = h.flags & SNAP_F_DELTA;
+        npages = h.memsize / SNAP_PAGE;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (delta) {
+                if (zpuino_checksum(zp, 0, h.memsize, &crc)<0) {
+                        perror("checksum");
+                        goto out;
+                }
+                if (crc!=h.base_crc) {
+                        fprintf(stderr,"%s: device does not hold the base image (CRC %04x, want %04x)\n",
+                                name, crc, h.base_crc);
+                        goto out;
+                }
+        }
+
+        run.zp = zp;
+        run.pages = 0;
+        run.written = 0;
+
+        for (;;) {
+                if (read_record(f, name, h.memsize, &page, data, tmp)<0)
+                        goto out;
+                if (page!=SNAP_END && page<next) {
+                        fprintf(stderr,"%s: records out of order\n", name);
+                        goto out;
+                }
+                if (page==SNAP_END || page!=run.start + run.pages ||
+                    run.pages==SNAP_CHUNK/SNAP_PAGE) {
+                        if (run_flush(&run)<0)
+                                goto out;
+                        if (!delta && zero_pages(zp, next, page==SNAP_END ? npages : page)<0)
+                                goto out;
+                        run.start = page;
+                }
+                if (page==SNAP_END)
+                        break;
+                memcpy(run.buf + run.pages * SNAP_PAGE, data, SNAP_PAGE);
+                run.pages++;
+                next = page + 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        {
+                double ms = elapsed_ms(&start, &end);
+                printf("Restored %s: wrote %zu of %u bytes in %.3f ms\n",
+                       delta ? "delta" : "snapshot", run.written, h.memsize, ms);
+        }
+
+        if (verify) {
+                if (zpuino_checksum(zp, 0, h.memsize, &crc)<0) {
+                        perror("checksum");
+                        goto out;
+                }
+                if (crc!=h.crc) {
+                        fprintf(stderr,"Verify failed: expected CRC %04x, got %04x\n", h.crc, crc);
+                        goto out;
+                }
+                printf("Verified, CRC %04x\n", crc);
+        }
+        r = 0;
+out:
+        fclose(f);
+        return r;
+}
+
+static int snap_info(const char *name)
+{
+        struct snap_header h;
+        FILE *f = fopen(name, "rb");
+
+        if (f==NULL) {
+                perror(name);
+                return -1;
+        }
+        if (read_header(f, name, &h)<0) {
+                fclose(f);
+                return -1;
+        }
+        fseek(f, 0, SEEK_END);
+        printf("%s: %s snapshot of %u bytes, %u of %u pages stored, %ld bytes, CRC %04x",
+               name, h.flags & SNAP_F_DELTA ? "delta" : "full",
+               h.memsize, h.stored, h.memsize / SNAP_PAGE, ftell(f), h.crc);
+        if (h.flags & SNAP_F_DELTA)
+                printf(", base CRC %04x", h.base_crc);
+        printf("\n");
+        fclose(f);
+        return 0;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] [-s] [-b base.snap] save file.snap\n", name);
+        fprintf(stderr,"       %s [-d device] [-n] [-V] restore file.snap\n", name);
+        fprintf(stderr,"       %s info file.snap\n", name);
+        fprintf(stderr,"  -d device   ZPUino device (default %s)\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -s          Hold the core in reset while saving, and leave it there\n");
+        fprintf(stderr,"  -b base     Save only pages that differ from a full snapshot\n");
+        fprintf(stderr,"  -n          Do not release reset after restoring\n");
+        fprintf(stderr,"  -V          Verify the whole memory by CRC after restoring\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE;
+        const char *basename = NULL;
+        int stop = 0, norelease = 0, verify = 0;
+        struct zpuino *zp;
+        int c, r;
+
+        while ((c=getopt(argc, argv, "d:sb:nV"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 's':
+                        stop = 1;
+                        break;
+                case 'b':
+                        basename = optarg;
+                        break;
+                case 'n':
+                        norelease = 1;
+                        break;
+                case 'V':
+                        verify = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (optind+2!=argc) {
+                usage(argv[0]);
+                return -1;
+        }
+        if (strcmp(argv[optind], "info")==0)
+                return snap_info(argv[optind+1])<0 ? -1 : 0;
+
+        if (strcmp(argv[optind], "save") && strcmp(argv[optind], "restore")) {
+                usage(argv[0]);
+                return -1;
+        }
+
+        zp = zpuino_open(devname);
+        if (zp==NULL) {
+                fprintf(stderr,"cannot open %s: %s\n", devname, strerror(errno));
+                return -1;
+        }
+        zpuino_setswap(zp, 1);
+
+        if (strcmp(argv[optind], "save")==0) {
+                if (stop && zpuino_reset(zp, 1)<0) {
+                        perror("reset");
+                        zpuino_close(zp);
+                        return -1;
+                }
+                r = snap_save(zp, argv[optind+1], basename);
+        } else {
+                if (zpuino_reset(zp, 1)<0) {
+                        perror("reset");
+                        zpuino_close(zp);
+                        return -1;
+                }
+                r = snap_restore(zp, argv[optind+1], verify);
+                if (r==0 && !norelease) {
+                        printf("Removing reset.\n");
+                        if (zpuino_reset(zp, 0)<0) {
+                                perror("reset");
+                                r = -1;
+                        }
+                }
+        }
+        zpuino_close(zp);
+        return r<0 ? -1 : 0;
+}
@@ -0,0 +1,235 @@
+/*  zpuinotlm.c - ZPUino telemetry stream reader
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "zpuinodrv.h"
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+#define DEFAULT_TSC_HZ   100000000.0 /* CLK_FREQ, board_minized.h */
+#define READ_RECORDS     256
+
+/*
+ * Reads the telemetry stream of a core and prints one line per event,
+ * in wall-clock time. With -b the records are copied out unconverted
+ * instead, and -i converts such a capture (or "cat zpuinodrv-tlm") later.
+ *
+ * TIMERTSC is 32 bits and wraps every 43s at 100MHz. It is extended to
+ * 64 bits using the drain timestamps, which are far more precise than
+ * that. An event cannot happen after it was drained, so the TSC to
+ * wall-clock offset is the smallest (drain time - TSC time) seen so far.
+ * The first events of a stream may therefore be placed up to one drain
+ * interval late, until a tighter sample comes in.
+ */
+struct tlm_clock {
+        int started;
+        double hz;
+        uint64_t tsc;           /* Extended TSC of the previous event */
+        uint64_t host_ns;       /* Drain time of the previous event */
+        int64_t offset_ns;      /* Wall clock minus TSC time */
+        uint64_t first_ns;      /* Wall clock of the first event */
+};
+
+static uint64_t tsc_ns(const struct tlm_clock *c, uint64_t tsc)
+{
+        return (uint64_t)(tsc * (1e9 / c->hz));
+}
+
+/* Wall-clock ns of an event */
+static uint64_t clock_event(struct tlm_clock *c, const struct zpu_tlm_record *r)
+{
+        uint32_t delta;
+        double expect;
+        int64_t wraps, offset;
+
+        if (!c->started) {
+                c->tsc = r->tsc;
+                c->offset_ns = r->host_ns - tsc_ns(c, r->tsc);
+                c->first_ns = r->host_ns;
+                c->started = 1;
+        } else {
+                /* Wraps that the drain times say must have happened */
+                delta = r->tsc - (uint32_t)c->tsc;
+                expect = (double)(int64_t)(r->host_ns - c->host_ns) * c->hz / 1e9;
+                wraps = llround((expect - delta) / 4294967296.0);
+                if (wraps < 0)
+                        wraps = 0;
+                c->tsc += delta + ((uint64_t)wraps << 32);
+        }
+        c->host_ns = r->host_ns;
+
+        offset = r->host_ns - tsc_ns(c, c->tsc);
+        if (offset < c->offset_ns)
+                c->offset_ns = offset;
+        return c->offset_ns + tsc_ns(c, c->tsc);
+}
+
+static void print_record(struct tlm_clock *c, const struct zpu_tlm_record *r)
+{
+        uint64_t ns;
+        time_t sec;
+        struct tm tm;
+        char date[32];
+
+        if (r->id==ZPU_TLM_ID_DROPPED) {
+                printf("-- dropped %u events\n", r->arg[0]);
+                return;
+        }
+        ns = clock_event(c, r);
+        sec = ns / 1000000000ULL;
+        localtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s.%09llu %+14.3f us  tsc %016llx  id %-10u %08x %08x\n",
+               date, (unsigned long long)(ns % 1000000000ULL),
+               ((int64_t)(ns - c->first_ns)) / 1e3,
+               (unsigned long long)c->tsc, r->id, r->arg[0], r->arg[1]);
+}
+
+static int tlm_setup(const char *devname, uint32_t base)
+{
+        int fd = open(devname, O_RDONLY);
+
+        if (fd<0) {
+                perror(devname);
+                return -1;
+        }
+        if (ioctl(fd, ZPU_IOCTL_TLM_SETUP, base)<0) {
+                fprintf(stderr,"Cannot set up telemetry ring at 0x%08x: %s\n", base, strerror(errno));
+                close(fd);
+                return -1;
+        }
+        close(fd);
+        return 0;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] [-a ring] [-f hz] [-n count] [-b]\n", name);
+        fprintf(stderr,"       %s [-f hz] -i capture\n", name);
+        fprintf(stderr,"  -d device   ZPUino device (default %s); the stream is read from <device>-tlm\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -a ring     Address of the telemetry ring header, if not set up yet\n");
+        fprintf(stderr,"              (the \"zpuinotlm\" global of a sketch built with zpuinotlm_rt.c)\n");
+        fprintf(stderr,"  -f hz       TSC frequency (default %.0f)\n", DEFAULT_TSC_HZ);
+        fprintf(stderr,"  -n count    Stop after count records\n");
+        fprintf(stderr,"  -b          Copy raw records to standard output\n");
+        fprintf(stderr,"  -i capture  Convert raw records from a file\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE;
+        const char *input = NULL;
+        struct zpu_tlm_record recs[READ_RECORDS];
+        struct tlm_clock clk;
+        char tlmname[256];
+        unsigned long count = 0, done = 0;
+        int raw = 0, have_base = 0, fd, c;
+        uint32_t base = 0;
+        ssize_t r, i, n;
+
+        memset(&clk, 0, sizeof(clk));
+        clk.hz = DEFAULT_TSC_HZ;
+
+        while ((c=getopt(argc, argv, "d:a:f:n:bi:"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 'a':
+                        base = strtoul(optarg, NULL, 0);
+                        have_base = 1;
+                        break;
+                case 'f':
+                        clk.hz = strtod(optarg, NULL);
+                        break;
+                case 'n':
+                        count = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        raw = 1;
+                        break;
+                case 'i':
+                        input = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (optind!=argc || clk.hz<=0 || (input && (raw || have_base))) {
+                usage(argv[0]);
+                return -1;
+        }
+
+        if (input) {
+                fd = open(input, O_RDONLY);
+                if (fd<0) {
+                        perror(input);
+                        return -1;
+                }
+        } else {
+                snprintf(tlmname, sizeof(tlmname), "%s-tlm", devname);
+                fd = open(tlmname, O_RDONLY);
+                if (fd<0) {
+                        perror(tlmname);
+                        return -1;
+                }
+                /* After opening, so that the drain starts with the stream */
+                if (have_base && tlm_setup(devname, base)<0) {
+                        close(fd);
+                        return -1;
+                }
+        }
+
+        while (count==0 || done<count) {
+                r = read(fd, recs, sizeof(recs));
+                if (r<0) {
+                        if (errno==EINTR)
+                                continue;
+                        perror("read");
+                        close(fd);
+                        return -1;
+                }
+                n = r / sizeof(recs[0]);
+                if (n==0)
+                        break;
+                if (count && done + n > count)
+                        n = count - done;
+                if (raw) {
+                        if (fwrite(recs, sizeof(recs[0]), n, stdout)!=(size_t)n)
+                                break;
+                } else {
+                        for (i=0; i<n; i++)
+                                print_record(&clk, &recs[i]);
+                }
+                fflush(stdout);
+                done += n;
+        }
+        close(fd);
+        return 0;
+}
@@ -0,0 +1,82 @@
+/*  zpuinotlm_rt.c - ZPUino telemetry, sketch side
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "register.h"
+#include "zpuinotlm_rt.h"
+
+#ifndef ZPUINOTLM_SLOTS
+#define ZPUINOTLM_SLOTS 64      /* A power of two, for free-running head/tail */
+#endif
+/*
+ * Whatever raises the host interrupt on this board, to have the ring
+ * drained right away. Without it the driver still polls every few ms.
+ */
+#ifndef ZPUINOTLM_RAISE
+#define ZPUINOTLM_RAISE() do { } while (0)
+#endif
+
+/* The host reads the ring through MACCESS; keep the compiler's stores in order */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+volatile struct {
+        struct zpuinotlm_header h;
+        struct zpuinotlm_event ev[ZPUINOTLM_SLOTS];
+} zpuinotlm;
+
+void zpuinotlm_start(void)
+{
+        zpuinotlm.h.magic = 0;
+        barrier();
+        zpuinotlm.h.slots = ZPUINOTLM_SLOTS;
+        zpuinotlm.h.head = 0;
+        zpuinotlm.h.tail = 0;
+        zpuinotlm.h.dropped = 0;
+        barrier();
+        zpuinotlm.h.magic = ZPUINOTLM_MAGIC;
+}
+
+int zpuinotlm_log(uint32_t id, uint32_t arg0, uint32_t arg1)
+{
+        volatile struct zpuinotlm_event *ev;
+        unsigned intr = INTRCTL;
+        uint32_t head;
+        int r = 0;
+
+        /* Interrupt handlers log too, and there is only one producer */
+        INTRCTL = 0;
+        head = zpuinotlm.h.head;
+        if (head - zpuinotlm.h.tail >= ZPUINOTLM_SLOTS) {
+                zpuinotlm.h.dropped++;
+                r = -1;
+        } else {
+                ev = &zpuinotlm.ev[head % ZPUINOTLM_SLOTS];
+                ev->tsc = TIMERTSC;
+                ev->id = id;
+                ev->arg[0] = arg0;
+                ev->arg[1] = arg1;
+                /* The slot must be complete before head says so */
+                barrier();
+                zpuinotlm.h.head = head + 1;
+        }
+        INTRCTL = intr;
+
+        if (r==0)
+                ZPUINOTLM_RAISE();
+        return r;
+}
@@ -0,0 +1,55 @@
+/*  zpuinotlm_rt.h - ZPUino telemetry, sketch side
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef __ZPUINOTLM_RT_H__
+#define __ZPUINOTLM_RT_H__
+
+#include <stdint.h>
+
+/*
+ * Built into the sketch along with zpuinotlm_rt.c. The ring is a global
+ * named ZPUINOTLM_SYMBOL laid out as struct zpu_tlm_header followed by
+ * its zpu_tlm_events (see zpuinodrv.h, which the ZPU toolchain cannot
+ * include). The sketch calls zpuinotlm_start() once, and the host is
+ * pointed at the ring with "zpuinotlm -a <address of zpuinotlm>".
+ *
+ * zpuinotlm_log() is the only producer and may be called from interrupt
+ * handlers too. It returns -1 and counts the event as dropped when the
+ * host has not drained the ring in time.
+ */
+#define ZPUINOTLM_MAGIC   0x544C4D52 /* ZPU_TLM_MAGIC */
+#define ZPUINOTLM_SYMBOL  "zpuinotlm"
+
+struct zpuinotlm_header {
+        uint32_t magic;         /* Written last by zpuinotlm_start() */
+        uint32_t slots;
+        uint32_t head;          /* ZPU */
+        uint32_t tail;          /* Host */
+        uint32_t dropped;       /* ZPU */
+};
+
+struct zpuinotlm_event {
+        uint32_t tsc;
+        uint32_t id;
+        uint32_t arg[2];
+};
+
+void zpuinotlm_start(void);
+int zpuinotlm_log(uint32_t id, uint32_t arg0, uint32_t arg1);
+
+#endif
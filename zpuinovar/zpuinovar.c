@@ -0,0 +1,374 @@
+/*  zpuinovar.c - Read and write variables of a running ZPUino sketch
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "zpuino.h"
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+#define MAX_VARS         256
+
+/*
+ * Variables are named by ELF symbol and located once; every batch after
+ * that is a single vectored transfer through the driver. The core is
+ * never put in reset, so the sketch keeps running throughout.
+ */
+struct batch {
+        char *line;             /* As given, to recognise a repeated batch */
+        char *names;            /* Tokenised copy the variable names point into */
+        struct zpuino_var vars[MAX_VARS];
+        unsigned nvars;
+        struct zpuino_varset vs;
+        int ready;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+        stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void batch_clear(struct batch *b)
+{
+        if (b->ready)
+                zpuino_varset_free(&b->vs);
+        free(b->line);
+        free(b->names);
+        b->line = NULL;
+        b->names = NULL;
+        b->nvars = 0;
+        b->ready = 0;
+}
+
+/* "var" reads, "var=value" writes. Takes over "line" */
+static int batch_parse(struct batch *b, const struct zpuino_symtab *tab, char *line)
+{
+        struct zpuino_var *v;
+        char *tok, *save = NULL, *eq, *end;
+
+        batch_clear(b);
+        if (line==NULL)
+                return -1;
+        b->line = line;
+        b->names = strdup(line);
+        if (b->names==NULL)
+                goto fail;
+
+        for (tok=strtok_r(b->names, " \t\r\n", &save); tok; tok=strtok_r(NULL, " \t\r\n", &save)) {
+                if (b->nvars==MAX_VARS) {
+                        fprintf(stderr,"Too many variables\n");
+                        goto fail;
+                }
+                v = &b->vars[b->nvars];
+                eq = strchr(tok, '=');
+                if (eq)
+                        *eq++ = '\0';
+                if (zpuino_var_parse(tab, tok, v)<0) {
+                        fprintf(stderr,"%s: %s\n", tok, errno==ENOENT ? "no such symbol" :
+                                errno==ERANGE ? "outside the object" : "bad variable");
+                        goto fail;
+                }
+                v->write = eq!=NULL;
+                if (eq) {
+                        v->value = strtoll(eq, &end, 0);
+                        if (*eq=='\0' || *end) {
+                                fprintf(stderr,"%s: bad value \"%s\"\n", tok, eq);
+                                goto fail;
+                        }
+                }
+                b->nvars++;
+        }
+        if (zpuino_varset_init(&b->vs, b->vars, b->nvars)<0) {
+                perror("zpuino_varset_init");
+                goto fail;
+        }
+        b->ready = 1;
+        return 0;
+fail:
+        batch_clear(b);
+        return -1;
+}
+
+static int32_t var_signed(const struct zpuino_var *v)
+{
+        unsigned bits = 32 - v->size*8;
+
+        return (int32_t)(v->value << bits) >> bits;
+}
+
+static void batch_print(const struct batch *b, int oneline, double t_ms)
+{
+        const struct zpuino_var *v;
+        unsigned i;
+
+        if (oneline)
+                printf("%12.3f", t_ms);
+        for (i=0; i<b->vs.nvars; i++) {
+                v = &b->vs.vars[i];
+                if (v->write)
+                        continue;
+                if (oneline)
+                        printf(" %d", var_signed(v));
+                else
+                        printf("%s = %d (0x%0*x)\n", v->name, var_signed(v), v->size*2, v->value);
+        }
+        if (oneline)
+                printf("\n");
+}
+
+static void list_symbols(const struct zpuino_symtab *tab)
+{
+        const struct zpuino_symbol *s;
+        unsigned i;
+
+        for (i=0; i<tab->nsyms; i++) {
+                s = &tab->syms[i];
+                if (s->type==ZPUINO_SYM_OBJECT)
+                        printf("%08x %6u %c %s\n", s->addr, s->size, s->global ? 'G' : 'L', s->name);
+        }
+}
+
+/*
+ * Runs the batch "count" times (0 for ever) at "hz", or back to back
+ * if hz is 0, then reports the rate achieved.
+ */
+static int run_periodic(struct zpuino *zp, struct batch *b, double hz, unsigned long count)
+{
+        uint64_t period = hz > 0 ? (uint64_t)(1e9 / hz) : 0;
+        uint64_t start, next, t0, t1, total = 0, worst = 0;
+        unsigned long done = 0, late = 0;
+        struct timespec ts;
+
+        start = next = now_ns();
+        while (!stop && (count==0 || done<count)) {
+                t0 = now_ns();
+                if (zpuino_varset_xfer(zp, &b->vs)<0) {
+                        perror("transfer");
+                        return -1;
+                }
+                t1 = now_ns();
+                total += t1 - t0;
+                if (t1 - t0 > worst)
+                        worst = t1 - t0;
+                done++;
+                batch_print(b, 1, (t0 - start) / 1e6);
+
+                if (period==0)
+                        continue;
+                next += period;
+                if (t1 > next) {
+                        /* Overran: drop the missed periods rather than bursting */
+                        late++;
+                        next = t1;
+                        continue;
+                }
+                ts.tv_sec = next / 1000000000ULL;
+                ts.tv_nsec = next % 1000000000ULL;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        fflush(stdout);
+        if (done) {
+                t1 = now_ns();
+                fprintf(stderr,"%lu transfers in %.3f s: %.1f Hz, %.1f us mean, %.1f us worst, %lu late\n",
+                        done, (t1 - start) / 1e9, done * 1e9 / (t1 - start),
+                        total / 1e3 / done, worst / 1e3, late);
+        }
+        return 0;
+}
+
+/* One batch per line; an unchanged line reuses the last layout */
+static int run_stdin(struct zpuino *zp, const struct zpuino_symtab *tab)
+{
+        struct batch b;
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+
+        memset(&b, 0, sizeof(b));
+        while (!stop && (len = getline(&line, &cap, stdin))>0) {
+                if (line[len-1]=='\n')
+                        line[--len] = '\0';
+                if (strspn(line, " \t\r")==(size_t)len)
+                        continue;
+                if (!b.ready || strcmp(b.line, line)!=0) {
+                        if (batch_parse(&b, tab, strdup(line))<0)
+                                continue;
+                }
+                if (zpuino_varset_xfer(zp, &b.vs)<0) {
+                        perror("transfer");
+                        continue;
+                }
+                batch_print(&b, 0, 0);
+                fflush(stdout);
+        }
+        batch_clear(&b);
+        free(line);
+        return 0;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] [-e sketch.elf] [-r hz] [-n count] var[=value] ...\n", name);
+        fprintf(stderr,"       %s [-d device] [-e sketch.elf] -i\n", name);
+        fprintf(stderr,"       %s -e sketch.elf -l\n", name);
+        fprintf(stderr,"  -d device   ZPUino device (default %s)\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -e elf      Sketch executable, for its symbol table\n");
+        fprintf(stderr,"  -r hz       Repeat the batch at this rate, one line per transfer\n");
+        fprintf(stderr,"  -n count    Stop after count transfers (default 1, or never with -r)\n");
+        fprintf(stderr,"  -i          Run one batch per line of standard input\n");
+        fprintf(stderr,"  -l          List the data symbols\n");
+        fprintf(stderr,"A variable is symbol[index][:size] or address[:size]. All variables of\n");
+        fprintf(stderr,"a batch are written, then read, in one transfer; the sketch keeps running.\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE, *elf = NULL;
+        struct zpuino_image img;
+        struct zpuino_symtab tab;
+        struct zpuino *zp;
+        struct batch b;
+        unsigned long count = 0;
+        int interactive = 0, list = 0, have_count = 0, ro, c, i, r;
+        size_t len;
+        char *line;
+        double hz = 0;
+
+        memset(&img, 0, sizeof(img));
+        memset(&tab, 0, sizeof(tab));
+        memset(&b, 0, sizeof(b));
+
+        while ((c=getopt(argc, argv, "d:e:r:n:il"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 'e':
+                        elf = optarg;
+                        break;
+                case 'r':
+                        hz = strtod(optarg, NULL);
+                        break;
+                case 'n':
+                        count = strtoul(optarg, NULL, 0);
+                        have_count = 1;
+                        break;
+                case 'i':
+                        interactive = 1;
+                        break;
+                case 'l':
+                        list = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (hz<0 || (list && !elf) || (!interactive && !list && optind==argc) ||
+            ((interactive || list) && optind!=argc)) {
+                usage(argv[0]);
+                return -1;
+        }
+        if (!have_count && hz==0)
+                count = 1;
+
+        if (elf) {
+                if (zpuino_image_read(elf, &img)<0 || img.format!=ZPUINO_IMAGE_ELF) {
+                        fprintf(stderr,"%s: %s\n", elf, img.format ? strerror(errno) :
+                                "not a ZPU ELF executable");
+                        return -1;
+                }
+                if (zpuino_symtab_read(&img, &tab)<0) {
+                        fprintf(stderr,"%s: %s\n", elf, errno==ENOENT ? "no symbol table" : strerror(errno));
+                        zpuino_image_free(&img);
+                        return -1;
+                }
+        }
+        if (list) {
+                list_symbols(&tab);
+                goto out;
+        }
+
+        if (!interactive) {
+                for (len=1, i=optind; i<argc; i++)
+                        len += strlen(argv[i]) + 1;
+                line = malloc(len);
+                if (line==NULL) {
+                        perror("malloc");
+                        goto out;
+                }
+                for (*line='\0', i=optind; i<argc; i++) {
+                        strcat(line, argv[i]);
+                        strcat(line, " ");
+                }
+                if (batch_parse(&b, &tab, line)<0)
+                        goto out;
+        }
+
+        /* A batch that only reads does not need, or take, the core's writer slot */
+        ro = !interactive;
+        for (i=0; ro && i<(int)b.nvars; i++)
+                if (b.vars[i].write)
+                        ro = 0;
+        zp = ro ? zpuino_open_ro(devname) : zpuino_open(devname);
+        if (zp==NULL) {
+                fprintf(stderr,"Cannot open %s: %s\n", devname, strerror(errno));
+                goto out;
+        }
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+
+        if (interactive)
+                r = run_stdin(zp, &tab);
+        else if (hz>0 || count!=1)
+                r = run_periodic(zp, &b, hz, count);
+        else {
+                r = zpuino_varset_xfer(zp, &b.vs);
+                if (r<0)
+                        perror("transfer");
+                else
+                        batch_print(&b, 0, 0);
+        }
+        zpuino_close(zp);
+        batch_clear(&b);
+        zpuino_symtab_free(&tab);
+        zpuino_image_free(&img);
+        return r;
+out:
+        batch_clear(&b);
+        zpuino_symtab_free(&tab);
+        zpuino_image_free(&img);
+        return list ? 0 : -1;
+}
@@ -0,0 +1,274 @@
+/*  zpuinowatch.c - Watch ZPUino memory for changes
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "zpuinodrv.h"
+#include "zpuino.h"
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+#define DEFAULT_HZ       10000
+#define READ_RECORDS     1024
+
+/*
+ * The driver samples the ranges on its own timer and only hands over
+ * the words that changed, so nothing between two samples is lost to
+ * this program being slow, only to the sampling rate. The last value
+ * of every word is kept here to print changes as old -> new.
+ */
+struct watch_range {
+        const char *name;       /* Symbol it was given as, if any */
+        uint32_t offset;
+        uint32_t len;
+        uint32_t *last;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+        stop = 1;
+}
+
+/* symbol[+len] or address[+len], rounded out to whole words */
+static int parse_range(const struct zpuino_symtab *tab, char *spec, struct watch_range *r)
+{
+        const struct zpuino_symbol *sym = NULL;
+        char *plus = strchr(spec, '+'), *end;
+        uint32_t addr, len = 4;
+
+        if (plus)
+                *plus++ = '\0';
+        if (spec[0]>='0' && spec[0]<='9') {
+                addr = strtoul(spec, &end, 0);
+                if (*end)
+                        return -1;
+        } else {
+                sym = zpuino_symbol_lookup(tab, spec);
+                if (sym==NULL) {
+                        fprintf(stderr,"%s: no such symbol\n", spec);
+                        return -1;
+                }
+                addr = sym->addr;
+                if (sym->size)
+                        len = sym->size;
+        }
+        if (plus) {
+                len = strtoul(plus, &end, 0);
+                if (*end || len==0)
+                        return -1;
+        }
+        r->name = sym ? sym->name : NULL;
+        r->offset = addr & ~3;
+        r->len = (addr + len - r->offset + 3) & ~3;
+        r->last = calloc(r->len>>2, sizeof(uint32_t));
+        return r->last ? 0 : -1;
+}
+
+static void print_record(struct watch_range *ranges, unsigned nranges,
+                         const struct zpu_watch_record *rec, uint64_t start)
+{
+        struct watch_range *r;
+        uint32_t *last;
+        unsigned i;
+        char where[300];
+
+        if (rec->offset==ZPU_WATCH_DROPPED) {
+                printf("-- dropped %u changes\n", rec->value);
+                return;
+        }
+        for (i=0; i<nranges; i++) {
+                r = &ranges[i];
+                if (rec->offset >= r->offset && rec->offset - r->offset < r->len)
+                        break;
+        }
+        if (i==nranges)
+                return;
+
+        last = &r->last[(rec->offset - r->offset)>>2];
+        if (r->name)
+                snprintf(where, sizeof(where), "%s+0x%x", r->name, rec->offset - r->offset);
+        else
+                where[0] = '\0';
+        printf("%14.3f us  %08x  %08x -> %08x  %s\n", (rec->ns - start) / 1e3,
+               rec->offset, *last, rec->value, where);
+        *last = rec->value;
+}
+
+static void print_stats(int fd, uint64_t period_ns)
+{
+        struct zpu_watch_stats st;
+        double secs;
+
+        if (ioctl(fd, ZPU_IOCTL_WATCH_STATS, &st)<0) {
+                perror("ZPU_IOCTL_WATCH_STATS");
+                return;
+        }
+        if (st.samples==0)
+                return;
+        secs = st.elapsed_ns / 1e9;
+        fprintf(stderr,"%llu samples in %.3f s: %.1f Hz of %.1f Hz requested, %llu periods missed\n",
+                (unsigned long long)st.samples, secs, st.samples / secs, 1e9 / period_ns,
+                (unsigned long long)st.missed);
+        fprintf(stderr,"%.2f us per sample, so at most %.1f Hz; %llu changes, %llu dropped\n",
+                st.busy_ns / 1e3 / st.samples, st.samples * 1e9 / st.busy_ns,
+                (unsigned long long)st.changes, (unsigned long long)st.dropped);
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] [-e sketch.elf] [-f hz] [-t seconds] [-b] range ...\n", name);
+        fprintf(stderr,"  -d device   ZPUino device (default %s); sampled through <device>-watch\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -e elf      Sketch executable, to give ranges by symbol\n");
+        fprintf(stderr,"  -f hz       Sample rate (default %d)\n", DEFAULT_HZ);
+        fprintf(stderr,"  -t seconds  Stop after this long\n");
+        fprintf(stderr,"  -b          Copy raw records to standard output\n");
+        fprintf(stderr,"A range is symbol[+len] or address[+len]; up to %d ranges, %d words.\n",
+                ZPU_WATCH_RANGES, ZPU_WATCH_WORDS);
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE, *elf = NULL;
+        struct watch_range ranges[ZPU_WATCH_RANGES];
+        struct zpu_watch_record recs[READ_RECORDS];
+        struct zpuino_image img;
+        struct zpuino_symtab tab;
+        struct zpu_watch watch;
+        struct pollfd pfd;
+        char watchname[256];
+        double hz = DEFAULT_HZ, seconds = 0;
+        uint64_t start = 0;
+        time_t deadline = 0;
+        unsigned nranges = 0, i;
+        int raw = 0, fd, c, ret = -1;
+        ssize_t r, n;
+
+        memset(&img, 0, sizeof(img));
+        memset(&tab, 0, sizeof(tab));
+        memset(&watch, 0, sizeof(watch));
+
+        while ((c=getopt(argc, argv, "d:e:f:t:b"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 'e':
+                        elf = optarg;
+                        break;
+                case 'f':
+                        hz = strtod(optarg, NULL);
+                        break;
+                case 't':
+                        seconds = strtod(optarg, NULL);
+                        break;
+                case 'b':
+                        raw = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (optind==argc || argc - optind > ZPU_WATCH_RANGES || hz<=0 ||
+            1e9 / hz < ZPU_WATCH_MIN_PERIOD) {
+                usage(argv[0]);
+                return -1;
+        }
+
+        if (elf) {
+                if (zpuino_image_read(elf, &img)<0 || zpuino_symtab_read(&img, &tab)<0) {
+                        fprintf(stderr,"%s: %s\n", elf, errno==ENOENT ? "no symbol table" : strerror(errno));
+                        goto out;
+                }
+        }
+        for (i=optind; i<(unsigned)argc; i++, nranges++) {
+                if (parse_range(&tab, argv[i], &ranges[nranges])<0) {
+                        fprintf(stderr,"Bad range \"%s\"\n", argv[i]);
+                        goto out;
+                }
+                watch.range[nranges].offset = ranges[nranges].offset;
+                watch.range[nranges].len = ranges[nranges].len;
+        }
+        watch.count = nranges;
+        watch.period_ns = (uint64_t)(1e9 / hz);
+
+        snprintf(watchname, sizeof(watchname), "%s-watch", devname);
+        fd = open(watchname, O_RDONLY);
+        if (fd<0) {
+                perror(watchname);
+                goto out;
+        }
+        if (ioctl(fd, ZPU_IOCTL_WATCH_SETUP, &watch)<0) {
+                fprintf(stderr,"Cannot start watching: %s\n", strerror(errno));
+                close(fd);
+                goto out;
+        }
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        if (seconds > 0)
+                deadline = time(NULL) + (time_t)(seconds + 0.5);
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (!stop && (!deadline || time(NULL) < deadline)) {
+                /* Wake up now and then to notice the deadline */
+                if (poll(&pfd, 1, 200)<=0)
+                        continue;
+                r = read(fd, recs, sizeof(recs));
+                if (r<0) {
+                        if (errno==EINTR || errno==EAGAIN)
+                                continue;
+                        perror("read");
+                        break;
+                }
+                n = r / sizeof(recs[0]);
+                if (raw) {
+                        if (fwrite(recs, sizeof(recs[0]), n, stdout)!=(size_t)n)
+                                break;
+                        continue;
+                }
+                for (i=0; i<n; i++) {
+                        if (start==0)
+                                start = recs[i].ns;
+                        print_record(ranges, nranges, &recs[i], start);
+                }
+                fflush(stdout);
+        }
+        fflush(stdout);
+        print_stats(fd, watch.period_ns);
+        close(fd);
+        ret = 0;
+out:
+        for (i=0; i<nranges; i++)
+                free(ranges[i].last);
+        zpuino_symtab_free(&tab);
+        zpuino_image_free(&img);
+        return ret;
+}
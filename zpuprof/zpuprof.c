@@ -0,0 +1,447 @@
+/*  zpuprof.c - Statistical profiler for ZPUino sketches
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "zpuino.h"
+#include "zpuprof.h"
+
+#define DEFAULT_DEVICE   "/dev/zpuinodrv"
+#define DEFAULT_SECONDS  5.0
+#define DEFAULT_TOP      25
+#define CAL_SLOTS        32     /* pc_slot values tried by -c */
+#define CAL_SECONDS      0.2
+
+#define FIELD(p, f) ((p)->addr + offsetof(struct zpuprof_header, f))
+
+/*
+ * The sketch's zpuprof_rt.c samples into its "zpuprof" global; this end
+ * points the histogram at the sketch's code, clears it, enables it for
+ * a while and reads it back, all through memory while the ZPU runs.
+ * Buckets and arcs are then attributed to the functions of the ELF.
+ */
+struct prof {
+        struct zpuino *zp;
+        const struct zpuino_symtab *tab;
+        uint32_t addr;
+        struct zpuprof_header h;
+        uint32_t *hist;
+        struct zpuprof_arc *arcs;
+};
+
+struct fcount {
+        int func;               /* Symbol index, or -1 */
+        uint32_t count;
+};
+
+struct arc_count {
+        int caller, callee;
+        uint32_t count;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+        stop = 1;
+}
+
+static void sleep_for(double seconds)
+{
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)seconds;
+        ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+        while (!stop && nanosleep(&ts, &ts)<0 && errno==EINTR)
+                ;
+}
+
+static int put_word(struct prof *p, uint32_t addr, uint32_t value)
+{
+        return zpuino_pwrite(p->zp, &value, 4, addr)==4 ? 0 : -1;
+}
+
+static int read_header(struct prof *p)
+{
+        if (zpuino_pread(p->zp, &p->h, sizeof(p->h), p->addr)!=sizeof(p->h))
+                return -1;
+        if (p->h.magic!=ZPUPROF_MAGIC) {
+                errno = ENODATA;
+                return -1;
+        }
+        if (p->h.buckets==0 || p->h.buckets > 65536 || p->h.arcs==0 ||
+            (p->h.arcs & (p->h.arcs-1)) || p->h.hz==0 ||
+            (uint64_t)p->addr + sizeof(p->h) + p->h.buckets*4ULL +
+            p->h.arcs*sizeof(struct zpuprof_arc) > zpuino_memsize(p->zp)) {
+                errno = EPROTO;
+                return -1;
+        }
+        return 0;
+}
+
+/* Code is whatever the function symbols cover */
+static int text_range(const struct zpuino_symtab *tab, uint32_t *lo, uint32_t *hi)
+{
+        unsigned i;
+
+        *lo = 0xFFFFFFFF;
+        *hi = 0;
+        for (i=0; i<tab->nsyms; i++) {
+                if (tab->syms[i].type!=ZPUINO_SYM_FUNC)
+                        continue;
+                if (tab->syms[i].addr < *lo)
+                        *lo = tab->syms[i].addr;
+                if (tab->syms[i].addr + tab->syms[i].size > *hi)
+                        *hi = tab->syms[i].addr + tab->syms[i].size;
+        }
+        return *hi > *lo ? 0 : -1;
+}
+
+/* Disable, clear, point at the code, enable; then the reverse */
+static int profile(struct prof *p, double seconds, uint32_t pc_slot)
+{
+        size_t len = p->h.buckets*4 + p->h.arcs*sizeof(struct zpuprof_arc);
+        useconds_t settle = 2000000 / p->h.hz + 1;
+        uint32_t lo, hi, shift;
+
+        if (text_range(p->tab, &lo, &hi)<0) {
+                errno = ENOENT;
+                return -1;
+        }
+        for (shift=0; ((hi - lo) >> shift) >= p->h.buckets; shift++)
+                ;
+
+        if (put_word(p, FIELD(p, enable), 0)<0)
+                return -1;
+        /* Let an interrupt already past the check finish */
+        usleep(settle);
+
+        if (zpuino_memset(p->zp, FIELD(p, samples), 3*4, 0)<0 ||
+            zpuino_memset(p->zp, p->addr + sizeof(p->h), len, 0)<0 ||
+            put_word(p, FIELD(p, base), lo)<0 ||
+            put_word(p, FIELD(p, shift), shift)<0 ||
+            put_word(p, FIELD(p, pc_slot), pc_slot)<0 ||
+            put_word(p, FIELD(p, enable), 1)<0)
+                return -1;
+
+        sleep_for(seconds);
+
+        if (put_word(p, FIELD(p, enable), 0)<0)
+                return -1;
+        usleep(settle);
+
+        if (read_header(p)<0 ||
+            zpuino_pread(p->zp, p->hist, len, p->addr + sizeof(p->h))!=(ssize_t)len)
+                return -1;
+        return 0;
+}
+
+static int func_of(const struct prof *p, uint32_t bucket)
+{
+        const struct zpuino_symbol *s;
+
+        s = zpuino_symbol_find(p->tab, p->h.base + (bucket << p->h.shift), ZPUINO_SYM_FUNC);
+        return s ? (int)(s - p->tab->syms) : -1;
+}
+
+static const char *func_name(const struct prof *p, int func)
+{
+        return func<0 ? "[unknown]" : p->tab->syms[func].name;
+}
+
+static int fcount_compare(const void *a, const void *b)
+{
+        const struct fcount *x = a, *y = b;
+
+        return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int arc_compare(const void *a, const void *b)
+{
+        const struct arc_count *x = a, *y = b;
+
+        return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/* Per function: index nsyms holds samples outside any function */
+static struct fcount *flat_counts(const struct prof *p)
+{
+        unsigned n = p->tab->nsyms, b;
+        struct fcount *fc = calloc(n + 1, sizeof(*fc));
+        int f;
+
+        if (fc==NULL)
+                return NULL;
+        for (b=0; b<=n; b++)
+                fc[b].func = b<n ? (int)b : -1;
+        for (b=0; b<p->h.buckets; b++) {
+                if (p->hist[b]==0)
+                        continue;
+                f = func_of(p, b);
+                fc[f<0 ? n : (unsigned)f].count += p->hist[b];
+        }
+        qsort(fc, n + 1, sizeof(*fc), fcount_compare);
+        return fc;
+}
+
+/* Arcs between functions, merging the bucket pairs that map to each */
+static struct arc_count *arc_counts(const struct prof *p, unsigned *count)
+{
+        struct arc_count *ac = calloc(p->h.arcs, sizeof(*ac));
+        const struct zpuprof_arc *a;
+        unsigned i, j, n = 0;
+        int caller, callee;
+
+        if (ac==NULL)
+                return NULL;
+        for (i=0; i<p->h.arcs; i++) {
+                a = &p->arcs[i];
+                if (a->count==0 || (a->arc>>16) >= p->h.buckets || (a->arc&0xFFFF) >= p->h.buckets)
+                        continue;
+                caller = func_of(p, a->arc>>16);
+                callee = func_of(p, a->arc&0xFFFF);
+                /* Scanning found a return address into the function itself */
+                if (caller==callee)
+                        continue;
+                for (j=0; j<n; j++) {
+                        if (ac[j].caller==caller && ac[j].callee==callee)
+                                break;
+                }
+                if (j==n) {
+                        ac[n].caller = caller;
+                        ac[n].callee = callee;
+                        n++;
+                }
+                ac[j].count += a->count;
+        }
+        qsort(ac, n, sizeof(*ac), arc_compare);
+        *count = n;
+        return ac;
+}
+
+static void report(const struct prof *p, unsigned top, int graph)
+{
+        const uint32_t samples = p->h.samples, inside = samples - p->h.outside;
+        struct fcount *fc = flat_counts(p);
+        struct arc_count *ac = NULL;
+        unsigned i, j, narcs = 0;
+
+        if (fc==NULL)
+                return;
+        printf("%u samples at %u Hz (%.2f s), %u (%.1f%%) outside the code",
+               samples, p->h.hz, (double)samples / p->h.hz, p->h.outside, samples ? 100.0 * p->h.outside / samples : 0);
+        printf(", %u bytes per bucket\n\n", 1U << p->h.shift);
+        if (inside==0) {
+                printf("Nothing sampled in the code: is zpuprof_interrupt() being called, and pc_slot right (-c)?\n");
+                free(fc);
+                return;
+        }
+
+        printf("   %%self   samples  function\n");
+        for (i=0; i<=p->tab->nsyms && i<top && fc[i].count; i++)
+                printf("%7.2f%% %9u  %s\n", 100.0 * fc[i].count / inside, fc[i].count,
+                       func_name(p, fc[i].func));
+
+        if (graph)
+                ac = arc_counts(p, &narcs);
+        if (ac==NULL) {
+                free(fc);
+                return;
+        }
+
+        /*
+         * Arcs only go one level up: samples in a function, by the caller
+         * found on the stack. A function's callees are the samples taken
+         * in functions it called directly.
+         */
+        printf("\nCall arcs, one level (%u arcs lost)\n", p->h.arcs_lost);
+        for (i=0; i<=p->tab->nsyms && i<top && fc[i].count; i++) {
+                printf("\n%7.2f%%  %s\n", 100.0 * fc[i].count / inside, func_name(p, fc[i].func));
+                for (j=0; j<narcs; j++) {
+                        if (ac[j].callee==fc[i].func)
+                                printf("           <- %-32s %9u\n", func_name(p, ac[j].caller), ac[j].count);
+                }
+                for (j=0; j<narcs; j++) {
+                        if (ac[j].caller==fc[i].func)
+                                printf("           -> %-32s %9u\n", func_name(p, ac[j].callee), ac[j].count);
+                }
+        }
+        free(ac);
+        free(fc);
+}
+
+/*
+ * Tries every pc_slot for a moment. The right one lands samples all
+ * over the code; wrong ones mostly miss it, or keep hitting the same
+ * return address of the interrupt path.
+ */
+static int calibrate(struct prof *p, uint32_t *best)
+{
+        uint32_t slot, b, spread, best_spread = 0;
+        double inside;
+
+        printf("slot  inside  buckets\n");
+        for (slot=0; slot<CAL_SLOTS && !stop; slot++) {
+                if (profile(p, CAL_SECONDS, slot)<0)
+                        return -1;
+                for (spread=0, b=0; b<p->h.buckets; b++)
+                        spread += p->hist[b]!=0;
+                inside = p->h.samples ? 100.0 * (p->h.samples - p->h.outside) / p->h.samples : 0;
+                printf("%4u  %5.1f%%  %7u\n", slot, inside, spread);
+                if (inside >= 50 && spread > best_spread) {
+                        best_spread = spread;
+                        *best = slot;
+                }
+        }
+        if (best_spread==0) {
+                errno = ENOENT;
+                return -1;
+        }
+        return put_word(p, FIELD(p, pc_slot), *best);
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr,"Usage: %s [-d device] -e sketch.elf [-t seconds] [-n top] [-g] [-s slot]\n", name);
+        fprintf(stderr,"       %s [-d device] -e sketch.elf -c\n", name);
+        fprintf(stderr,"  -d device   ZPUino device (default %s)\n", DEFAULT_DEVICE);
+        fprintf(stderr,"  -e elf      The running sketch, built with zpuprof_rt.c\n");
+        fprintf(stderr,"  -t seconds  Profile for this long (default %.0f), or until interrupted\n", DEFAULT_SECONDS);
+        fprintf(stderr,"  -n top      Functions to report (default %d)\n", DEFAULT_TOP);
+        fprintf(stderr,"  -g          Add callers and callees of each function\n");
+        fprintf(stderr,"  -s slot     Where the interrupted PC is, in words above the handler frame\n");
+        fprintf(stderr,"  -c          Find the slot, and keep it in the sketch for later runs\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *devname = DEFAULT_DEVICE, *elf = NULL;
+        const struct zpuino_symbol *sym;
+        struct zpuino_image img;
+        struct zpuino_symtab tab;
+        struct prof p;
+        double seconds = DEFAULT_SECONDS;
+        unsigned top = DEFAULT_TOP;
+        int graph = 0, cal = 0, have_slot = 0, c, ret = -1;
+        uint32_t slot = 0;
+
+        memset(&img, 0, sizeof(img));
+        memset(&tab, 0, sizeof(tab));
+        memset(&p, 0, sizeof(p));
+
+        while ((c=getopt(argc, argv, "d:e:t:n:gs:c"))!=-1) {
+                switch (c) {
+                case 'd':
+                        devname = optarg;
+                        break;
+                case 'e':
+                        elf = optarg;
+                        break;
+                case 't':
+                        seconds = strtod(optarg, NULL);
+                        break;
+                case 'n':
+                        top = strtoul(optarg, NULL, 0);
+                        break;
+                case 'g':
+                        graph = 1;
+                        break;
+                case 's':
+                        slot = strtoul(optarg, NULL, 0);
+                        have_slot = 1;
+                        break;
+                case 'c':
+                        cal = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return -1;
+                }
+        }
+        if (elf==NULL || optind!=argc || seconds<=0 || (cal && have_slot)) {
+                usage(argv[0]);
+                return -1;
+        }
+
+        if (zpuino_image_read(elf, &img)<0 || zpuino_symtab_read(&img, &tab)<0) {
+                fprintf(stderr,"%s: %s\n", elf, errno==ENOENT ? "no symbol table" : strerror(errno));
+                goto out;
+        }
+        sym = zpuino_symbol_lookup(&tab, ZPUPROF_SYMBOL);
+        if (sym==NULL || sym->type!=ZPUINO_SYM_OBJECT) {
+                fprintf(stderr,"%s: no \"%s\"; build the sketch with zpuprof_rt.c\n", elf, ZPUPROF_SYMBOL);
+                goto out;
+        }
+        p.tab = &tab;
+        p.addr = sym->addr;
+
+        p.zp = zpuino_open(devname);
+        if (p.zp==NULL) {
+                fprintf(stderr,"Cannot open %s: %s\n", devname, strerror(errno));
+                goto out;
+        }
+        if (read_header(&p)<0) {
+                fprintf(stderr,"%s: %s\n", ZPUPROF_SYMBOL, errno==ENODATA ?
+                        "zpuprof_start() has not run, or a different sketch is loaded" :
+                        errno==EPROTO ? "bad header" : strerror(errno));
+                goto out_close;
+        }
+        p.hist = malloc(p.h.buckets*4 + p.h.arcs*sizeof(struct zpuprof_arc));
+        if (p.hist==NULL) {
+                perror("malloc");
+                goto out_close;
+        }
+        p.arcs = (struct zpuprof_arc*)(p.hist + p.h.buckets);
+        if (!have_slot)
+                slot = p.h.pc_slot;
+
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+
+        if (cal) {
+                if (calibrate(&p, &slot)<0)
+                        fprintf(stderr,"Calibration failed: %s\n", errno==ENOENT ?
+                                "no slot samples the code" : strerror(errno));
+                else {
+                        printf("Using slot %u\n", slot);
+                        ret = 0;
+                }
+        } else if (profile(&p, seconds, slot)<0) {
+                fprintf(stderr,"Profiling failed: %s\n", errno==ENOENT ?
+                        "no functions in the symbol table" : strerror(errno));
+        } else {
+                report(&p, top, graph);
+                ret = 0;
+        }
+        free(p.hist);
+out_close:
+        zpuino_close(p.zp);
+out:
+        zpuino_symtab_free(&tab);
+        zpuino_image_free(&img);
+        return ret;
+}
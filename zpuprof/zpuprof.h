@@ -0,0 +1,60 @@
+/*  zpuprof.h - ZPUino profiler layout, shared by the sketch runtime and the host
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef __ZPUPROF_H__
+#define __ZPUPROF_H__
+
+#include <stdint.h>
+
+/*
+ * The sketch runtime keeps a global named ZPUPROF_SYMBOL: this header,
+ * then "buckets" 32-bit PC counters, then "arcs" zpuprof_arcs. The host
+ * finds it through the ELF symbol table and drives it through memory
+ * alone, so the ZPU never stops.
+ *
+ * While "enable" is 1, every TMR1 interrupt takes the interrupted PC
+ * from the word "pc_slot" words above the interrupt handler's frame and
+ * counts it in bucket (pc - base) >> shift. The nearest word above that
+ * one which also falls in the histogram is taken for the return address
+ * of the interrupted function, and the (caller, callee) bucket pair is
+ * counted in the arc table. The host sets base, shift and pc_slot and
+ * clears the counters with profiling disabled, then enables it.
+ */
+#define ZPUPROF_MAGIC   0x50524F46 /* "PROF" */
+#define ZPUPROF_SYMBOL  "zpuprof"
+
+struct zpuprof_header {
+        uint32_t magic;         /* Written last by zpuprof_start() */
+        uint32_t buckets;
+        uint32_t arcs;          /* A power of two */
+        uint32_t hz;            /* Sample rate the timer was set to */
+        uint32_t enable;        /* Host */
+        uint32_t base;          /* Host: address of bucket 0 */
+        uint32_t shift;         /* Host: log2 of bytes per bucket */
+        uint32_t pc_slot;       /* Host, defaults to ZPUPROF_PC_SLOT */
+        uint32_t samples;       /* Interrupts while enabled */
+        uint32_t outside;       /* ...whose PC fell outside the histogram */
+        uint32_t arcs_lost;     /* Arcs that found the table full */
+};
+
+struct zpuprof_arc {
+        uint32_t arc;           /* Caller bucket << 16 | callee bucket */
+        uint32_t count;         /* 0 for a free slot */
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*  zpuprof_rt.c - ZPUino profiler, sketch side
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "register.h"
+#include "zpuprof.h"
+#include "zpuprof_rt.h"
+
+#ifndef ZPUPROF_BUCKETS
+#define ZPUPROF_BUCKETS 2048
+#endif
+#ifndef ZPUPROF_ARCS
+#define ZPUPROF_ARCS    256     /* A power of two */
+#endif
+#ifndef ZPUPROF_SCAN
+#define ZPUPROF_SCAN    16      /* Stack words searched for a return address */
+#endif
+/*
+ * Words from zpuprof_interrupt()'s frame up to the PC the ZPU pushed
+ * when it took the interrupt. It depends on the core's interrupt entry
+ * and the compiler; "zpuprof -c" finds it for a running sketch.
+ */
+#ifndef ZPUPROF_PC_SLOT
+#define ZPUPROF_PC_SLOT 4
+#endif
+#define ZPUPROF_MAX_SLOT 64     /* Keeps a bad pc_slot away from IO space */
+#define ZPUPROF_TIMER_MAX 65536 /* TMR1 is 16 bits */
+
+struct {
+        struct zpuprof_header h;
+        uint32_t hist[ZPUPROF_BUCKETS];
+        struct zpuprof_arc arc[ZPUPROF_ARCS];
+} zpuprof;
+
+static const unsigned prescalers[8] = { 1, 2, 4, 8, 16, 64, 256, 1024 };
+
+int zpuprof_start(unsigned hz)
+{
+        unsigned i, count = 0;
+
+        for (i=0; hz && i<8; i++) {
+                count = CLK_FREQ / prescalers[i] / hz;
+                if (count <= ZPUPROF_TIMER_MAX)
+                        break;
+        }
+        if (hz==0 || i==8 || count==0)
+                return -1;
+
+        zpuprof.h.enable = 0;
+        zpuprof.h.buckets = ZPUPROF_BUCKETS;
+        zpuprof.h.arcs = ZPUPROF_ARCS;
+        zpuprof.h.hz = CLK_FREQ / prescalers[i] / count;
+        zpuprof.h.pc_slot = ZPUPROF_PC_SLOT;
+        zpuprof.h.magic = ZPUPROF_MAGIC;
+
+        TMR1CTL = 0;
+        TMR1CNT = 0;
+        TMR1CMP = count - 1;
+        TMR1CTL = BIT(TCTLENA) | BIT(TCTLCCM) | BIT(TCTLDIR) | BIT(TCTLIEN) | (i<<TCTLCP0);
+        INTRMASK |= BIT(INTRLINE_TIMER1);
+        INTRCTL = 1;
+        return 0;
+}
+
+void zpuprof_stop(void)
+{
+        TMR1CTL = 0;
+        INTRMASK &= ~BIT(INTRLINE_TIMER1);
+        zpuprof.h.magic = 0;
+}
+
+static inline int in_histogram(uint32_t addr, uint32_t *bucket)
+{
+        *bucket = (addr - zpuprof.h.base) >> zpuprof.h.shift;
+        return addr >= zpuprof.h.base && *bucket < ZPUPROF_BUCKETS;
+}
+
+static void count_arc(uint32_t arc)
+{
+        struct zpuprof_arc *a;
+        unsigned i, n = (arc ^ (arc >> 16) ^ (arc >> 7)) & (ZPUPROF_ARCS-1);
+
+        for (i=0; i<ZPUPROF_ARCS; i++, n=(n+1) & (ZPUPROF_ARCS-1)) {
+                a = &zpuprof.arc[n];
+                if (a->count==0) {
+                        a->arc = arc;
+                        a->count = 1;
+                        return;
+                }
+                if (a->arc==arc) {
+                        a->count++;
+                        return;
+                }
+        }
+        zpuprof.h.arcs_lost++;
+}
+
+void zpuprof_sample(const uint32_t *pc)
+{
+        const uint32_t *top = (const uint32_t*)BOARD_MEMORYSIZE;
+        uint32_t callee, caller;
+        unsigned i;
+
+        if (zpuprof.h.enable!=1)
+                return;
+        zpuprof.h.samples++;
+
+        if (pc >= top || !in_histogram(*pc, &callee)) {
+                zpuprof.h.outside++;
+                return;
+        }
+        zpuprof.hist[callee]++;
+
+        for (i=1; i<=ZPUPROF_SCAN && pc + i < top; i++) {
+                if (in_histogram(pc[i], &caller)) {
+                        count_arc((caller << 16) | callee);
+                        break;
+                }
+        }
+}
+
+void zpuprof_interrupt(void)
+{
+        if (!(TMR1CTL & BIT(TCTLIF)))
+                return;
+        TMR1CTL &= ~BIT(TCTLIF);
+        if (zpuprof.h.pc_slot > ZPUPROF_MAX_SLOT)
+                return;
+        zpuprof_sample((const uint32_t*)__builtin_frame_address(0) + zpuprof.h.pc_slot);
+}
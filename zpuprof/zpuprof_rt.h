@@ -0,0 +1,37 @@
+/*  zpuprof_rt.h - ZPUino profiler, sketch side
+
+* Copyright (C) 2018 Alvaro Lopes
+*
+*   This program is free software; you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation; either version 2 of the License, or
+*   (at your option) any later version.
+
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License along
+*   with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef __ZPUPROF_RT_H__
+#define __ZPUPROF_RT_H__
+
+#include <stdint.h>
+
+/*
+ * Built into the sketch along with zpuprof_rt.c. The sketch calls
+ * zpuprof_start() once, and zpuprof_interrupt() first thing in its
+ * _zpu_interrupt(); sampling then costs nothing until the host enables
+ * it. TMR1 is taken over for the sample clock.
+ */
+int zpuprof_start(unsigned hz);
+void zpuprof_stop(void);
+void zpuprof_interrupt(void);
+
+/* For interrupt entries that know where the interrupted PC was pushed */
+void zpuprof_sample(const uint32_t *pc);
+
+#endif